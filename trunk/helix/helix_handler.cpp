@@ -26,6 +26,7 @@ THE SOFTWARE.
 #include <sstream>
 #include <string>
 #include <iomanip>
+#include <iterator>
 #include <time.h>
 #include "xplat_hash_map.hpp"
 #include <boost/lexical_cast.hpp>
@@ -43,10 +44,28 @@ THE SOFTWARE.
 #include "header.hpp"
 #include "helix_handler.hpp"
 #include "natcheck.hpp"
+#include "state_segment.hpp"
+#include "swarm_index.hpp"
+#include "checkpoint_loader.hpp"
+#include "replication.hpp"
 #include "control.hpp"
+#include "slab.hpp"
 
 // the number of minutes between checkpoints
 int checkpoint_timer = 5;
+// the journal of peer changes between checkpoints. Empty disables it
+std::string journal_filename;
+// the number of milliseconds between journal commits
+int journal_commit_ms = 100;
+// the shared memory segment holding a full image of the tracker
+// state. Empty disables it
+std::string state_segment_name;
+// the port to accept replication followers on. Empty disables it
+std::string replication_port;
+// the milliseconds between batches of changes sent to followers
+int replication_batch_ms = 20;
+// host:port of the primary to follow. Empty means we're the primary
+std::string replicate_from;
 
 namespace http {
 namespace server {
@@ -60,22 +79,34 @@ uint64 saved_num_peers;
 std::string saved_cpu_percent;
 
 uint64_t total_requests, prev_total_requests;
-hash_map<std::string, Swarm*> swarms;
+uint64_t total_announces, total_scrapes, prev_total_scrapes;
+double saved_scrape_qps;
+SwarmIndex swarms;
 
 // TODO: Should be config based.
 SaltyAuthorizer saltyauth;
 
 helix_handler::helix_handler(boost::asio::io_service& io_service,
-                             const std::string& port) :
+                             const std::string& port,
+                             const std::vector<char>* handoff_state) :
     request_handler(io_service, port),
     _io_service(io_service),
     _periodic(io_service),
     pm_("Helix"),
     _last_checkpoint(time(0)),
+    _last_sweep(time(0)),
+    _swarms_evicted(0),
+    _probation_size(65536),
+    _probation(_probation_size, INTERVAL + INTERVAL / 10),
+    _segment_bytes(0),
+    _segment_save_ms(0),
+    _handed_off(false),
+    read_only_(!replicate_from.empty()),
     control_only_from_localhost_(true),
     enforce_db_blacklist_(true),
     enforce_auth_token_(false),
-    secret_auth_token_("sekret")
+    secret_auth_token_("sekret"),
+    announce_swarm_counts_(false)
 {
     using boost::asio::ip::tcp;
     tcp::resolver resolver(io_service);
@@ -106,48 +137,87 @@ helix_handler::helix_handler(boost::asio::io_service& io_service,
     snprintf(_myid, sizeof(_myid), "%.8X%.4X", ip, nport);
     logger << "Trackerid: [" << _myid << "]" << std::endl;
 
-    std::ifstream checkpoint("tracker_checkpoint", std::ios::binary);
-    if (checkpoint.good())
+    bool took_over = handoff_state && !handoff_state->empty();
+    bool loaded = false;
+    if (took_over)
     {
-        checkpoint.seekg(0, std::ios::end);
-        int file_size = checkpoint.tellg();
-        checkpoint.seekg(0);
-        // have some sane limit on file size. 50 million peers
-        if (file_size > 0 && file_size < 50000000 * 35)
+        StopWatch sw;
+        uint64 tot_peers = load_state_image(&(*handoff_state)[0], handoff_state->size());
+        logger << "took over tracker state. "
+            << swarms.size() << " swarms, " << tot_peers << " peers total in "
+            << sw.get_msec() << "ms" << std::endl;
+        loaded = true;
+    }
+
+    // the state segment has every peer, only fall back to the
+    // checkpoint if there isn't a usable one
+    if (!loaded && !state_segment_name.empty())
+        loaded = load_state_segment();
+
+    // the checkpoint is merged into the swarms while we're already
+    // serving, peers that announce in the meantime are kept
+    if (!loaded)
+    {
+        _checkpoint_loader.reset(new CheckpointLoader(_io_service, "tracker_checkpoint",
+            boost::bind(&helix_handler::merge_checkpoint, this, _1),
+            boost::bind(&helix_handler::checkpoint_loaded, this)));
+        if (!_checkpoint_loader->start()) _checkpoint_loader.reset();
+    }
+
+    if (read_only_)
+    {
+        // the state, and the journal, comes from the primary until
+        // we're promoted
+        Swarm::replica = true;
+        _replication_client.reset(new ReplicationClient(_io_service, replicate_from,
+            boost::bind(&helix_handler::load_replicated_state, this, _1, _2),
+            boost::bind(&helix_handler::replay_journal_record, this, _1)));
+        _replication_client->start();
+    }
+    else
+    {
+        // the state handed over already has everything in the journal
+        if (!journal_filename.empty() && !took_over)
         {
-            std::vector<char> swarm_data(file_size);
-            checkpoint.read(&swarm_data[0], file_size);
-            file_size = checkpoint.gcount();
-            char const* flat_file = &swarm_data[0];
-            int size = file_size;
-            int num_peers, tot_peers = 0;
-            while (size > 24)
-            {
-                // size is passed by reference to the constructor
-                // and it will be decreased by the number of bytes that are read
-                int read = size;
-                Swarm* s = new Swarm(flat_file, size, _io_service, num_peers);
-                swarms.insert(std::make_pair(s->info_hash, s));
-                read -= size;
-                // read is the number of bytes that was consumed by the Swarm constructor
-                flat_file += read;
-                tot_peers += num_peers;
-            }
-            logger << "loaded tracker state from checkpoint. "
-                << swarms.size() << " swarms, " << tot_peers << " peers total"
-                << std::endl;
+            if (checkpoint_loading())
+            {
+                // the journal goes on top of the checkpoint, keep
+                // it until the checkpoint is loaded
+                int64 n = Journal::replay(journal_filename,
+                    boost::bind(&std::vector<journal_record>::push_back,
+                        &_checkpoint_journal, _1));
+                logger << "read " << n << " journal records" << std::endl;
+            }
+            else
+            {
+                int64 n = Journal::replay(journal_filename,
+                    boost::bind(&helix_handler::replay_journal_record, this, _1));
+                logger << "replayed " << n << " journal records. "
+                    << swarms.size() << " swarms" << std::endl;
+            }
         }
+        start_primary();
     }
+
     controls.add_variable(
             "control_only_from_localhost",
             boost::bind(&ControlAPI::set_bool, &control_only_from_localhost_, _1),
             boost::bind(&ControlAPI::get_bool, &control_only_from_localhost_));
+    controls.add_variable("announce_swarm_counts",
+            boost::bind(&ControlAPI::set_bool, &announce_swarm_counts_, _1),
+            boost::bind(&ControlAPI::get_bool, &announce_swarm_counts_));
     controls.add_variable("enforce_auth_token",
             boost::bind(&ControlAPI::set_bool, &enforce_auth_token_, _1),
             boost::bind(&ControlAPI::get_bool, &enforce_auth_token_));
     controls.add_variable("enforce_db_blacklist",
             boost::bind(&ControlAPI::set_bool, &enforce_db_blacklist_, _1),
             boost::bind(&ControlAPI::get_bool, &enforce_db_blacklist_));
+    controls.add_variable("probation_size",
+            boost::bind(&helix_handler::set_probation_size, this, _1),
+            boost::bind(&ControlAPI::get_int, &_probation_size));
+    controls.add_variable("read_only",
+            boost::bind(&helix_handler::set_read_only, this, _1),
+            boost::bind(&ControlAPI::get_bool, &read_only_));
     controls.add_variable("secret_auth_token",
             boost::bind(&ControlAPI::set_string, &secret_auth_token_, _1),
             boost::bind(&ControlAPI::get_string, &secret_auth_token_));
@@ -156,6 +226,7 @@ helix_handler::helix_handler(boost::asio::io_service& io_service,
     dba.setup_controls(controls);
 #endif
     Swarm::setup_controls(controls);
+    NatCheck::setup_controls(controls);
 
 
     _periodic.start(boost::posix_time::seconds(1),
@@ -170,6 +241,9 @@ void helix_handler::start()
 #ifndef DISABLE_DNADB
     dba.start();
 #endif
+#ifndef DISABLE_NATCHECK
+    NatCheck::start_engine();
+#endif
 }
 
 bool helix_handler::set_torrents_enabled(bool enabled, std::vector< std::string > &args)
@@ -192,7 +266,8 @@ bool helix_handler::set_torrents_enabled(bool enabled, std::vector< std::string
             continue;
         }
 
-        if (swarms.count(info_hash) == 0)
+        Swarm* swarm = swarms.find(info_hash);
+        if (swarm == NULL)
         {
             logger << "No swarm found matching " << h << std::endl;
             continue;
@@ -202,12 +277,12 @@ bool helix_handler::set_torrents_enabled(bool enabled, std::vector< std::string
         if (enabled)
         {
             logger << "unblacklisting " << h << std::endl;
-            swarms[info_hash]->enable();
+            swarm->enable();
         }
         else
         {
             logger << "blacklisting " << h << std::endl;
-            swarms[info_hash]->disable();
+            swarm->disable();
         }
     }
 
@@ -219,7 +294,7 @@ std::string helix_handler::get_torrent_blacklist()
     std::stringstream os;
     bool printed = false;
 
-    for(hash_map<std::string, Swarm*>::iterator it = swarms.begin();
+    for(SwarmIndex::iterator it = swarms.begin();
             it != swarms.end();
             it++)
     {
@@ -227,7 +302,7 @@ std::string helix_handler::get_torrent_blacklist()
         {
             if (printed)
                 os << " ";
-            os << sha1_hash(it->first);
+            os << it->first;
             printed = true;
         }
     }
@@ -256,11 +331,14 @@ void helix_handler::periodic()
 {
     std::vector<load_t> load_list;
     size_t load_total = 0;
+    time_t time_now = time(0);
+    Swarm::tracker_cpu = _cpu_monitor.get_cpu_percent();
 
-    hash_map<std::string, Swarm*>::const_iterator it;
+    SwarmIndex::const_iterator it;
     for (it = swarms.begin(); it != swarms.end(); it++)
     {
         Swarm* s = it->second;
+        s->check_timeout(time_now);
         size_t l = s->get_load_metric();
         load_list.push_back(load_t(l, s));
         load_total += l;
@@ -278,9 +356,9 @@ void helix_handler::periodic()
         s->set_cpuload(load_frac);
     }
 
-    time_t time_now = time(0);
-    // checkpoint regularly
-    if (time_now > _last_checkpoint + checkpoint_timer * 60)
+    // checkpoint regularly. Not until the old checkpoint is loaded
+    // though, or the peers not loaded yet would be lost
+    if (time_now > _last_checkpoint + checkpoint_timer * 60 && !checkpoint_loading())
     {
         StopWatch sw;
         _last_checkpoint = time_now;
@@ -289,7 +367,7 @@ void helix_handler::periodic()
         // guess that the average swarm size is 100 peers
         swarm_data.reserve(swarms.size() * (20 + 4 + 100 * (20 + 4 + 1 + 4 + 2)));
 
-        for (hash_map<std::string, Swarm*>::iterator i = swarms.begin();
+        for (SwarmIndex::iterator i = swarms.begin();
                 i != swarms.end(); ++i)
         {
             i->second->save_state(swarm_data);
@@ -303,10 +381,119 @@ void helix_handler::periodic()
 
         logger << "saved checkpoint " << swarms.size() << " swarms, "
             << swarm_data.size() << " bytes in " << sw.get_msec() << "ms ( " << pre_write << "ms )" << std::endl;
+
+        if (!state_segment_name.empty()) save_state_segment();
+
+        // everything journaled so far is in the checkpoint now
+        if (_journal) _journal->truncate();
+    }
+
+    if (time_now >= _last_sweep + 60)
+    {
+        _last_sweep = time_now;
+        evict_idle_swarms(time_now);
+        compact_swarms();
     }
     do_helix_statistics();
 }
 
+void helix_handler::evict_idle_swarms(time_t now)
+{
+    StopWatch sw;
+
+    // erasing moves other swarms in the index, collect them first
+    std::vector<sha1_hash> idle;
+    for (SwarmIndex::const_iterator i = swarms.begin(); i != swarms.end(); ++i)
+    {
+        if (i->second->is_idle(now)) idle.push_back(i->first);
+    }
+    if (idle.empty()) return;
+
+    for (std::vector<sha1_hash>::const_iterator i = idle.begin(); i != idle.end(); ++i)
+    {
+        Swarm* s = swarms.find(*i);
+        swarms.erase(*i);
+        Swarm::recycle(s);
+    }
+    _swarms_evicted += idle.size();
+
+    logger << "evicted " << idle.size() << " idle swarms in " << sw.get_msec()
+        << "ms, " << swarms.size() << " swarms left" << std::endl;
+}
+
+Swarm* helix_handler::admit_swarm(std::string const& tid,
+    probationary_announce const& a)
+{
+    if (a.event == STOPPED)
+    {
+        _probation.stopped(a.info_hash, a.pid);
+        return NULL;
+    }
+
+    // torrents from the database don't need a second peer
+    bool known = !_probation.enabled();
+#ifndef DISABLE_DNADB
+    if (!known) known = dba.is_known(tid);
+#endif
+    probationary_announce first;
+    if (!known && !_probation.announce(a, first)) return NULL;
+
+    Swarm* swarm = Swarm::create(std::string((char const*)a.info_hash.begin(), 20), _io_service);
+    swarms.insert(a.info_hash, swarm);
+    if (known) return swarm;
+
+    // the first peer is added as if it announced again, so that the
+    // second one is handed its endpoint
+    stats_struct stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.event = event_e(first.event);
+    stats.left = first.left;
+    boost::asio::ip::address_v4::bytes_type b4;
+    std::copy(first.ip, first.ip + 4, b4.begin());
+    boost::asio::ip::address_v6::bytes_type b6;
+    std::copy(first.ip6, first.ip6 + 16, b6.begin());
+    peer_list peers;
+    peer_list peers6;
+    try
+    {
+        swarm->handle_announce(std::string((char const*)first.pid.begin(), 20),
+            boost::asio::ip::address_v4(b4), first.port,
+            boost::asio::ip::address_v6(b6), first.port6,
+            0, stats, peers, peers6, false);
+    }
+    catch (std::runtime_error&)
+    {
+        // the swarm's permissions changed since
+    }
+    return swarm;
+}
+
+void helix_handler::set_probation_size(std::vector<std::string> args)
+{
+    ControlAPI::set_int(&_probation_size, args);
+    if (_probation_size < 0) _probation_size = 0;
+    _probation.set_capacity(_probation_size);
+}
+
+void helix_handler::compact_swarms()
+{
+    StopWatch sw;
+
+    int compacted = 0;
+    size_t freed = 0;
+    for (SwarmIndex::iterator i = swarms.begin(); i != swarms.end(); ++i)
+    {
+        size_t f = i->second->compact();
+        if (f == 0) continue;
+        ++compacted;
+        freed += f;
+    }
+    if (compacted == 0) return;
+
+    logger << "compacted " << compacted << " swarms, freed " << freed
+        << " bytes in " << sw.get_msec() << "ms" << std::endl;
+}
+
 void helix_handler::reply_text(Result &res, const std::string &content)
 {
     reply rep;
@@ -331,7 +518,7 @@ void helix_handler::do_helix_statistics(void)
     if (runtime > 15)
     {
         int64_t num_peers = 0;
-        for(hash_map<std::string, Swarm*>::iterator iter = swarms.begin();
+        for(SwarmIndex::iterator iter = swarms.begin();
                 iter != swarms.end();
                 iter++)
         {
@@ -339,29 +526,41 @@ void helix_handler::do_helix_statistics(void)
                     iter->second->get_num_seeds());
         }
         saved_qps = (total_requests - prev_total_requests) / (double)runtime;
+        saved_scrape_qps = (total_scrapes - prev_total_scrapes) / (double)runtime;
         saved_num_swarms = swarms.size();
         saved_num_peers = num_peers;
         saved_cpu_percent = string_format("%.2f", _cpu_monitor.get_cpu_percent());
         start_time = time(NULL);
         logger << "*** " << std::setw(4) << saved_qps << "qps; " << std::setw(6) << saved_num_swarms << " swarms; " << std::setw(7) << saved_num_peers << " peers; " << std::setw(5) << saved_cpu_percent << " %cpu; " << start_time << "s; ***" << std::endl;
         prev_total_requests = total_requests;
+        prev_total_scrapes = total_scrapes;
         pm_.log_status_and_clear();
     }
 }
 
 void helix_handler::reply_bencoded(Result& res, libtorrent::entry::dictionary_type &dict, Swarm* s, reply::status_type status)
 {
-    std::stringstream st;
-    bencode(std::ostream_iterator<char>(st), dict);
-    const std::string& str = st.str();
+    reply rep;
+    bencode(std::back_inserter(rep.content), dict);
+    send_bencoded(res, rep, s, status);
+}
 
+void helix_handler::reply_announce(Result& res,
+    libtorrent::entry::dictionary_type const& dict,
+    peer_list const& peers, peer_list const& peers6)
+{
     reply rep;
+    rep.content.reserve(peers.size() + peers6.size() + 200);
+    bencode_announce(rep.content, dict, peers, peers6);
+    send_bencoded(res, rep, NULL, reply::ok);
+}
 
+void helix_handler::send_bencoded(Result& res, reply& rep, Swarm* s, reply::status_type status)
+{
     rep.status = status;
-    rep.content.append(str);
     rep.headers.resize(4);
     rep.headers[0].name = "Content-Length";
-    rep.headers[0].value = boost::lexical_cast<std::string>((unsigned int)str.length());
+    rep.headers[0].value = boost::lexical_cast<std::string>((unsigned int)rep.content.length());
     rep.headers[1].name = "Content-Type";
     rep.headers[1].value = "text/plain";
     rep.headers[2].name = "X-Server";
@@ -377,7 +576,7 @@ void helix_handler::reply_bencoded(Result& res, libtorrent::entry::dictionary_ty
         rep.headers[5].value = boost::lexical_cast<std::string>((unsigned int)s->get_rank());
     }
 
-    res.finished(rep);
+    res.finished_swap(rep);
 
     total_requests++;
 }
@@ -393,10 +592,278 @@ std::string helix_handler::class_stats()
     st << "Helix number of peers: " << saved_num_peers << std::endl;
     st << "Helix CPU percentage: " << saved_cpu_percent << std::endl;
     st << "Helix requests: " << total_requests << std::endl;
+    st << "Helix announces: " << total_announces << std::endl;
+    st << "Helix scrapes: " << total_scrapes << std::endl;
+    st << "Helix scrape QPS: " << saved_scrape_qps << std::endl;
 
     return st.str();
 }
 
+void helix_handler::stop()
+{
+    NatCheck::stop_engine();
+
+    // the new process owns the state now
+    if (_handed_off || state_segment_name.empty()) return;
+    // the segment would be preferred over the checkpoint next time,
+    // and it doesn't have all of it yet
+    if (checkpoint_loading()) return;
+
+    save_state_segment();
+    // everything journaled is in the segment now
+    if (_journal)
+    {
+        _journal->truncate();
+        _journal->stop();
+    }
+}
+
+uint64 helix_handler::state_image_size() const
+{
+    // swarm records contain 64 bit offsets, keep them aligned
+    uint64 size = sizeof(segment_header) + swarms.size() * sizeof(uint64);
+    for (SwarmIndex::const_iterator i = swarms.begin();
+            i != swarms.end(); ++i)
+    {
+        size += (sizeof(segment_swarm)
+            + i->second->image_peers() * sizeof(segment_peer) + 7) & ~uint64(7);
+    }
+    return size;
+}
+
+void helix_handler::write_state_image(char* image, uint64 size) const
+{
+    segment_header* h = (segment_header*)image;
+    init_segment_header(h, size);
+
+    uint64* table = (uint64*)(image + h->swarm_table);
+    uint64 offset = h->swarm_table + swarms.size() * sizeof(uint64);
+    for (SwarmIndex::const_iterator i = swarms.begin();
+            i != swarms.end(); ++i)
+    {
+        segment_swarm* s = (segment_swarm*)(image + offset);
+        s->peers = offset + sizeof(segment_swarm);
+        i->second->save_image(*s, (segment_peer*)(image + s->peers));
+        table[h->num_swarms++] = offset;
+        h->num_peers += s->num_peers;
+        offset = (s->peers + s->num_peers * sizeof(segment_peer) + 7) & ~uint64(7);
+    }
+    assert(offset == size);
+    h->saved_time = time(0);
+}
+
+uint64 helix_handler::load_state_image(char const* image, uint64 size)
+{
+    segment_header const* h = (segment_header const*)image;
+    if (size < sizeof(segment_header) || !segment_header_valid(h, size))
+        return 0;
+
+    uint64 const* table = (uint64 const*)(image + h->swarm_table);
+    uint64 tot_peers = 0;
+    for (uint64 n = 0; n < h->num_swarms; ++n)
+    {
+        uint64 offset = table[n];
+        if (offset + sizeof(segment_swarm) > h->size) break;
+        segment_swarm const* s = (segment_swarm const*)(image + offset);
+        if (s->peers + uint64(s->num_peers) * sizeof(segment_peer) > h->size) break;
+
+        Swarm* swarm = new Swarm(*s, (segment_peer const*)(image + s->peers), _io_service);
+        if (!swarms.insert(sha1_hash(swarm->info_hash), swarm))
+        {
+            delete swarm;
+            continue;
+        }
+        tot_peers += swarm->image_peers();
+    }
+    return tot_peers;
+}
+
+bool helix_handler::load_state_segment()
+{
+    StopWatch sw;
+    StateSegment segment(state_segment_name);
+    if (!segment.attach()) return false;
+
+    uint64 tot_peers = load_state_image(segment.base(), segment.header()->size);
+    logger << "loaded tracker state from segment '" << state_segment_name
+        << "' saved " << (time(0) - segment.header()->saved_time) << "s ago. "
+        << swarms.size() << " swarms, " << tot_peers << " peers total in "
+        << sw.get_msec() << "ms" << std::endl;
+    return true;
+}
+
+void helix_handler::save_state_segment()
+{
+    StopWatch sw;
+
+    uint64 size = state_image_size();
+    StateSegment segment(state_segment_name);
+    if (!segment.create(size)) return;
+
+    write_state_image(segment.base(), size);
+    segment.finish();
+
+    _segment_bytes = size;
+    _segment_save_ms = sw.get_msec();
+    logger << "saved state segment " << segment.header()->num_swarms << " swarms, "
+        << segment.header()->num_peers << " peers, " << size << " bytes in "
+        << _segment_save_ms << "ms" << std::endl;
+}
+
+void helix_handler::snapshot(std::vector<char>& image) const
+{
+    // the new process won't load the checkpoint
+    if (checkpoint_loading()) _checkpoint_loader->complete();
+
+    StopWatch sw;
+
+    uint64 size = state_image_size();
+    image.resize(size);
+    write_state_image(&image[0], size);
+    ((segment_header*)&image[0])->complete = 1;
+
+    logger << "snapshot of " << swarms.size() << " swarms, " << size
+        << " bytes took " << sw.get_msec() << "ms" << std::endl;
+}
+
+void helix_handler::handed_off()
+{
+    // the new process appends to the journal from now on
+    if (_journal)
+    {
+        Swarm::journal = NULL;
+        _journal->stop();
+    }
+    _handed_off = true;
+}
+
+void helix_handler::start_primary()
+{
+    if (!journal_filename.empty())
+    {
+        _journal.reset(new Journal(journal_filename, journal_commit_ms));
+        _journal->start();
+        Swarm::journal = _journal.get();
+    }
+    start_replication();
+}
+
+void helix_handler::start_replication()
+{
+    // followers get a snapshot of the complete state, so wait until
+    // the checkpoint is loaded
+    if (replication_port.empty() || _replication_server || checkpoint_loading())
+        return;
+
+    _replication_server.reset(new ReplicationServer(_io_service, replication_port,
+        boost::bind(&helix_handler::snapshot, this, _1), replication_batch_ms));
+    Swarm::replicator = _replication_server.get();
+}
+
+void helix_handler::set_read_only(std::vector<std::string> args)
+{
+    bool read_only = read_only_;
+    ControlAPI::set_bool(&read_only, args);
+    if (read_only || !read_only_)
+    {
+        read_only_ = read_only;
+        return;
+    }
+
+    // promoted to primary
+    if (_replication_client)
+    {
+        _replication_client->stop();
+        _replication_client.reset();
+
+        // the primary only sends the changes, not every announce.
+        // Give all peers a full interval to announce to us instead
+        Swarm::replica = false;
+        for (SwarmIndex::iterator i = swarms.begin();
+                i != swarms.end(); ++i)
+        {
+            i->second->renew_peers();
+        }
+
+        start_primary();
+        // the journal only has changes from now on, make sure the
+        // rest is in a checkpoint soon
+        if (_journal) _journal->truncate();
+        _last_checkpoint = 0;
+        logger << "promoted to primary. " << swarms.size() << " swarms" << std::endl;
+    }
+    read_only_ = false;
+}
+
+void helix_handler::load_replicated_state(char const* image, uint64 size)
+{
+    // the primary's state replaces ours, including the checkpoint
+    if (checkpoint_loading())
+    {
+        _checkpoint_loader->abort();
+        _checkpoint_journal.clear();
+    }
+
+    for (SwarmIndex::iterator i = swarms.begin();
+            i != swarms.end(); ++i)
+    {
+        delete i->second;
+    }
+    swarms.clear();
+
+    uint64 tot_peers = image ? load_state_image(image, size) : 0;
+    logger << "replicated state: " << swarms.size() << " swarms, "
+        << tot_peers << " peers total" << std::endl;
+}
+
+void helix_handler::merge_checkpoint(checkpoint_batch const& batch)
+{
+    for (checkpoint_batch::const_iterator i = batch.begin();
+            i != batch.end(); ++i)
+    {
+        bool inserted;
+        Swarm*& s = swarms.find_or_insert(sha1_hash(i->info_hash), inserted);
+        if (inserted) s = Swarm::create(i->info_hash, _io_service);
+        if (!i->peers.empty())
+            s->merge_peers(&i->peers[0], i->peers.size());
+    }
+}
+
+void helix_handler::checkpoint_loaded()
+{
+    // peers that announced while loading are more recent than
+    // the journal, replay() keeps them
+    for (std::vector<journal_record>::const_iterator i = _checkpoint_journal.begin();
+            i != _checkpoint_journal.end(); ++i)
+    {
+        replay_journal_record(*i);
+    }
+    if (!_checkpoint_journal.empty())
+    {
+        logger << "replayed " << _checkpoint_journal.size() << " journal records. "
+            << swarms.size() << " swarms" << std::endl;
+    }
+    std::vector<journal_record>().swap(_checkpoint_journal);
+
+    if (!read_only_) start_replication();
+}
+
+void helix_handler::replay_journal_record(journal_record const& r)
+{
+    std::string info_hash((char const*)r.info_hash, 20);
+    sha1_hash h(info_hash);
+
+    Swarm* s = swarms.find(h);
+    if (s == NULL)
+    {
+        // don't resurrect a swarm just to remove a peer from it
+        if (r.type == JOURNAL_REMOVE) return;
+        s = Swarm::create(info_hash, _io_service);
+        swarms.insert(h, s);
+    }
+    s->replay(r);
+}
+
 bool helix_handler::endpoint_ok_for_control_set(const boost::asio::ip::tcp::endpoint &endpoint)
 {
     if (control_only_from_localhost_)
@@ -408,30 +875,42 @@ bool helix_handler::endpoint_ok_for_control_set(const boost::asio::ip::tcp::endp
 std::string helix_handler::get_swarm_flags(const std::string &infohash)
 {
     sha1_hash h(boost::lexical_cast<sha1_hash>(infohash));
-    std::string info_hash(h.begin(), h.end());
     std::stringstream os;
 
-    if (swarms.count(info_hash) == 0)
+    Swarm* swarm = swarms.find(h);
+    if (swarm == NULL)
     {
         throw std::runtime_error(infohash + std::string(": no such swarm\n"));
     }
-    os << "Flags: " << swarms[info_hash]->get_flags() << std::endl;
+    os << "Flags: " << swarm->get_flags() << std::endl;
     return os.str();
 }
 
+std::string helix_handler::get_swarm_handouts(const std::string &infohash)
+{
+    sha1_hash h(boost::lexical_cast<sha1_hash>(infohash));
+
+    Swarm* swarm = swarms.find(h);
+    if (swarm == NULL)
+    {
+        throw std::runtime_error(infohash + std::string(": no such swarm\n"));
+    }
+    return swarm->get_handout_distribution();
+}
+
 bool helix_handler::set_swarm_flags(const std::string &infohash,
         const hash_map< std::string, std::vector<std::string> > & query_params)
 {
     std::stringstream is(infohash);
     sha1_hash h;
     is >> h;
-    std::string info_hash(h.begin(), h.end());
 
-    if (swarms.count(info_hash) == 0)
+    Swarm* swarm = swarms.find(h);
+    if (swarm == NULL)
     {
         throw std::runtime_error(infohash + std::string(": no such swarm\n"));
     }
-    return swarms[info_hash]->set_flags(query_params);
+    return swarm->set_flags(query_params);
 }
 
 void helix_handler::handle_request(server& http_server,
@@ -460,6 +939,13 @@ void helix_handler::handle_request(server& http_server,
             using namespace libtorrent;
             entry::dictionary_type dict;
 
+            if (read_only_)
+            {
+                dict["failure reason"] = "This tracker is a read-only replica.";
+                reply_bencoded(res, dict);
+                return;
+            }
+
             if (!query_params.count("info_hash"))
             {
                 dict["failure reason"] = "No info_hash given.";
@@ -507,20 +993,11 @@ void helix_handler::handle_request(server& http_server,
             } 
 #endif
 
-            Swarm* swarm;
-            if (swarms.count(info_hash) == 0)
-            {
-                swarm = new Swarm(info_hash, _io_service);
-                swarms.insert(std::pair<std::string, Swarm*>(info_hash, swarm));
-                //logger << "new swarm! " << swarms.size() << " known" << std::endl;
-            }
-            else
-            {
-                swarm = swarms[info_hash];
-            }
-            dict["info_hash"] = swarm->info_hash;
+            // NULL until a second peer announces a new info-hash
+            Swarm* swarm = swarms.find(sha1_hash(info_hash));
+            dict["info_hash"] = info_hash;
 
-            if (swarm->is_disabled())
+            if (swarm && swarm->is_disabled())
             {
                 dict["failure reason"] = "Swarm is blacklisted.";
                 reply_bencoded(res, dict, swarm);
@@ -542,7 +1019,9 @@ void helix_handler::handle_request(server& http_server,
                 return;
             }
 
-            int numwant = 50;
+            // the swarm decides how many it hands out, see
+            // Swarm::cap_numwant()
+            int numwant = -1;
             if (query_params.count("numwant"))
             {
                 numwant =
@@ -658,8 +1137,8 @@ void helix_handler::handle_request(server& http_server,
 
             if (query_params.count("report_w_bad"))
             {
-                dict["w_bad"] = swarm->get_w_bad();
-                dict["c_w_bad"] = swarm->get_cumulative_w_bad();
+                dict["w_bad"] = swarm ? swarm->get_w_bad() : 0;
+                dict["c_w_bad"] = swarm ? swarm->get_cumulative_w_bad() : 0;
                 reply_bencoded(res, dict);
                 return;
             }
@@ -670,8 +1149,8 @@ void helix_handler::handle_request(server& http_server,
             int port_v4 =-1;
             int port_v6 =-1;
 
-            std::string peers;
-            std::string peers6;
+            peer_list peers;
+            peer_list peers6;
 
             bool ip_in_header = false;
             for (size_t i = 0; i < req.headers.size(); i++)
@@ -744,7 +1223,7 @@ void helix_handler::handle_request(server& http_server,
                     client_debug = true;
             }
 
-            if (swarm->is_terminated())
+            if (swarm && swarm->is_terminated())
             {
                 dict["terminate swarm"] = 1;
                 reply_bencoded(res, dict);
@@ -753,37 +1232,73 @@ void helix_handler::handle_request(server& http_server,
 
             if (port_v6 == -1) port_v6 = port;
             if (port_v4 == -1) port_v4 = port;
-            try
+
+            if (swarm == NULL)
             {
-                swarm->handle_announce(peer_id,
-                    in_v4, port_v4,
-                    in_v6, port_v6,
-                    numwant, stats,
-                    peers, peers6,
-                    client_debug);
+                if (!Swarm::new_swarm_permits(peer_id))
+                {
+                    dict["failure reason"] = "Permission denied.";
+                    reply_bencoded(res, dict);
+                    return;
+                }
+
+                probationary_announce a;
+                a.info_hash = sha1_hash(info_hash);
+                a.pid = libtorrent::peer_id(peer_id);
+                a.left = stats.left;
+                a.time = time(NULL);
+                a.event = stats.event;
+                a.reserved = 0;
+                a.port = port_v4;
+                a.port6 = port_v6;
+                boost::asio::ip::address_v4::bytes_type b4 = in_v4.to_bytes();
+                std::copy(b4.begin(), b4.end(), a.ip);
+                boost::asio::ip::address_v6::bytes_type b6 = in_v6.to_bytes();
+                std::copy(b6.begin(), b6.end(), a.ip6);
+                swarm = admit_swarm(tid, a);
             }
-            catch (std::runtime_error& e)
+
+            if (swarm)
             {
-                dict["failure reason"] = e.what();
-                reply_bencoded(res, dict);
-                return;
+                try
+                {
+                    swarm->handle_announce(peer_id,
+                        in_v4, port_v4,
+                        in_v6, port_v6,
+                        numwant, stats,
+                        peers, peers6,
+                        client_debug);
+                }
+                catch (std::runtime_error& e)
+                {
+                    dict["failure reason"] = e.what();
+                    reply_bencoded(res, dict);
+                    return;
+                }
             }
 
             //swarm->print_peers();
-            dict["peers"] = peers;
-            if (!peers6.empty()) dict["peers6"] = peers6;
-            dict["interval"] = INTERVAL + int((rand() / float(RAND_MAX) - .5f) * INTERVAL_RANDOM);
+            dict["interval"] = INTERVAL + int((fast_rand_unit() - .5) * INTERVAL_RANDOM);
             dict["min interval"] = MIN_INTERVAL;
             if (external_ip.is_v4())
                 dict["external ip"] = std::string((char*)&external_ip.to_v4().to_bytes()[0], 4);
             else
                 dict["external ip"] = std::string((char*)&external_ip.to_v6().to_bytes()[0], 16);
             dict["snapdelta"] = SNAP_DELTA;
+            if (swarm && announce_swarm_counts_)
+            {
+                // the same counts as /scrape
+                dict["complete"] = swarm->get_num_seeds();
+                dict["incomplete"] = swarm->get_num_peers();
+                dict["downloaded"] = swarm->get_num_completes();
+            }
+            ++total_announces;
 
-            reply_bencoded(res, dict);
+            reply_announce(res, dict, peers, peers6);
         }
         else if (request_path == "/scrape")
         {
+            ++total_scrapes;
             using namespace libtorrent;
             entry::dictionary_type dict;
             entry::dictionary_type files;
@@ -794,9 +1309,9 @@ void helix_handler::handle_request(server& http_server,
                 entry::dictionary_type stats;
                 std::string info_hash = info_hashes[i];
 
-                if (swarms.count(info_hash))
+                Swarm* swarm = swarms.find(info_hash);
+                if (swarm)
                 {
-                    Swarm* swarm = swarms[info_hash];
 
                     stats["complete"] = swarm->get_num_seeds();
                     stats["incomplete"] = swarm->get_num_peers();
@@ -820,6 +1335,19 @@ void helix_handler::handle_request(server& http_server,
             stats << helix_handler::class_stats();
             stats << pm_.instance_stats();
             stats << Swarm::class_stats();
+            stats << slab_pool::class_stats();
+            stats << swarms.instance_stats();
+            stats << "Swarms evicted: " << _swarms_evicted << std::endl;
+            stats << _probation.instance_stats();
+            if (_checkpoint_loader) stats << _checkpoint_loader->instance_stats();
+            if (_journal) stats << _journal->instance_stats();
+            if (_replication_server) stats << _replication_server->instance_stats();
+            if (_replication_client) stats << _replication_client->instance_stats();
+            if (!state_segment_name.empty())
+            {
+                stats << "State segment bytes: " << _segment_bytes << std::endl;
+                stats << "State segment save time: " << _segment_save_ms << std::endl;
+            }
 
             reply_text(res, stats.str());
         }
@@ -908,6 +1436,19 @@ void helix_handler::handle_request(server& http_server,
                 return;
             }
         }
+        else if (starts_with(request_path, "/control/handouts/"))
+        {
+            const int prefixlen = 18; // strlen("/control/handouts/")
+            std::string infohash(request_path, prefixlen, request_path.size() - prefixlen);
+            try {
+                reply_text(res, get_swarm_handouts(infohash));
+            }
+            catch (std::runtime_error &e)
+            {
+                res.finished(reply::stock_reply(reply::not_found, e.what()));
+            }
+            return;
+        }
         else if (starts_with(request_path, "/control/flags/"))
         {
             const int prefixlen = 15; // strlen("/control/flags/")
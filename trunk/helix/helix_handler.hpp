@@ -26,7 +26,13 @@ THE SOFTWARE.
 #define __HELIX_HANDLER_HPP__
 
 #include <libtorrent/entry.hpp>
+#include <boost/scoped_ptr.hpp>
 #include "control.hpp"
+#include "journal.hpp"
+#include "replication.hpp"
+#include "checkpoint_loader.hpp"
+#include "peer_list.hpp"
+#include "swarm_index.hpp"
 
 #ifndef DISABLE_DNADB
 #include "dnadb.hpp"
@@ -41,7 +47,10 @@ class helix_handler: public request_handler
 {
 public:
 
-    explicit helix_handler(boost::asio::io_service& io_service, const std::string& port);
+    // if handoff_state is set, the tracker state is loaded from that image
+    // (handed over by the process we're replacing) instead of from disk
+    explicit helix_handler(boost::asio::io_service& io_service, const std::string& port,
+                           const std::vector<char>* handoff_state = NULL);
 
     void handle_request(server& http_server,
                         const boost::asio::ip::tcp::endpoint& endpoint, const request& req, Result& res);
@@ -50,19 +59,61 @@ public:
     static std::string handler_name(void);
 
     void start();
+    // called after the network thread has stopped
+    void stop();
+
+    // snapshots the state into image for a new process taking over
+    void snapshot(std::vector<char>& image) const;
+    // called once the new process has the state. This process stops
+    // journaling and saving state
+    void handed_off();
 private:
 
     bool set_torrents_enabled(bool enabled, std::vector< std::string > &);
     std::string get_torrent_blacklist();
 
     void periodic();
+    // removes the swarms without peers and recent announces
+    void evict_idle_swarms(time_t now);
+    // returns the swarm to add the peer of a, the first announce of
+    // an info-hash without one. Returns NULL while it's on probation
+    Swarm* admit_swarm(std::string const& tid, probationary_announce const& a);
+    void set_probation_size(std::vector<std::string> args);
+    // gives back the memory of swarms that have shrunk
+    void compact_swarms();
     void reply_bencoded(Result& res, libtorrent::entry::dictionary_type &dict, Swarm* s = NULL, reply::status_type status = reply::ok);
+    // replies to an announce. The peer lists are copied straight from
+    // the swarm's endpoint lists into the reply
+    void reply_announce(Result& res, libtorrent::entry::dictionary_type const& dict,
+        peer_list const& peers, peer_list const& peers6);
+    // adds the headers to a reply with bencoded content, and sends it
+    void send_bencoded(Result& res, reply& rep, Swarm* s, reply::status_type status);
     void reply_text(Result &res, const std::string &content);
     void do_helix_statistics(void);
     static std::string class_stats();
     bool endpoint_ok_for_control_set(const boost::asio::ip::tcp::endpoint &);
+    void replay_journal_record(journal_record const& r);
+    // starts the journal and the replication server, if enabled
+    void start_primary();
+    void start_replication();
+    void merge_checkpoint(checkpoint_batch const& batch);
+    // called once the whole checkpoint is merged
+    void checkpoint_loaded();
+    bool checkpoint_loading() const
+    { return _checkpoint_loader && _checkpoint_loader->is_loading(); }
+    // setting read_only to false promotes a replica to primary
+    void set_read_only(std::vector<std::string> args);
+    void load_replicated_state(char const* image, uint64 size);
+    uint64 state_image_size() const;
+    void write_state_image(char* image, uint64 size) const;
+    // returns the number of peers loaded
+    uint64 load_state_image(char const* image, uint64 size);
+    bool load_state_segment();
+    void save_state_segment();
 
     static std::string get_swarm_flags(const std::string &);
+    // the distribution of the swarm's handout counters
+    static std::string get_swarm_handouts(const std::string &);
     static bool set_swarm_flags(const std::string &,
             const hash_map< std::string, std::vector<std::string> >&);
 
@@ -79,10 +130,35 @@ private:
     // the time when the last snapshot of all
     // the swarms was saved to disk
     int _last_checkpoint;
+    // the last time idle swarms were looked for
+    time_t _last_sweep;
+    int64 _swarms_evicted;
+    // info-hashes announced by a single peer. 0 entries creates a
+    // swarm for every new info-hash
+    int _probation_size;
+    ProbationTable _probation;
+    // peer changes since the last checkpoint, if enabled
+    boost::scoped_ptr<Journal> _journal;
+    // set while the checkpoint is loaded in the background
+    boost::scoped_ptr<CheckpointLoader> _checkpoint_loader;
+    // the journal to replay once the checkpoint is loaded
+    std::vector<journal_record> _checkpoint_journal;
+    // the size and save time of the last state segment
+    uint64 _segment_bytes;
+    double _segment_save_ms;
+    // set once the state has been handed off to a new process
+    bool _handed_off;
+    boost::scoped_ptr<ReplicationServer> _replication_server;
+    boost::scoped_ptr<ReplicationClient> _replication_client;
+    // rejects announces. Set while following a replication primary
+    bool read_only_;
     bool control_only_from_localhost_;
     bool enforce_db_blacklist_;
     bool enforce_auth_token_;
     std::string secret_auth_token_;
+    // announce replies carry the swarm's complete, incomplete and
+    // downloaded counts, so clients don't need to scrape for them
+    bool announce_swarm_counts_;
 };
 
 } // namespace server
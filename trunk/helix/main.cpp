@@ -28,11 +28,14 @@ THE SOFTWARE.
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
 #include <boost/program_options.hpp>
+#include <boost/scoped_ptr.hpp>
 #include "stats.hpp"
 #include "server.hpp"
 #include "utils.hpp"
 #include "helix_handler.hpp"
+#include "handoff.hpp"
 #include "control.hpp"
+#include "slab.hpp"
 
 #if !defined(_WIN32)
 
@@ -64,6 +67,12 @@ BOOL WINAPI console_ctrl_handler(DWORD ctrl_type)
 // nice global variable for the number of
 // minutes between checkpoints
 extern int checkpoint_timer;
+extern std::string journal_filename;
+extern int journal_commit_ms;
+extern std::string state_segment_name;
+extern std::string replication_port;
+extern int replication_batch_ms;
+extern std::string replicate_from;
 bool verbose_logging = false;
 
 int main(int argc, char* argv[])
@@ -77,6 +86,7 @@ int main(int argc, char* argv[])
         std::string pidfilename;
         std::string logfilename;
         std::string configfilename;
+        std::string handoff_path;
 
 #ifndef _GLIBCXX_DEBUG
         // Check command line arguments.
@@ -104,6 +114,35 @@ int main(int argc, char* argv[])
             ("checkpoint-time",
              po::value<int>(&checkpoint_timer)->default_value(5),
              "The number of minutes between checkpointing the tracker state")
+            ("journal",
+             po::value<std::string>(&journal_filename)->default_value(""),
+             "Log peer changes to this file between checkpoints, and replay it on startup")
+            ("journal-commit-ms",
+             po::value<int>(&journal_commit_ms)->default_value(100),
+             "The number of milliseconds between writes to the journal")
+            ("state-segment",
+             po::value<std::string>(&state_segment_name)->default_value(""),
+             "Keep a full image of the tracker state in this shared memory segment, and resume from it on startup")
+            ("replication-port",
+             po::value<std::string>(&replication_port)->default_value(""),
+             "Accept replication followers on this port, and stream all peer changes to them")
+            ("replication-batch-ms",
+             po::value<int>(&replication_batch_ms)->default_value(20),
+             "The number of milliseconds between batches of changes sent to replication followers")
+            ("replicate-from",
+             po::value<std::string>(&replicate_from)->default_value(""),
+             "Run as a read-only replica of the primary at host:port (its --replication-port). "
+             "Set the read_only control to false to promote it")
+            ("handoff-socket",
+             po::value<std::string>(&handoff_path)->default_value(""),
+             "Take over the listening sockets and state from the tracker listening on this unix socket, if any, "
+             "and listen on it to hand them over to the next one")
+            ("huge-pages",
+             po::value<bool>(&slab_pool::huge_pages)->default_value(false),
+             "Back the memory of swarms, peers and connections with transparent huge pages")
+            ("drain-timeout",
+             po::value<int>(&http::server::server::drain_timeout)->default_value(10),
+             "The number of seconds to wait for requests in progress to finish when shutting down")
             ("configfile",
              po::value<std::string>(&configfilename)->default_value(""),
              "Load configuration values from this file")
@@ -151,13 +190,31 @@ int main(int argc, char* argv[])
 #endif
 #endif
 
+        // if another tracker is running, take over its listening
+        // sockets and state instead of starting from scratch
+        std::vector<int> listen_fds;
+        std::vector<char> handoff_state;
+        if (!handoff_path.empty())
+            http::server::receive_handoff(handoff_path, listen_fds, handoff_state);
+
         std::vector<std::string> addresses;
         addresses.push_back("0.0.0.0");
         addresses.push_back("::");
-        http::server::server s(addresses, port);
-        http::server::helix_handler rh(s.io_service(), port);
+        http::server::server s(addresses, port, listen_fds);
+        http::server::helix_handler rh(s.io_service(), port,
+            listen_fds.empty() ? NULL : &handoff_state);
         s.set_request_handler(&rh);
 
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        boost::scoped_ptr<http::server::handoff_listener> handoff;
+        if (!handoff_path.empty())
+        {
+            handoff.reset(new http::server::handoff_listener(s, handoff_path,
+                boost::bind(&http::server::helix_handler::snapshot, &rh, _1),
+                boost::bind(&http::server::helix_handler::handed_off, &rh)));
+        }
+#endif
+
         if (configfilename != "")
         {
             bool success = rh.controls.read_file(configfilename);
@@ -183,6 +240,7 @@ int main(int argc, char* argv[])
 
         // Run the server until stopped.
         s.run();
+        rh.stop();
 #else
 #ifdef RUN_IN_FOREGROUND
         // to make it possible to break into gdb when running in debug mode
@@ -223,6 +281,7 @@ int main(int argc, char* argv[])
                     " exiting on signal " << sig << std::endl;
                 s.stop();
                 t.join();
+                rh.stop();
                 return 0;
             }
         }
@@ -0,0 +1,260 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "checkpoint_loader.hpp"
+#include "swarm.hpp"
+
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+#include <boost/bind.hpp>
+
+namespace
+{
+    // the file is read in chunks of this size
+    const size_t read_size = 4 * 1024 * 1024;
+    // the number of swarms handed to the network thread at a time
+    const size_t batch_size = 1000;
+    // the reader waits for the network thread when this many
+    // batches are waiting to be merged
+    const int max_pending = 4;
+}
+
+CheckpointLoader::CheckpointLoader(boost::asio::io_service& ios,
+    const std::string& filename, merge_f_t merge, done_f_t done)
+    : ios_(ios),
+      filename_(filename),
+      merge_(merge),
+      done_(done),
+      pending_(0),
+      stop_(false),
+      truncated_(false),
+      loading_(false),
+      aborted_(false),
+      bytes_total_(0),
+      bytes_loaded_(0),
+      swarms_loaded_(0),
+      peers_loaded_(0),
+      load_ms_(0)
+{}
+
+CheckpointLoader::~CheckpointLoader()
+{
+    abort();
+}
+
+bool CheckpointLoader::start()
+{
+    assert(!thread_);
+
+    FILE* f = fopen(filename_.c_str(), "rb");
+    if (f == NULL) return false;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    if (size <= 0) return false;
+
+    bytes_total_ = size;
+    loading_ = true;
+    timer_.restart();
+    thread_.reset(new boost::thread(boost::bind(&CheckpointLoader::run, this)));
+    logger << "loading tracker state from checkpoint '" << filename_ << "', "
+        << bytes_total_ << " bytes" << std::endl;
+    return true;
+}
+
+void CheckpointLoader::stop_reader()
+{
+    {
+        boost::mutex::scoped_lock l(mutex_);
+        stop_ = true;
+        cond_.notify_all();
+    }
+    if (thread_)
+    {
+        thread_->join();
+        thread_.reset();
+    }
+}
+
+void CheckpointLoader::abort()
+{
+    stop_reader();
+    aborted_ = true;
+    loading_ = false;
+}
+
+void CheckpointLoader::complete()
+{
+    if (!loading_) return;
+
+    stop_reader();
+    aborted_ = true;
+
+    logger << "loading the rest of the checkpoint" << std::endl;
+    bytes_loaded_ = 0;
+    swarms_loaded_ = 0;
+    peers_loaded_ = 0;
+    truncated_ = false;
+    read_file(true);
+    finish();
+}
+
+void CheckpointLoader::run()
+{
+    read_file(false);
+    if (stop_) return;
+    ios_.post(boost::bind(&CheckpointLoader::finish, this));
+}
+
+void CheckpointLoader::read_file(bool sync)
+{
+    FILE* f = fopen(filename_.c_str(), "rb");
+    if (f == NULL) return;
+
+    std::vector<char> buf(read_size);
+    size_t used = 0;
+    bool eof = false;
+    // bytes parsed, and bytes parsed into batches already delivered
+    uint64 parsed = 0;
+    uint64 delivered = 0;
+
+    boost::shared_ptr<checkpoint_batch> batch(new checkpoint_batch);
+    checkpoint_swarm s;
+
+    while (!eof && (sync || !stop_))
+    {
+        // the beginning of the next swarm may be left over from the
+        // last chunk, append to it
+        buf.resize(used + read_size);
+        size_t n = fread(&buf[used], 1, read_size, f);
+        if (n < read_size) eof = true;
+        used += n;
+
+        char const* p = &buf[0];
+        int left = used;
+        while (left > 0)
+        {
+            int r = http::server::Swarm::read_state(p, left, s.info_hash, s.peers);
+            if (r == 0) break;
+            if (r < 0)
+            {
+                // nothing after this can be trusted
+                eof = true;
+                break;
+            }
+            p += r;
+            left -= r;
+            parsed += r;
+            batch->push_back(checkpoint_swarm());
+            batch->back().info_hash.swap(s.info_hash);
+            batch->back().peers.swap(s.peers);
+            if (batch->size() < batch_size) continue;
+
+            deliver(batch, parsed - delivered, sync);
+            delivered = parsed;
+            batch.reset(new checkpoint_batch);
+            if (!sync && stop_) break;
+        }
+
+        memmove(&buf[0], p, left);
+        used = left;
+    }
+    fclose(f);
+
+    if (!sync && stop_) return;
+    if (!batch->empty()) deliver(batch, parsed - delivered, sync);
+    // a corrupt swarm, or a swarm cut off by the end of the file
+    if (used > 0) truncated_ = true;
+}
+
+void CheckpointLoader::deliver(boost::shared_ptr<checkpoint_batch> batch,
+    uint64 bytes, bool sync)
+{
+    if (sync)
+    {
+        merge_batch(*batch, bytes);
+        return;
+    }
+
+    boost::mutex::scoped_lock l(mutex_);
+    while (pending_ >= max_pending && !stop_) cond_.wait(l);
+    if (stop_) return;
+    ++pending_;
+    ios_.post(boost::bind(&CheckpointLoader::merge, this, batch, bytes));
+}
+
+void CheckpointLoader::merge(boost::shared_ptr<checkpoint_batch> batch, uint64 bytes)
+{
+    if (aborted_) return;
+
+    {
+        boost::mutex::scoped_lock l(mutex_);
+        --pending_;
+        cond_.notify_all();
+    }
+    merge_batch(*batch, bytes);
+}
+
+void CheckpointLoader::merge_batch(checkpoint_batch const& batch, uint64 bytes)
+{
+    merge_(batch);
+    bytes_loaded_ += bytes;
+    swarms_loaded_ += batch.size();
+    for (checkpoint_batch::const_iterator i = batch.begin();
+            i != batch.end(); ++i)
+    {
+        peers_loaded_ += i->peers.size();
+    }
+}
+
+void CheckpointLoader::finish()
+{
+    // the posted end of a load that was completed synchronously
+    if (!loading_) return;
+
+    bytes_loaded_ = bytes_total_;
+    loading_ = false;
+    load_ms_ = timer_.get_msec();
+    logger << "loaded tracker state from checkpoint. " << swarms_loaded_
+        << " swarms, " << peers_loaded_ << " peers total in " << load_ms_
+        << "ms" << std::endl;
+    if (truncated_)
+        logger << "the end of the checkpoint is truncated or corrupt" << std::endl;
+    done_();
+}
+
+std::string CheckpointLoader::instance_stats()
+{
+    std::stringstream st;
+
+    st << "Checkpoint loading: " << (loading_ ? 1 : 0) << std::endl;
+    st << "Checkpoint bytes loaded: " << bytes_loaded_ << std::endl;
+    st << "Checkpoint bytes total: " << bytes_total_ << std::endl;
+    st << "Checkpoint swarms loaded: " << swarms_loaded_ << std::endl;
+    st << "Checkpoint peers loaded: " << peers_loaded_ << std::endl;
+    st << "Checkpoint load time: " << (loading_ ? timer_.get_msec() : load_ms_) << std::endl;
+
+    return st.str();
+}
@@ -0,0 +1,123 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __CHECKPOINT_LOADER_HPP__
+#define __CHECKPOINT_LOADER_HPP__
+
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+#include "state_segment.hpp"
+#include "templates.h"
+#include "utils.hpp"
+
+// the peers of one swarm read from the checkpoint
+struct checkpoint_swarm
+{
+    std::string info_hash;
+    std::vector<segment_peer> peers;
+};
+
+typedef std::vector<checkpoint_swarm> checkpoint_batch;
+
+/// Reads the checkpoint file on a background thread while the tracker
+/// is already serving. The swarms are parsed in batches which are
+/// handed to the network thread, so the swarms themselves are only
+/// ever touched from there. The reader blocks when the network thread
+/// falls behind, instead of buffering the whole file.
+class CheckpointLoader : private boost::noncopyable
+{
+public:
+    typedef boost::function<void (checkpoint_batch const&)> merge_f_t;
+    typedef boost::function<void ()> done_f_t;
+
+    CheckpointLoader(boost::asio::io_service& ios, const std::string& filename,
+        merge_f_t merge, done_f_t done);
+    ~CheckpointLoader();
+
+    // returns false if there's no checkpoint to load. done is
+    // only called if the load was started
+    bool start();
+    // stops loading. Batches that haven't been merged yet are dropped
+    // and done is not called
+    void abort();
+    // loads the rest of the checkpoint on the calling (network)
+    // thread and calls done before returning. Merging must not
+    // replace peers that are already in a swarm, the file is read
+    // again from the beginning
+    void complete();
+
+    // true until the last batch has been merged
+    bool is_loading() const { return loading_; }
+
+    std::string instance_stats();
+
+private:
+    void run();
+    void read_file(bool sync);
+    void deliver(boost::shared_ptr<checkpoint_batch> batch, uint64 bytes, bool sync);
+    void stop_reader();
+
+    // called on the network thread
+    void merge(boost::shared_ptr<checkpoint_batch> batch, uint64 bytes);
+    void merge_batch(checkpoint_batch const& batch, uint64 bytes);
+    void finish();
+
+    boost::asio::io_service& ios_;
+    std::string filename_;
+    merge_f_t merge_;
+    done_f_t done_;
+
+    // the number of batches posted to the network thread,
+    // but not merged yet
+    boost::mutex mutex_;
+    boost::condition cond_;
+    int pending_;
+    volatile bool stop_;
+
+    boost::scoped_ptr<boost::thread> thread_;
+    // set by the reader before finish() is posted
+    bool truncated_;
+
+    // only touched by the network thread
+    bool loading_;
+    // batches and the end of the load posted before
+    // abort() or complete() are ignored
+    bool aborted_;
+    uint64 bytes_total_;
+    uint64 bytes_loaded_;
+    int64 swarms_loaded_;
+    int64 peers_loaded_;
+    StopWatch timer_;
+    double load_ms_;
+};
+
+#endif //__CHECKPOINT_LOADER_HPP__
@@ -0,0 +1,187 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef __CHUNKED_VECTOR_HPP__
+#define __CHUNKED_VECTOR_HPP__
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <boost/noncopyable.hpp>
+#include "slab.hpp"
+
+/// A vector of POD elements stored in fixed size chunks. Growing it
+/// never copies more than one chunk, and elements are contiguous
+/// within each chunk (see run()). The first chunk grows like a normal
+/// vector, so short vectors don't pay for a whole chunk. Memory isn't
+/// given back as elements are removed, until shrink() is called.
+/// The chunks come from the slab_pools of Category.
+template <class T, class Category, int ChunkSize = 256>
+class chunked_vector : private boost::noncopyable
+{
+public:
+    typedef T value_type;
+    enum { chunk_size = ChunkSize };
+
+    chunked_vector() : size_(0), first_capacity_(0) {}
+    ~chunked_vector() { clear_memory(); }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    T& operator[](size_t i)
+    {
+        assert(i < size_);
+        return chunks_[i / ChunkSize][i % ChunkSize];
+    }
+    T const& operator[](size_t i) const
+    {
+        assert(i < size_);
+        return chunks_[i / ChunkSize][i % ChunkSize];
+    }
+    T& back() { return (*this)[size_ - 1]; }
+
+    // returns element i, and sets len to the number of elements
+    // from it to the end of its chunk (or of the vector)
+    T const* run(size_t i, size_t& len) const
+    {
+        assert(i < size_);
+        len = std::min(size_ - i, ChunkSize - i % ChunkSize);
+        return &chunks_[i / ChunkSize][i % ChunkSize];
+    }
+    T* run(size_t i, size_t& len)
+    {
+        assert(i < size_);
+        len = std::min(size_ - i, ChunkSize - i % ChunkSize);
+        return &chunks_[i / ChunkSize][i % ChunkSize];
+    }
+
+    void push_back(T const& v)
+    {
+        if (size_ == capacity()) grow();
+        chunks_[size_ / ChunkSize][size_ % ChunkSize] = v;
+        ++size_;
+    }
+
+    void pop_back()
+    {
+        assert(size_ > 0);
+        --size_;
+    }
+
+    // the number of bytes allocated for elements
+    size_t memory() const { return capacity() * sizeof(T); }
+
+    // frees the chunks that aren't in use, except for one spare,
+    // and shrinks the first chunk if the vector is short. Returns
+    // the number of bytes freed
+    size_t shrink()
+    {
+        size_t before = memory();
+        size_t used = (size_ + ChunkSize - 1) / ChunkSize;
+        while (chunks_.size() > used + 1)
+        {
+            free_chunk(chunks_.back(), ChunkSize);
+            chunks_.pop_back();
+        }
+        if (size_ == 0)
+        {
+            clear_memory();
+        }
+        else if (chunks_.size() == 1 && first_capacity_ > 4 * size_)
+        {
+            // capacities stay powers of two, to share the slab pools
+            size_t capacity = 4;
+            while (capacity < size_ * 2) capacity *= 2;
+            resize_first(capacity);
+        }
+        if (chunks_.capacity() > 2 * chunks_.size())
+            std::vector<T*>(chunks_).swap(chunks_);
+        return before - memory();
+    }
+
+private:
+    size_t capacity() const
+    {
+        if (chunks_.size() == 1) return first_capacity_;
+        return chunks_.size() * ChunkSize;
+    }
+
+    void grow()
+    {
+        if (chunks_.empty())
+        {
+            chunks_.push_back(allocate_chunk(4));
+            first_capacity_ = 4;
+        }
+        else if (chunks_.size() == 1 && first_capacity_ < ChunkSize)
+        {
+            resize_first(std::min(first_capacity_ * 2, size_t(ChunkSize)));
+        }
+        else
+        {
+            chunks_.push_back(allocate_chunk(ChunkSize));
+            first_capacity_ = ChunkSize;
+        }
+    }
+
+    void resize_first(size_t capacity)
+    {
+        assert(chunks_.size() == 1 && capacity >= size_);
+        T* c = allocate_chunk(capacity);
+        std::copy(chunks_[0], chunks_[0] + size_, c);
+        free_chunk(chunks_[0], first_capacity_);
+        chunks_[0] = c;
+        first_capacity_ = capacity;
+    }
+
+    void clear_memory()
+    {
+        // the first chunk is first_capacity_ elements, the others
+        // ChunkSize
+        for (size_t i = 0; i < chunks_.size(); ++i)
+            free_chunk(chunks_[i], i == 0 ? first_capacity_ : ChunkSize);
+        std::vector<T*>().swap(chunks_);
+        first_capacity_ = 0;
+    }
+
+    static T* allocate_chunk(size_t n)
+    {
+        return static_cast<T*>(
+            slab_pool::get(Category::name(), n * sizeof(T)).allocate());
+    }
+    static void free_chunk(T* c, size_t n)
+    {
+        slab_pool::get(Category::name(), n * sizeof(T)).deallocate(c);
+    }
+
+    std::vector<T*> chunks_;
+    size_t size_;
+    // the capacity of the first chunk. Once there are more chunks
+    // it's always ChunkSize
+    size_t first_capacity_;
+};
+
+#endif //__CHUNKED_VECTOR_HPP__
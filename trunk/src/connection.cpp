@@ -10,23 +10,37 @@
 
 #include "connection.hpp"
 #include <vector>
-#include <boost/pool/pool.hpp>
 #include <boost/bind.hpp>
 #include "connection_manager.hpp"
 #include "request_handler.hpp"
 #include "server.hpp"
 #include "utils.hpp"
+#include "slab.hpp"
 
 namespace http {
 namespace server {
 
 #define SERVER_BUFFER_SIZE 65535
 
-boost::pool<> _connection_buffer(SERVER_BUFFER_SIZE);
+// the receive buffers are reported with the connections
+slab_pool& _connection_buffer = slab_pool::get(connection_memory::name(), SERVER_BUFFER_SIZE);
 
 void free_buffer(char* mem)
 {
-	_connection_buffer.free(mem);
+	_connection_buffer.deallocate(mem);
+}
+
+void* connection::operator new(size_t size)
+{
+    static slab_pool& pool = slab_pool::get(connection_memory::name(), sizeof(connection));
+    assert(size == sizeof(connection));
+    return pool.allocate();
+}
+
+void connection::operator delete(void* p)
+{
+    static slab_pool& pool = slab_pool::get(connection_memory::name(), sizeof(connection));
+    if (p) pool.deallocate(p);
 }
 
 int pending = 0;
@@ -70,6 +84,7 @@ connection::connection(server& http_server)
 {
     _writing = false;
     _should_keepalive = false;
+    _num_requests = 0;
     pending++;
     //logger << "new connection! " << pending << " pending" << std::endl;
 }
@@ -81,7 +96,7 @@ void connection::start()
     _request_handler = _http_server.get_request_handler();
 
     _recv_pos = 0;
-	_buffer.reset((char*)_connection_buffer.malloc(), &free_buffer);
+	_buffer.reset((char*)_connection_buffer.allocate(), &free_buffer);
     _socket.set_option(boost::asio::ip::tcp::no_delay(true));
     read();
 }
@@ -104,6 +119,16 @@ void connection::stop()
     //logger << "closed connection! " << pending << " pending" << std::endl;
 }
 
+void connection::drain()
+{
+    _should_keepalive = false;
+    // idle keep-alive connections can be closed right away. New
+    // connections and ones with a partial request are waiting for
+    // a request, the others are closed by the write completion handler
+    if (_results.empty() && _recv_pos == 0 && _num_requests > 0)
+        _connection_manager.stop(shared_from_this());
+}
+
 void connection::read()
 {
     conn_assert(_recv_pos < SERVER_BUFFER_SIZE);
@@ -158,6 +183,7 @@ void connection::process_buffer()
         }
 
         _request_parser.reset();
+        ++_num_requests;
 
         _results.push_back(Result(shared_from_this()));
         Result& nr = _results.back();
@@ -205,6 +231,10 @@ void connection::process_buffer()
             */
         }
 
+        // the server is shutting down, tell the client to reconnect
+        if (_connection_manager.draining())
+            _should_keepalive = false;
+
         _request_handler->handle_request(_http_server, peer_endpoint(), _request, nr);
         _request.reset();
 
@@ -281,5 +311,12 @@ void Result::finished(const reply& r)
     _connection->write();
 }
 
+void Result::finished_swap(reply& r)
+{
+    _reply.swap(r);
+    complete = true;
+    _connection->write();
+}
+
 } // namespace server
 } // namespace http
@@ -41,6 +41,10 @@ public:
   /// Construct a connection with the given io_service.
   explicit connection(server& http_server);
 
+  /// Connections are allocated from a slab_pool.
+  static void* operator new(size_t size);
+  static void operator delete(void* p);
+
   /// Get the socket associated with the connection.
   boost::asio::ip::tcp::socket& socket() { return _socket; }
 
@@ -53,6 +57,9 @@ public:
   /// Stop all asynchronous operations associated with the connection.
   void stop();
 
+  /// Close the connection once the pending results have been written.
+  void drain();
+
   /// Submits pending result if one is not in progess.
   void write();
 
@@ -100,6 +107,9 @@ private:
   /// Whether to close the connection when the write completes.
   bool _should_keepalive;
 
+  /// The number of requests received on this connection.
+  int _num_requests;
+
   /// List of pending results.
   std::list<Result> _results;
 
@@ -115,6 +125,9 @@ class Result {
 public:
     Result(connection_ptr c);
     void finished(const reply& r);
+    /// Like finished(), but takes the contents of r instead of
+    /// copying them, and leaves it empty.
+    void finished_swap(reply& r);
 
     bool complete;
     reply _reply;
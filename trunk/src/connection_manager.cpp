@@ -10,11 +10,17 @@
 
 #include "connection_manager.hpp"
 #include <algorithm>
+#include <vector>
 #include <boost/bind.hpp>
 
 namespace http {
 namespace server {
 
+connection_manager::connection_manager()
+  : draining_(false)
+{
+}
+
 void connection_manager::start(connection_ptr c)
 {
   connections_.insert(c);
@@ -25,6 +31,13 @@ void connection_manager::stop(connection_ptr c)
 {
   connections_.erase(c);
   c->stop();
+
+  if (draining_ && connections_.empty() && drained_)
+  {
+    boost::function<void()> handler;
+    handler.swap(drained_);
+    handler();
+  }
 }
 
 void connection_manager::stop_all()
@@ -34,5 +47,23 @@ void connection_manager::stop_all()
   connections_.clear();
 }
 
+void connection_manager::drain(const boost::function<void()>& handler)
+{
+  draining_ = true;
+  drained_ = handler;
+
+  if (connections_.empty())
+  {
+    drained_.clear();
+    handler();
+    return;
+  }
+
+  // draining a connection may stop it, which removes it from the set
+  std::vector<connection_ptr> connections(connections_.begin(), connections_.end());
+  std::for_each(connections.begin(), connections.end(),
+      boost::bind(&connection::drain, _1));
+}
+
 } // namespace server
 } // namespace http
@@ -13,6 +13,7 @@
 
 #include <set>
 #include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
 #include "connection.hpp"
 
 namespace http {
@@ -24,6 +25,8 @@ class connection_manager
   : private boost::noncopyable
 {
 public:
+  connection_manager();
+
   /// Add the specified connection to the manager and start it.
   void start(connection_ptr c);
 
@@ -33,9 +36,21 @@ public:
   /// Stop all connections.
   void stop_all();
 
+  /// Close every connection as soon as the requests it has received are
+  /// answered, and call the handler once the last one is closed.
+  void drain(const boost::function<void()>& handler);
+
+  bool draining() const { return draining_; }
+
 private:
   /// The managed connections.
   std::set<connection_ptr> connections_;
+
+  /// Whether we're waiting for the connections to close.
+  bool draining_;
+
+  /// Called when the last connection closes while draining.
+  boost::function<void()> drained_;
 };
 
 } // namespace server
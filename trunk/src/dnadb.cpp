@@ -75,6 +75,13 @@ bool DBAuthorizer::is_allowed(std::string binary_infohash)
     return (_blacklist.count(binary_infohash) == 0);
 }
 
+bool DBAuthorizer::is_known(std::string binary_infohash)
+{
+    boost::mutex::scoped_lock lock(_cache_mutex);
+
+    return (_known.count(binary_infohash) != 0);
+}
+
 void DBAuthorizer::periodic_update()
 {
     mysqlpp::Connection *con = _connection_pool.get_connection();
@@ -100,12 +107,8 @@ void DBAuthorizer::periodic_update()
         "companies.cid = torrents.cid AND "
         "(torrents.modified >= " << last_update << " OR "
         "domains.modified >= " << last_update << ")";
-    // optimization for when we have an empty black-list. Only look
-    // for torrents that are disabled/suspended
-    if (_blacklist.empty())
-        query << " AND (torrents.enabled = false OR "
-        "domains.suspended = true OR "
-        "companies.suspended = true)";
+    // the enabled torrents are needed as well, they're let past
+    // the probation of new info-hashes
 
 #if MYSQLPP_HEADER_VERSION >= MYSQLPP_VERSION(3, 0, 0)
     mysqlpp::StoreQueryResult res = query.store();
@@ -141,11 +144,13 @@ void DBAuthorizer::periodic_update()
         {
             if (_blacklist.erase(tid))
                 ++num_removed;
+            _known.insert(tid);
         }
         else
         {
             if (_blacklist.insert(tid).second)
                 ++num_added;
+            _known.erase(tid);
         }
     }
     lock.unlock();
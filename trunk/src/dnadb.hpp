@@ -48,6 +48,8 @@ public:
     }
 
     bool is_allowed(std::string binary_infohash);
+    // true if the torrent is in the database and enabled
+    bool is_known(std::string binary_infohash);
 
     void start(void);
     void setup_controls(ControlAPI &controls);
@@ -62,6 +64,7 @@ private:
 
     boost::mutex _cache_mutex;
     hash_set<libtorrent::sha1_hash> _blacklist;
+    hash_set<libtorrent::sha1_hash> _known;
 
     mysqlPool _connection_pool;
     ThreadPool _thread_pool;
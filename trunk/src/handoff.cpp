@@ -0,0 +1,264 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "handoff.hpp"
+#include "server.hpp"
+#include "utils.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <boost/bind.hpp>
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+namespace http {
+namespace server {
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+
+namespace
+{
+    const char handoff_magic[4] = { 'H', 'L', 'X', 'H' };
+
+    // more than we ever listen on
+    enum { max_listen_fds = 16 };
+
+    struct handoff_hello
+    {
+        char magic[4];
+        uint32 num_fds;
+    };
+
+    bool read_all(int fd, char* buf, size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t n = read(fd, buf, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            buf += n;
+            size -= n;
+        }
+        return true;
+    }
+}
+
+bool receive_handoff(const std::string& path, std::vector<int>& listen_fds,
+    std::vector<char>& state)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0) return false;
+
+    // if nobody is listening, there's nothing to take over
+    if (connect(s, (sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        close(s);
+        return false;
+    }
+
+    logger << "taking over from the tracker on '" << path << "'" << std::endl;
+
+    handoff_hello hello;
+    iovec iov;
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+
+    char control[CMSG_SPACE(max_listen_fds * sizeof(int))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do { n = recvmsg(s, &msg, 0); } while (n < 0 && errno == EINTR);
+
+    listen_fds.clear();
+    for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c))
+    {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        int const* fds = (int const*)CMSG_DATA(c);
+        int num_fds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        listen_fds.insert(listen_fds.end(), fds, fds + num_fds);
+    }
+
+    bool ok = n == sizeof(hello)
+        && memcmp(hello.magic, handoff_magic, sizeof(handoff_magic)) == 0
+        && hello.num_fds == listen_fds.size()
+        && !listen_fds.empty();
+
+    uint64 size = 0;
+    if (ok) ok = read_all(s, (char*)&size, sizeof(size));
+    if (ok)
+    {
+        state.resize(size);
+        ok = size == 0 || read_all(s, &state[0], size);
+    }
+    close(s);
+
+    if (!ok)
+    {
+        logger << "handoff from '" << path << "' failed" << std::endl;
+        for (size_t i = 0; i < listen_fds.size(); ++i)
+            close(listen_fds[i]);
+        listen_fds.clear();
+        state.clear();
+        return false;
+    }
+
+    logger << "received " << listen_fds.size() << " listening sockets and "
+        << size << " bytes of state" << std::endl;
+    return true;
+}
+
+handoff_listener::handoff_listener(server& s, const std::string& path,
+    snapshot_f_t snapshot, done_f_t done)
+    : server_(s),
+      path_(path),
+      snapshot_(snapshot),
+      done_(done),
+      acceptor_(s.io_service()),
+      socket_(s.io_service()),
+      state_size_(0)
+{
+    try
+    {
+        // a process we took over from may still be bound to the path.
+        // it doesn't need it anymore
+        unlink(path.c_str());
+        boost::asio::local::stream_protocol::endpoint ep(path);
+        acceptor_.open(ep.protocol());
+        acceptor_.bind(ep);
+        acceptor_.listen(1);
+        start_accept();
+    }
+    catch (const std::exception& e)
+    {
+        logger << "Unable to listen for handoffs on '" << path << "': "
+            << e.what() << std::endl;
+    }
+}
+
+void handoff_listener::start_accept()
+{
+    acceptor_.async_accept(socket_, boost::bind(&handoff_listener::handle_accept,
+        this, boost::asio::placeholders::error));
+}
+
+void handoff_listener::handle_accept(const boost::system::error_code& e)
+{
+    if (e) return;
+
+    std::vector<int> fds = server_.listen_fds();
+    if (fds.size() > max_listen_fds) fds.resize(max_listen_fds);
+
+    handoff_hello hello;
+    memcpy(hello.magic, handoff_magic, sizeof(handoff_magic));
+    hello.num_fds = fds.size();
+
+    iovec iov;
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+
+    char control[CMSG_SPACE(max_listen_fds * sizeof(int))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(fds.size() * sizeof(int));
+
+    cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+    if (!fds.empty())
+        memcpy(CMSG_DATA(c), &fds[0], fds.size() * sizeof(int));
+
+    ssize_t n;
+    do { n = sendmsg(socket_.native_handle(), &msg, 0); } while (n < 0 && errno == EINTR);
+    if (n != sizeof(hello))
+    {
+        int err = errno;
+        logger << "handoff failed: " << strerror(err) << std::endl;
+        boost::system::error_code ec;
+        socket_.close(ec);
+        start_accept();
+        return;
+    }
+
+    // the new process is accepting connections on the same sockets as
+    // soon as it has the state. Until then, this process keeps serving
+    snapshot_(state_);
+    state_size_ = state_.size();
+
+    std::vector<boost::asio::const_buffer> buffers;
+    buffers.push_back(boost::asio::buffer(&state_size_, sizeof(state_size_)));
+    buffers.push_back(boost::asio::buffer(state_));
+    boost::asio::async_write(socket_, buffers, boost::bind(
+        &handoff_listener::handle_write, this, boost::asio::placeholders::error));
+}
+
+void handoff_listener::handle_write(const boost::system::error_code& e)
+{
+    boost::system::error_code ec;
+    socket_.close(ec);
+    std::vector<char>().swap(state_);
+
+    if (e)
+    {
+        logger << "handoff failed: " << e.message() << std::endl;
+        start_accept();
+        return;
+    }
+
+    acceptor_.close(ec);
+    logger << "handoff complete, shutting down" << std::endl;
+    done_();
+    kill(getpid(), SIGTERM);
+}
+
+#else
+
+bool receive_handoff(const std::string&, std::vector<int>&, std::vector<char>&)
+{
+    return false;
+}
+
+#endif
+
+} // namespace server
+} // namespace http
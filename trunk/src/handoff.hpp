@@ -0,0 +1,107 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __HANDOFF_HPP__
+#define __HANDOFF_HPP__
+
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include "templates.h"
+
+/*
+
+handoff protocol:
+
+A running tracker started with --handoff-socket listens on a unix
+domain socket. A new tracker started with the same option connects
+to it before it opens any sockets of its own, and receives:
+
+4 bytes    magic ("HLXH")
+4 bytes    number of listening sockets
+           the listening sockets themselves, as SCM_RIGHTS ancillary
+           data on the same message
+8 bytes    size of the state image (host order)
+           the state image (see state_segment.hpp)
+
+The old process keeps serving until the image is sent, and then shuts
+down, answering the requests it has already received. The new process
+accepts on the same listening sockets, so no connection is refused
+during the upgrade.
+
+*/
+
+namespace http {
+namespace server {
+
+class server;
+
+// connects to the tracker listening for handoffs on path and receives
+// its listening sockets and state. Returns false if there's no tracker
+// on path, or if the handoff failed.
+bool receive_handoff(const std::string& path, std::vector<int>& listen_fds,
+    std::vector<char>& state);
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+
+/// Waits for a new process to connect to the handoff socket, and hands
+/// the server's listening sockets and a snapshot of the state over to it.
+/// Once the handoff is complete, this process is shut down (by raising
+/// SIGTERM, just like a normal stop).
+class handoff_listener : private boost::noncopyable
+{
+public:
+    typedef boost::function<void (std::vector<char>&)> snapshot_f_t;
+    typedef boost::function<void ()> done_f_t;
+
+    // snapshot is called to fill in the state image once a new process
+    // connects, done after it has been sent
+    handoff_listener(server& s, const std::string& path,
+        snapshot_f_t snapshot, done_f_t done);
+
+private:
+    void start_accept();
+    void handle_accept(const boost::system::error_code& e);
+    void handle_write(const boost::system::error_code& e);
+
+    server& server_;
+    std::string path_;
+    snapshot_f_t snapshot_;
+    done_f_t done_;
+
+    boost::asio::local::stream_protocol::acceptor acceptor_;
+    boost::asio::local::stream_protocol::socket socket_;
+
+    std::vector<char> state_;
+    uint64 state_size_;
+};
+
+#endif
+
+} // namespace server
+} // namespace http
+
+#endif //__HANDOFF_HPP__
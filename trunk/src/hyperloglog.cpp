@@ -0,0 +1,99 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "hyperloglog.hpp"
+#include <math.h>
+#include <algorithm>
+
+namespace
+{
+    // FNV-1a, followed by the MurmurHash3 finalizer to spread the
+    // bits, since the estimate relies on every bit being random
+    uint64 hash_key(unsigned char const* p, int len)
+    {
+        uint64 h = 14695981039346656037ULL;
+        for (int i = 0; i < len; ++i)
+        {
+            h ^= p[i];
+            h *= 1099511628211ULL;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+}
+
+HyperLogLog::HyperLogLog(int precision)
+    : precision_(precision),
+      registers_(size_t(1) << precision, 0)
+{
+}
+
+void HyperLogLog::add(void const* key, int len)
+{
+    uint64 h = hash_key((unsigned char const*)key, len);
+    // the first bits pick the register, the rest is the value
+    size_t index = size_t(h >> (64 - precision_));
+    uint64 rest = h << precision_;
+    uint8 rank = 1;
+    while (rank <= 64 - precision_ && (rest & (uint64(1) << 63)) == 0)
+    {
+        ++rank;
+        rest <<= 1;
+    }
+    if (rank > registers_[index]) registers_[index] = rank;
+}
+
+uint64 HyperLogLog::estimate() const
+{
+    double m = double(registers_.size());
+    double sum = 0;
+    int zeros = 0;
+    for (std::vector<uint8>::const_iterator i = registers_.begin();
+        i != registers_.end(); ++i)
+    {
+        sum += ldexp(1.0, -int(*i));
+        if (*i == 0) ++zeros;
+    }
+    double alpha = 0.7213 / (1.0 + 1.079 / m);
+    double e = alpha * m * m / sum;
+    // linear counting is more accurate for small sets
+    if (e <= 2.5 * m && zeros > 0)
+        e = m * log(m / zeros);
+    return uint64(e + 0.5);
+}
+
+void HyperLogLog::clear()
+{
+    std::fill(registers_.begin(), registers_.end(), 0);
+}
+
+double HyperLogLog::error(int precision)
+{
+    return 1.04 / sqrt(double(size_t(1) << precision));
+}
@@ -0,0 +1,56 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef __HYPERLOGLOG_HPP__
+#define __HYPERLOGLOG_HPP__
+
+#include <vector>
+#include "templates.h"
+
+/// Estimates the number of distinct keys added to it in a fixed
+/// amount of memory (2^precision bytes), with a relative standard
+/// error of about 1.04 / sqrt(2^precision). Keys can't be removed,
+/// the estimate is started over with clear().
+class HyperLogLog
+{
+public:
+    enum { default_precision = 12 };
+
+    explicit HyperLogLog(int precision = default_precision);
+
+    void add(void const* key, int len);
+    uint64 estimate() const;
+    void clear();
+
+    size_t memory() const { return registers_.size(); }
+    // the relative standard error of the estimate
+    static double error(int precision = default_precision);
+
+private:
+    int precision_;
+    std::vector<uint8> registers_;
+};
+
+#endif //__HYPERLOGLOG_HPP__
@@ -0,0 +1,232 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "journal.hpp"
+#include "utils.hpp"
+
+#include <sstream>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <boost/bind.hpp>
+
+#if defined(_WIN32)
+#include <io.h>
+#define fsync(fd) _commit(fd)
+#define fileno _fileno
+#else
+#include <unistd.h>
+#endif
+
+Journal::Journal(const std::string& filename, int commit_ms, size_t capacity)
+    : filename_(filename),
+      file_(NULL),
+      commit_ms_(commit_ms),
+      head_(0),
+      tail_(0),
+      running_(false),
+      records_logged_(0),
+      records_dropped_(0),
+      records_written_(0),
+      commits_(0),
+      truncations_(0),
+      write_errors_(0)
+{
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    ring_.reset(new journal_record[size]);
+    mask_ = size - 1;
+
+    if (commit_ms_ <= 0) commit_ms_ = 1;
+}
+
+Journal::~Journal()
+{
+    stop();
+}
+
+void Journal::start()
+{
+    assert(!running_);
+
+    // the journal is replayed before it's opened, so just keep
+    // appending to it. It's truncated by the next checkpoint.
+    file_ = fopen(filename_.c_str(), "ab");
+    if (file_ == NULL)
+    {
+        int e = errno;
+        logger << "unable to open journal '" << filename_ << "': "
+            << strerror(e) << std::endl;
+        return;
+    }
+
+    running_ = true;
+    thread_.reset(new boost::thread(boost::bind(&Journal::run, this)));
+    logger << "journaling peer changes to '" << filename_ << "'" << std::endl;
+}
+
+void Journal::stop()
+{
+    if (!thread_) return;
+
+    running_ = false;
+    thread_->join();
+    thread_.reset();
+    if (file_) fclose(file_);
+    file_ = NULL;
+}
+
+void Journal::log(journal_record const& r)
+{
+    if (!running_) return;
+
+    size_t head = head_;
+    if (head - tail_ > mask_)
+    {
+        ++records_dropped_;
+        return;
+    }
+
+    ring_[head & mask_] = r;
+    // make sure the record is written before it's published
+    memory_barrier();
+    head_ = head + 1;
+    ++records_logged_;
+}
+
+void Journal::truncate()
+{
+    journal_record r;
+    memset(&r, 0, sizeof(r));
+    r.type = JOURNAL_TRUNCATE;
+    r.time = time(NULL);
+    log(r);
+}
+
+void Journal::run()
+{
+    std::vector<journal_record> batch;
+
+    // keep draining after stop() until the ring is empty, so that
+    // a clean shutdown doesn't lose the last commit interval
+    for (bool last = false; !last;)
+    {
+        last = !running_;
+        if (!last)
+            boost::this_thread::sleep(boost::posix_time::milliseconds(commit_ms_));
+
+        size_t head = head_;
+        memory_barrier();
+        size_t tail = tail_;
+
+        bool truncated = false;
+        batch.clear();
+        for (; tail != head; ++tail)
+        {
+            journal_record const& r = ring_[tail & mask_];
+            if (r.type == JOURNAL_TRUNCATE)
+            {
+                // everything collected so far is already part
+                // of the checkpoint
+                batch.clear();
+                truncated = true;
+                continue;
+            }
+            batch.push_back(r);
+        }
+        memory_barrier();
+        tail_ = tail;
+
+        if (!batch.empty() || truncated)
+            commit(batch, truncated);
+    }
+}
+
+bool Journal::commit(std::vector<journal_record> const& batch, bool truncated)
+{
+    if (truncated)
+    {
+        FILE* f = freopen(filename_.c_str(), "wb", file_);
+        if (f == NULL)
+        {
+            ++write_errors_;
+            file_ = fopen(filename_.c_str(), "ab");
+            if (file_ == NULL)
+            {
+                running_ = false;
+                return false;
+            }
+        }
+        else
+        {
+            file_ = f;
+        }
+        ++truncations_;
+    }
+
+    if (!batch.empty())
+    {
+        size_t n = fwrite(&batch[0], sizeof(journal_record), batch.size(), file_);
+        if (n != batch.size()) ++write_errors_;
+        records_written_ += n;
+    }
+
+    fflush(file_);
+    fsync(fileno(file_));
+    ++commits_;
+    return true;
+}
+
+int64 Journal::replay(const std::string& filename, replay_f_t f)
+{
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (file == NULL) return 0;
+
+    int64 ret = 0;
+    journal_record r;
+    while (fread(&r, sizeof(r), 1, file) == 1)
+    {
+        if (r.type < JOURNAL_ADD || r.type >= JOURNAL_TRUNCATE) continue;
+        f(r);
+        ++ret;
+    }
+    fclose(file);
+    return ret;
+}
+
+std::string Journal::instance_stats()
+{
+    std::stringstream st;
+
+    st << "Journal records logged: " << records_logged_ << std::endl;
+    st << "Journal records dropped: " << records_dropped_ << std::endl;
+    st << "Journal records written: " << records_written_ << std::endl;
+    st << "Journal commits: " << commits_ << std::endl;
+    st << "Journal truncations: " << truncations_ << std::endl;
+    st << "Journal write errors: " << write_errors_ << std::endl;
+    st << "Journal queue length: " << (head_ - tail_) << std::endl;
+
+    return st.str();
+}
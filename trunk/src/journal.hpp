@@ -0,0 +1,149 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __JOURNAL_HPP__
+#define __JOURNAL_HPP__
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include "templates.h"
+
+#if defined(_WIN32)
+#define memory_barrier() MemoryBarrier()
+#else
+#define memory_barrier() __sync_synchronize()
+#endif
+
+// record types
+enum journal_type_e {
+    // a new peer joined the swarm
+    JOURNAL_ADD = 1,
+    // the peer moved to another category (completed, paused, resumed)
+    JOURNAL_UPDATE,
+    // a NAT-check verified the peer's v4 endpoint
+    JOURNAL_ENDPOINT4,
+    // a NAT-check verified the peer's v6 endpoint
+    JOURNAL_ENDPOINT6,
+    // the peer stopped or timed out
+    JOURNAL_REMOVE,
+    // everything before this record is covered by a checkpoint.
+    // this is never written to disk
+    JOURNAL_TRUNCATE,
+};
+
+/*
+
+journal format:
+
+the journal is a flat sequence of 64 byte records in host byte
+order. A partial record at the end of the file (from a crash in
+the middle of a write) is ignored on replay.
+
+1 byte     record type (journal_type_e)
+1 byte     peer status bits
+2 bytes    port (network order, as stored in the endpoint tables)
+4 bytes    time of the change
+20 bytes   info-hash
+20 bytes   peer-id
+16 bytes   IP (the first 4 bytes for v4)
+
+*/
+struct journal_record
+{
+    uint8 type;
+    uint8 status;
+    uint16 port;
+    int32 time;
+    byte info_hash[20];
+    byte peer_id[20];
+    byte ip[16];
+};
+
+BOOST_STATIC_ASSERT(sizeof(journal_record) == 64);
+
+/// Append-only log of peer state changes between checkpoints.
+/// The network thread only copies records into a single-producer,
+/// single-consumer ring buffer. A background thread drains the ring
+/// and writes everything it finds with one write and one sync
+/// (group commit).
+class Journal : private boost::noncopyable
+{
+public:
+    typedef boost::function<void (journal_record const&)> replay_f_t;
+
+    // capacity is rounded up to a power of two
+    Journal(const std::string& filename, int commit_ms, size_t capacity = 65536);
+    ~Journal();
+
+    void start();
+    void stop();
+
+    // called from the network thread. Never blocks, if the ring
+    // buffer is full the record is dropped and counted.
+    void log(journal_record const& r);
+
+    // called right after a checkpoint has been saved. The records
+    // logged so far are covered by it and are discarded.
+    void truncate();
+
+    // reads the journal file and calls f for every complete record.
+    // returns the number of records replayed.
+    static int64 replay(const std::string& filename, replay_f_t f);
+
+    std::string instance_stats();
+
+private:
+    void run();
+    bool commit(std::vector<journal_record> const& batch, bool truncated);
+
+    std::string filename_;
+    FILE* file_;
+    int commit_ms_;
+
+    // ring buffer. head_ is only written by the producer (network
+    // thread) and tail_ only by the consumer (the writer thread).
+    boost::scoped_array<journal_record> ring_;
+    size_t mask_;
+    volatile size_t head_;
+    volatile size_t tail_;
+
+    volatile bool running_;
+    boost::scoped_ptr<boost::thread> thread_;
+
+    int64 records_logged_;
+    int64 records_dropped_;
+    int64 records_written_;
+    int64 commits_;
+    int64 truncations_;
+    int64 write_errors_;
+};
+
+#endif //__JOURNAL_HPP__
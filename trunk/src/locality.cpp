@@ -0,0 +1,175 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "locality.hpp"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <boost/lexical_cast.hpp>
+#include "utils.hpp"
+
+std::vector<network_map::prefixes> network_map::v4_;
+std::vector<network_map::prefixes> network_map::v6_;
+std::string network_map::filename_;
+
+namespace
+{
+    // networks from the AS table have the top bit set, so they can't
+    // be mistaken for a prefix
+    uint64 const as_network = uint64(1) << 63;
+
+    uint64 first_bytes(unsigned char const* p, int n)
+    {
+        uint64 ret = 0;
+        for (int i = 0; i < n; ++i) ret = (ret << 8) | p[i];
+        return ret;
+    }
+
+    // the first length of bits bits
+    uint64 prefix_mask(int length, int bits)
+    {
+        if (length == 0) return 0;
+        return (~uint64(0) << (bits - length)) & (~uint64(0) >> (64 - bits));
+    }
+
+    // the prefixes of one family, indexed by length, are moved to
+    // table longest first
+    template <class Prefixes>
+    void sort_prefixes(std::vector<Prefixes>& by_length, std::vector<Prefixes>& table)
+    {
+        table.clear();
+        for (int length = by_length.size() - 1; length >= 0; --length)
+        {
+            if (by_length[length].as.empty()) continue;
+            table.push_back(Prefixes());
+            table.back().length = length;
+            table.back().as.swap(by_length[length].as);
+        }
+    }
+}
+
+uint32 network_map::lookup(std::vector<prefixes> const& table,
+    uint64 address, int bits)
+{
+    for (std::vector<prefixes>::const_iterator i = table.begin();
+        i != table.end(); ++i)
+    {
+        hash_map<uint64, uint32, hash<uint64> >::const_iterator as
+            = i->as.find(address & prefix_mask(i->length, bits));
+        if (as != i->as.end()) return as->second;
+    }
+    return 0;
+}
+
+uint64 network_map::network(boost::asio::ip::address_v4::bytes_type const& ip)
+{
+    if (!v4_.empty())
+    {
+        uint32 as = lookup(v4_, first_bytes(&ip[0], 4), 32);
+        if (as) return as_network | as;
+    }
+    return first_bytes(&ip[0], 2);
+}
+
+uint64 network_map::network(boost::asio::ip::address_v6::bytes_type const& ip)
+{
+    if (!v6_.empty())
+    {
+        uint32 as = lookup(v6_, first_bytes(&ip[0], 8), 64);
+        if (as) return as_network | as;
+    }
+    return first_bytes(&ip[0], 6);
+}
+
+size_t network_map::size()
+{
+    size_t ret = 0;
+    for (size_t i = 0; i < v4_.size(); ++i) ret += v4_[i].as.size();
+    for (size_t i = 0; i < v6_.size(); ++i) ret += v6_[i].as.size();
+    return ret;
+}
+
+size_t network_map::load(std::string const& filename)
+{
+    // the old table stays if the new one can't be loaded
+    std::vector<prefixes> v4(33);
+    std::vector<prefixes> v6(65);
+
+    if (!filename.empty())
+    {
+        std::ifstream in(filename.c_str());
+        if (!in)
+            throw std::runtime_error("can't open AS table " + filename);
+
+        std::string line;
+        for (int n = 1; std::getline(in, line); ++n)
+        {
+            std::istringstream is(line);
+            std::string prefix;
+            std::string as;
+            if (!(is >> prefix) || prefix[0] == '#') continue;
+            is >> as;
+            if (as.compare(0, 2, "AS") == 0) as.erase(0, 2);
+
+            std::string::size_type slash = prefix.find('/');
+            boost::system::error_code ec;
+            boost::asio::ip::address addr = boost::asio::ip::address::from_string(
+                prefix.substr(0, slash), ec);
+            int length = -1;
+            uint32 number = 0;
+            if (!ec && slash != std::string::npos)
+            {
+                length = safe_lexical_cast<int>(prefix.substr(slash + 1), -1);
+                number = safe_lexical_cast<uint32>(as, 0);
+            }
+            int const bits = addr.is_v4() ? 32 : 128;
+            if (ec || length < 0 || length > bits || number == 0)
+            {
+                throw std::runtime_error(filename + ":"
+                    + boost::lexical_cast<std::string>(n)
+                    + ": expected <prefix>/<length> <AS number>");
+            }
+
+            if (addr.is_v4())
+            {
+                uint64 a = first_bytes(&addr.to_v4().to_bytes()[0], 4);
+                v4[length].as[a & prefix_mask(length, 32)] = number;
+            }
+            else
+            {
+                // only the first 64 bits of v6 prefixes are routed
+                length = std::min(length, 64);
+                uint64 a = first_bytes(&addr.to_v6().to_bytes()[0], 8);
+                v6[length].as[a & prefix_mask(length, 64)] = number;
+            }
+        }
+    }
+
+    sort_prefixes(v4, v4_);
+    sort_prefixes(v6, v6_);
+    filename_ = filename;
+    return size();
+}
@@ -0,0 +1,202 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef __LOCALITY_HPP__
+#define __LOCALITY_HPP__
+
+#include <string>
+#include <vector>
+#include <cassert>
+#include <boost/asio/ip/address.hpp>
+#include "templates.h"
+#include "xplat_hash_map.hpp"
+#include "chunked_vector.hpp"
+#include "peer_list.hpp"
+
+USING_NAMESPACE_EXT
+
+/// The network of an address, that peers close to each other share.
+/// Without an AS table it's the /16 of a v4 address or the /48 of a
+/// v6 one. An AS table maps the prefixes it covers to their AS, the
+/// longest matching prefix wins.
+class network_map
+{
+public:
+    static uint64 network(boost::asio::ip::address_v4::bytes_type const& ip);
+    static uint64 network(boost::asio::ip::address_v6::bytes_type const& ip);
+
+    // loads an AS table, lines of "<prefix>/<length> <AS number>".
+    // Blank lines and lines starting with # are skipped. Returns the
+    // number of prefixes, throws std::runtime_error if the file can't
+    // be read or a line can't be parsed. An empty filename unloads
+    // the table. Endpoints already grouped keep their networks
+    static size_t load(std::string const& filename);
+    static std::string const& filename() { return filename_; }
+    static size_t size();
+
+private:
+    // prefixes of one length, the first 64 bits of a v6 prefix
+    struct prefixes
+    {
+        int length;
+        hash_map<uint64, uint32, hash<uint64> > as;
+    };
+    // returns the AS of the address (bits long), or 0
+    static uint32 lookup(std::vector<prefixes> const& table,
+        uint64 address, int bits);
+
+    // longest prefixes first
+    static std::vector<prefixes> v4_;
+    static std::vector<prefixes> v6_;
+    static std::string filename_;
+};
+
+/// The endpoints of one endpoint list grouped by a key, their network
+/// or the time they last checked in. A group is a circular list linked
+/// through columns indexed like the endpoint list, and it's found by
+/// its key through the endpoint it hands out next. Adding, removing
+/// and moving an endpoint is O(1).
+class endpoint_groups : private boost::noncopyable
+{
+public:
+    // the endpoint at index was appended to the list
+    void add(int index, uint64 key)
+    {
+        assert(index == int(key_.size()));
+        key_.push_back(key);
+        next_.push_back(index);
+        prev_.push_back(index);
+        link(index);
+    }
+
+    // the endpoint at index was removed from the list, and the last
+    // one moved into its place
+    void remove(int index)
+    {
+        int last = key_.size() - 1;
+        assert(index >= 0 && index <= last);
+        unlink(index);
+        if (index != last)
+        {
+            key_[index] = key_[last];
+            unlink(last);
+            link(index);
+        }
+        key_.pop_back();
+        next_.pop_back();
+        prev_.pop_back();
+    }
+
+    // the endpoint at index has a new key. It's handed out last in
+    // its new group
+    void update(int index, uint64 key)
+    {
+        if (key_[index] == key) return;
+        unlink(index);
+        key_[index] = key;
+        link(index);
+    }
+
+    // appends up to count endpoints of the group of key that
+    // accept(index) lets through, and moves the group on past the
+    // ones looked at. At most 4 * count + 16 are looked at. Returns
+    // the number appended
+    template <class Endpoint, class Accept>
+    int hand_out(uint64 key, int count,
+        chunked_vector<Endpoint, endpoint_memory> const& endpoints,
+        peer_list& peers, Accept const& accept)
+    {
+        if (count <= 0) return 0;
+        group_map::iterator g = groups_.find(key);
+        if (g == groups_.end()) return 0;
+        int const first = g->second;
+        int const max_scan = count * 4 + 16;
+        int i = first;
+        int ret = 0;
+        int scanned = 0;
+        do
+        {
+            if (accept(i))
+            {
+                peers.append((char const*)&endpoints[i], sizeof(Endpoint));
+                ++ret;
+            }
+            i = next_[i];
+        } while (ret < count && i != first && ++scanned < max_scan);
+        g->second = i;
+        return ret;
+    }
+
+    size_t size() const { return key_.size(); }
+    size_t num_groups() const { return groups_.size(); }
+    size_t shrink()
+    {
+        return key_.shrink() + next_.shrink() + prev_.shrink();
+    }
+
+private:
+    // adds the endpoint at index to its group, to be handed out last
+    void link(int index)
+    {
+        std::pair<group_map::iterator, bool> g
+            = groups_.insert(std::make_pair(key_[index], index));
+        if (g.second)
+        {
+            next_[index] = prev_[index] = index;
+            return;
+        }
+        int next = g.first->second;
+        int prev = prev_[next];
+        next_[prev] = index;
+        prev_[index] = prev;
+        next_[index] = next;
+        prev_[next] = index;
+    }
+
+    void unlink(int index)
+    {
+        int next = next_[index];
+        int prev = prev_[index];
+        group_map::iterator g = groups_.find(key_[index]);
+        assert(g != groups_.end());
+        if (next == index)
+        {
+            groups_.erase(g);
+            return;
+        }
+        next_[prev] = next;
+        prev_[next] = prev;
+        if (g->second == index) g->second = next;
+    }
+
+    // key -> the endpoint its group hands out next
+    typedef hash_map<uint64, int, hash<uint64> > group_map;
+    group_map groups_;
+    chunked_vector<uint64, endpoint_memory> key_;
+    chunked_vector<int, endpoint_memory> next_;
+    chunked_vector<int, endpoint_memory> prev_;
+};
+
+#endif //__LOCALITY_HPP__
@@ -23,6 +23,7 @@ THE SOFTWARE.
 */
 
 #include "natcheck.hpp"
+#include "control.hpp"
 #include "utils.hpp"
 
 #include <iostream>
@@ -30,29 +31,139 @@ THE SOFTWARE.
 #include <ostream>
 #include <string>
 #include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <deque>
-
-#define NC_TIMEOUT 15
-#define NC_MAX_CHECKING 256
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <climits>
+#include <cerrno>
+#include <sys/resource.h>
 
 using boost::asio::ip::tcp;
 
 static const char _ident_string[] = "\x13" "BitTorrent protocol";
 static const char _peer_id[] = "DNA1000-000000000000";
 
+namespace
+{
+    // a check waiting to run
+    struct nc_job
+    {
+        tcp::endpoint endpoint;
+        byte info_hash[20];
+        byte peer_id[SIZE_OF_PEER_ID];
+        CallbackHandler<int> handler;
+        struct timeval queued;
+    };
+
+    enum nc_outcome { nc_passed, nc_failed, nc_timed_out };
+
+    // a running check. While it runs, the engine thread owns the socket,
+    // the timer, the buffers and the result, and the network thread the
+    // job. Once it's handed back the network thread owns all of it
+    struct nc_check : private boost::noncopyable
+    {
+        explicit nc_check(boost::asio::io_service& io_service)
+            : ios(&io_service), socket(io_service), timer(io_service), generation(0),
+              done(true), outcome(nc_failed), message(NULL)
+        {}
+
+        boost::asio::io_service* ios;
+        nc_job job;
+        int timeout;
+
+        tcp::socket socket;
+        Timer timer;
+        PeerConnHeader request;
+        PeerConnHeader response;
+        // handlers of an earlier use of the check see a different one
+        int generation;
+        bool done;
+
+        nc_outcome outcome;
+        const char* message;
+        boost::system::error_code error;
+    };
+
+    // the thread the checks run on
+    struct nc_engine
+    {
+        boost::asio::io_service ios;
+        boost::scoped_ptr<boost::asio::io_service::work> work;
+        boost::scoped_ptr<boost::thread> thread;
+    };
+}
+
 int num_checking = 0;
-typedef std::deque< boost::shared_ptr< NatCheck > > nc_queue_type;
-nc_queue_type nc_queue;
-
-long NatCheck::natcheck_started;
-long NatCheck::natcheck_created;
-long NatCheck::natcheck_deleted;
-long NatCheck::natcheck_success;
-double NatCheck::natcheck_success_sum;
-long NatCheck::natcheck_fail;
-double NatCheck::natcheck_fail_sum;
-long NatCheck::natcheck_timeout;
-double NatCheck::natcheck_timeout_sum;
+// one queue per priority, each served oldest first
+typedef std::deque<nc_job> nc_queue_type;
+nc_queue_type nc_queue[NatCheck::num_priorities];
+int nc_queued = 0;
+long nc_dropped = 0;
+
+// the number of checks run at once. It backs off when too many time out
+// or sockets run out, and grows back while it's the bottleneck
+int nc_limit = 256;
+time_t nc_window_start = 0;
+time_t nc_last_backoff = 0;
+int nc_window_done = 0;
+int nc_window_timeouts = 0;
+int nc_window_fd_errors = 0;
+
+// results of finished checks. A peer that's reachable on one torrent
+// is reachable on all of them, so every swarm shares these
+struct nc_result
+{
+    time_t expires;
+    bool ok;
+};
+typedef std::map<tcp::endpoint, nc_result> nc_cache_type;
+nc_cache_type nc_cache;
+// cached endpoints in the order they expire, one queue per TTL
+typedef std::deque<std::pair<time_t, tcp::endpoint> > nc_expiry_type;
+nc_expiry_type nc_expiry[2];
+
+// handlers waiting on a queued or running check of the same endpoint
+typedef std::map<tcp::endpoint, std::vector<CallbackHandler<int> > > nc_waiting_type;
+nc_waiting_type nc_waiting;
+
+long nc_cache_hits = 0;
+long nc_cache_misses = 0;
+long nc_coalesced = 0;
+
+boost::scoped_ptr<nc_engine> engine;
+// the io_service the handlers are called on
+boost::asio::io_service* nc_home = NULL;
+// every check allocated, and the ones that aren't running
+std::vector<nc_check*> nc_pool;
+std::vector<nc_check*> nc_free;
+
+// finished checks, waiting for the network thread to pick them up
+boost::mutex nc_results_mutex;
+std::vector<nc_check*> nc_results;
+std::vector<nc_check*> nc_delivering;
+long nc_batches = 0;
+long nc_batched = 0;
+
+long natcheck_started;
+long natcheck_success;
+double natcheck_success_sum;
+long natcheck_fail;
+double natcheck_fail_sum;
+long natcheck_timeout;
+double natcheck_timeout_sum;
+
+int NatCheck::cache_ok_ttl = 30 * 60;
+int NatCheck::cache_fail_ttl = 5 * 60;
+int NatCheck::cache_size = 1000000;
+int NatCheck::timeout = 15;
+int NatCheck::max_checking = 256;
+int NatCheck::min_checking = 16;
+int NatCheck::timeout_target = 50;
+int NatCheck::fd_reserve = 1024;
+int NatCheck::queue_size = 10000;
+int NatCheck::few_endpoints = 10;
 
 void BuildLoginPacket(PeerConnHeader &hdr, const byte *binary_infohash)
 {
@@ -65,277 +176,536 @@ void BuildLoginPacket(PeerConnHeader &hdr, const byte *binary_infohash)
     memcpy(hdr.peer_id, _peer_id, SIZE_OF_PEER_ID);
 }
 
-void ParseLoginPacket(PeerConnHeader *hdr, const byte *binary_infohash, const byte *peer_id)
+// returns what's wrong with the handshake, or NULL
+const char* ParseLoginPacket(PeerConnHeader const *hdr, const byte *binary_infohash, const byte *peer_id)
 {
     if (memcmp(hdr->ident, _ident_string, 20) != 0) {
-        throw std::logic_error("Incorrect protocol header");
+        return "Incorrect protocol header";
     }
     if (memcmp(hdr->info, binary_infohash, 20) != 0) {
-        throw std::logic_error("Incorrect infohash");
+        return "Incorrect infohash";
     }
     if (memcmp(hdr->peer_id, peer_id, SIZE_OF_PEER_ID) != 0) {
         // exclude magic id, for load tester
         if (memcmp(hdr->peer_id, MAGIC_PEERID, SIZE_OF_PEER_ID) != 0) {
-            throw std::logic_error("Incorrect peer id");
+            return "Incorrect peer id";
         }
     }
+    return NULL;
 }
 
-
-void start_from_queue()
+static double tv_delta(const struct timeval &tv1, const struct timeval &tv2)
 {
-    if ((num_checking < NC_MAX_CHECKING) && !nc_queue.empty())
-    {
-        //logger << "starting a natcheck, " << nc_queue.size() << " queued" << std::endl;
-        boost::shared_ptr<NatCheck> n = nc_queue.back();
-        nc_queue.pop_back();
-        n->start();
-    }
+    return tv2.tv_sec - tv1.tv_sec + 1e-6 * (tv2.tv_usec - tv1.tv_usec);
 }
 
-double nc_queue_average_age()
+static double job_age(nc_job const& j, struct timeval *now = 0)
 {
-    nc_queue_type::iterator it;
-    double total = 0;
-    struct timeval now;
-    int n = nc_queue.size();
-
-    if (n == 0) return 0;
-
-    gettimeofday(&now, 0);
+    struct timeval tv;
 
-    for (it = nc_queue.begin(); it != nc_queue.end(); it++)
+    if (!now)
     {
-        total += (*it)->age(&now);
+        now = &tv;
+        gettimeofday(now, 0);
     }
 
-    return total / n;
+    return tv_delta(j.queued, *now);
 }
 
-void StartNatCheck(boost::asio::io_service& io_service, tcp::endpoint const& endpoint,
-                   const byte* binary_infohash, const byte* peer_id,
-                   CallbackHandler<int> handler)
+// engine thread
+
+static void handle_timeout(nc_check* c, int generation, const char* msg,
+                           const boost::system::error_code& err);
+
+static void set_timer(nc_check* c, const char* msg)
 {
-    boost::shared_ptr<NatCheck> n(new NatCheck(io_service, endpoint, binary_infohash, peer_id, handler));
-    nc_queue.push_back(n);
-    start_from_queue();
+    c->timer.expires_from_now(boost::posix_time::seconds(c->timeout));
+    c->timer.async_wait(boost::bind(&handle_timeout, c, c->generation, msg,
+                                    boost::asio::placeholders::error));
 }
 
-NatCheck::NatCheck(boost::asio::io_service& io_service,
-                   tcp::endpoint const& endpoint,
-                   const byte* binary_infohash, const byte* peer_id,
-                   CallbackHandler<int> handler)
-    : socket_(io_service), timer_(io_service), endpoint_(endpoint)
-{
-    assert(handler);
-    handler_ = handler;
-    socket_closed = true;
-    memcpy(binary_infohash_, binary_infohash, 20);
-    memcpy(peer_id_, peer_id, SIZE_OF_PEER_ID);
-    gettimeofday(&birthtime_, 0);
-    natcheck_created++;
-}
+static void deliver_results();
 
-NatCheck::~NatCheck()
+static void finish(nc_check* c, nc_outcome outcome, const char* msg,
+                   const boost::system::error_code& err)
 {
-    natcheck_deleted++;
+    boost::system::error_code ec;
+    c->done = true;
+    c->outcome = outcome;
+    c->message = msg;
+    c->error = err;
+    c->timer.cancel(ec);
+    c->socket.close(ec);
+
+    bool first;
+    {
+        boost::mutex::scoped_lock l(nc_results_mutex);
+        first = nc_results.empty();
+        nc_results.push_back(c);
+    }
+    // the network thread picks up everything that finishes before it
+    // gets to it
+    if (first) nc_home->post(&deliver_results);
 }
 
-void NatCheck::start()
+static void handle_timeout(nc_check* c, int generation, const char* msg,
+                           const boost::system::error_code& err)
 {
-    natcheck_started++;
-    num_checking++;
-    socket_closed = false;
-#ifdef DISABLE_NATCHECK
-    result(1); // if natchecks are disabled, consider this natcheck passed right away
-    return;
-#endif
-    socket_.async_connect(endpoint_,
-                          boost::bind(&NatCheck::handle_connect, shared_from_this(),
-                                      boost::asio::placeholders::error));
-
-    timer_.expires_from_now(boost::posix_time::seconds(NC_TIMEOUT));
-    timer_.async_wait(boost::bind(&NatCheck::handle_timeout, shared_from_this(),
-                                  "Timeout while connecting",
-                                  boost::asio::placeholders::error));
+    // the timer was reset, or the check is done. no big deal.
+    if (generation != c->generation || c->done || err) return;
+    finish(c, nc_timed_out, msg, boost::system::error_code());
 }
 
-static double tv_delta(const struct timeval &tv1, const struct timeval &tv2)
+static void handle_handshake(nc_check* c, int generation, const boost::system::error_code& err)
 {
-    return tv2.tv_sec - tv1.tv_sec + 1e-6 * (tv2.tv_usec - tv1.tv_usec);
+    if (generation != c->generation || c->done) return;
+
+    // EOF is an error.
+    if (err)
+    {
+        finish(c, nc_failed, NULL, err);
+        return;
+    }
+
+    const char* msg = ParseLoginPacket(&c->response, c->job.info_hash, c->job.peer_id);
+    finish(c, msg ? nc_failed : nc_passed, msg, err);
 }
 
-double NatCheck::age(struct timeval *now)
+static void handle_write_handshake(nc_check* c, int generation, const boost::system::error_code& err)
 {
-    struct timeval tv;
+    if (generation != c->generation || c->done) return;
 
-    if (!now)
+    if (err)
     {
-        now = &tv;
-        gettimeofday(now, 0);
+        finish(c, nc_failed, NULL, err);
+        return;
     }
 
-    return tv_delta(birthtime_, *now);
+    boost::asio::async_read(c->socket, boost::asio::buffer(&c->response, sizeof(PeerConnHeader)),
+                            boost::bind(&handle_handshake, c, generation,
+                                        boost::asio::placeholders::error));
+    set_timer(c, "Timeout while reading");
 }
 
-std::string NatCheck::class_stats()
+static void handle_connect(nc_check* c, int generation, const boost::system::error_code& err)
 {
-    std::stringstream st;
+    if (generation != c->generation || c->done) return;
 
-    st << "NatCheck created: " << natcheck_created << std::endl;
-    st << "NatCheck deleted: " << natcheck_deleted << std::endl;
-    st << "NatCheck started: " << natcheck_started << std::endl;
-    st << "NatCheck success: " << natcheck_success << std::endl;
-    st << "NatCheck success time: " << natcheck_success_sum << std::endl;
-    st << "NatCheck fail: " << natcheck_fail << std::endl;
-    st << "NatCheck fail time: " << natcheck_fail_sum << std::endl;
-    st << "NatCheck timeout: " << natcheck_timeout << std::endl;
-    st << "NatCheck timeout time: " << natcheck_timeout_sum << std::endl;
-    st << "NatCheck queue length: " << nc_queue.size() << std::endl;
-    st << "NatCheck queue average age: " << nc_queue_average_age() << std::endl;
-    st << "NatCheck num_checking: " << num_checking << std::endl;
+    if (err)
+    {
+        finish(c, nc_failed, NULL, err);
+        return;
+    }
 
-    return st.str();
+    BuildLoginPacket(c->request, c->job.info_hash);
+    boost::asio::async_write(c->socket, boost::asio::buffer(&c->request, sizeof(PeerConnHeader)),
+                             boost::bind(&handle_write_handshake, c, generation,
+                                         boost::asio::placeholders::error));
+    set_timer(c, "Timeout while writing");
 }
 
-void NatCheck::result(int r)
+static void start_check(nc_check* c)
 {
-    CallbackHandler<int> h = handler_;
-    handler_ = NULL;
-    timer_.cancel();
-    h(r);
-    num_checking--;
-    natcheck_success++;
-    natcheck_success_sum += age();
-    start_from_queue();
+    ++c->generation;
+    c->done = false;
+    c->socket.async_connect(c->job.endpoint,
+                            boost::bind(&handle_connect, c, c->generation,
+                                        boost::asio::placeholders::error));
+    set_timer(c, "Timeout while connecting");
 }
 
-void NatCheck::result(const boost::system::error_code& err)
+static void run_engine(nc_engine* e)
 {
-    result(boost::system::system_error(err));
+    e->ios.run();
 }
 
-void NatCheck::result(const std::exception& exc)
+// network thread
+
+static boost::asio::io_service& check_service()
 {
-    timer_.cancel();
-    socket_closed = true;
-    socket_.close();
-    assert(handler_);
-    CallbackHandler<int> h = handler_;
-    assert(h);
-    handler_ = NULL;
-    assert(h);
-    h(exc);
-    assert(h);
-    natcheck_fail++;
-    natcheck_fail_sum += age();
-    num_checking--;
-    start_from_queue();
+    return engine ? engine->ios : *nc_home;
 }
 
-void NatCheck::handle_connect(const boost::system::error_code& err)
+static nc_check* take_check()
 {
-    if (socket_closed)
+    boost::asio::io_service& ios = check_service();
+    while (!nc_free.empty())
     {
-        return;
+        nc_check* c = nc_free.back();
+        nc_free.pop_back();
+        if (c->ios == &ios) return c;
+        // left from before the engine started
+        nc_pool.erase(std::find(nc_pool.begin(), nc_pool.end(), c));
+        delete c;
     }
+    nc_check* c = new nc_check(ios);
+    nc_pool.push_back(c);
+    return c;
+}
 
-    if (err)
+static void expire_one(nc_expiry_type& q)
+{
+    nc_cache_type::iterator i = nc_cache.find(q.front().second);
+    // unless the endpoint was checked again since
+    if (i != nc_cache.end() && i->second.expires == q.front().first)
+        nc_cache.erase(i);
+    q.pop_front();
+}
+
+static void expire_cache(time_t now)
+{
+    for (int k = 0; k < 2; ++k)
     {
-        result(err);
-        return;
+        while (!nc_expiry[k].empty() && nc_expiry[k].front().first <= now)
+            expire_one(nc_expiry[k]);
     }
+    while (nc_cache.size() > size_t(std::max(NatCheck::cache_size, 0)))
+    {
+        int k = nc_expiry[1].empty() || (!nc_expiry[0].empty()
+            && nc_expiry[0].front().first <= nc_expiry[1].front().first) ? 0 : 1;
+        expire_one(nc_expiry[k]);
+    }
+}
 
-    hdr_.reset(new PeerConnHeader);
-    BuildLoginPacket(*hdr_, binary_infohash_);
+// caches the result for ep, unless it was never checked, and returns the
+// handlers that were waiting on it
+static void finish_endpoint(tcp::endpoint const& ep, bool ok, bool checked,
+                            std::vector<CallbackHandler<int> >& waiting)
+{
+    int ttl = ok ? NatCheck::cache_ok_ttl : NatCheck::cache_fail_ttl;
+    if (checked && ttl > 0 && NatCheck::cache_size > 0)
+    {
+        time_t now = time(NULL);
+        nc_result& r = nc_cache[ep];
+        r.expires = now + ttl;
+        r.ok = ok;
+        nc_expiry[ok].push_back(std::make_pair(r.expires, ep));
+        expire_cache(now);
+    }
 
-    boost::asio::async_write(socket_,
-                             boost::asio::buffer((const void*)hdr_.get(), sizeof(PeerConnHeader)),
-                             boost::bind(&NatCheck::handle_write_handshake,
-                                         shared_from_this(),
-                                         boost::asio::placeholders::error));
+    nc_waiting_type::iterator i = nc_waiting.find(ep);
+    if (i == nc_waiting.end()) return;
+    waiting.swap(i->second);
+    nc_waiting.erase(i);
+}
 
-    timer_.expires_from_now(boost::posix_time::seconds(NC_TIMEOUT));
-    timer_.async_wait(boost::bind(&NatCheck::handle_timeout, shared_from_this(),
-                                  "Timeout while writing",
-                                  boost::asio::placeholders::error));
+static void fail(CallbackHandler<int>& h, std::vector<CallbackHandler<int> >& waiting,
+                 const std::exception& exc)
+{
+    h(exc);
+    for (size_t i = 0; i < waiting.size(); ++i)
+        waiting[i](exc);
 }
 
-void NatCheck::handle_write_handshake(const boost::system::error_code& err)
+// the most sockets natchecks may have open, leaving fd_reserve for the rest
+static int fd_limit()
 {
-    assert(hdr_);
-    hdr_.reset();
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY
+        || rl.rlim_cur > rlim_t(INT_MAX))
+        return INT_MAX;
+    return std::max(int(rl.rlim_cur) - NatCheck::fd_reserve, 1);
+}
 
-    if (socket_closed)
+// called at most once a second. Backing off waits a timeout between
+// steps, since that's how long it takes to see the effect
+static void adapt_limit(time_t now)
+{
+    if (now == nc_window_start) return;
+    nc_window_start = now;
+
+    if (nc_window_fd_errors > 0
+        || (nc_window_done >= 16 && now >= nc_last_backoff + NatCheck::timeout
+            && nc_window_timeouts * 100 > nc_window_done * NatCheck::timeout_target))
     {
-        return;
+        nc_limit -= nc_limit / 4;
+        nc_last_backoff = now;
     }
-
-    if (err)
+    else if (num_checking >= nc_limit && nc_queued > 0)
     {
-        result(err);
-        return;
+        nc_limit += nc_limit / 8 + 1;
     }
+    nc_limit = std::min(nc_limit, NatCheck::max_checking);
+    nc_limit = std::max(nc_limit, std::min(NatCheck::min_checking, NatCheck::max_checking));
+    // running out of sockets fails checks, and everything else
+    nc_limit = std::min(nc_limit, fd_limit());
+    nc_limit = std::max(nc_limit, 1);
+
+    nc_window_done = 0;
+    nc_window_timeouts = 0;
+    nc_window_fd_errors = 0;
+}
 
-    boost::asio::async_read(socket_, response_,
-                            boost::asio::transfer_at_least(sizeof(PeerConnHeader)),
-                            boost::bind(&NatCheck::handle_handshake, shared_from_this(),
-                                        boost::asio::placeholders::error));
+static void deliver(nc_check* c);
 
-    timer_.expires_from_now(boost::posix_time::seconds(NC_TIMEOUT));
-    timer_.async_wait(boost::bind(&NatCheck::handle_timeout, shared_from_this(),
-                                  "Timeout while reading",
-                                  boost::asio::placeholders::error));
+void start_from_queue()
+{
+    adapt_limit(time(NULL));
+    while (num_checking < nc_limit && nc_queued > 0)
+    {
+        int p = NatCheck::num_priorities - 1;
+        while (nc_queue[p].empty()) --p;
+        //logger << "starting a natcheck, " << nc_queued << " queued" << std::endl;
+        nc_check* c = take_check();
+        c->job = nc_queue[p].front();
+        c->timeout = NatCheck::timeout;
+        nc_queue[p].pop_front();
+        --nc_queued;
+        ++num_checking;
+        natcheck_started++;
+#ifdef DISABLE_NATCHECK
+        // if natchecks are disabled, consider this natcheck passed right away
+        c->outcome = nc_passed;
+        deliver(c);
+#else
+        check_service().post(boost::bind(&start_check, c));
+#endif
+    }
 }
 
+// hands a finished check's result to the swarms waiting on it, and puts
+// the check back in the pool
+static void deliver(nc_check* c)
+{
+    CallbackHandler<int> h = c->job.handler;
+    c->job.handler = NULL;
+    tcp::endpoint ep = c->job.endpoint;
+    double age = job_age(c->job);
+    nc_outcome outcome = c->outcome;
+    boost::system::error_code err = c->error;
+    const char* msg = c->message;
+    nc_free.push_back(c);
 
+    num_checking--;
+    ++nc_window_done;
 
-void NatCheck::handle_timeout(const char* msg, const boost::system::error_code& err)
-{
-    if (socket_closed)
+    std::vector<CallbackHandler<int> > waiting;
+    if (outcome == nc_passed)
     {
+        natcheck_success++;
+        natcheck_success_sum += age;
+        finish_endpoint(ep, true, true, waiting);
+        h(1);
+        for (size_t i = 0; i < waiting.size(); ++i)
+            waiting[i](1);
         return;
     }
 
-    if (err)
+    if (outcome == nc_timed_out)
     {
-        // the timer was reset. no big deal.
-        return;
+        natcheck_timeout++;
+        natcheck_timeout_sum += age;
+        ++nc_window_timeouts;
+    }
+    if (err == boost::asio::error::no_descriptors || err.value() == ENFILE)
+        ++nc_window_fd_errors;
+    natcheck_fail++;
+    natcheck_fail_sum += age;
+    finish_endpoint(ep, false, true, waiting);
+    if (err) fail(h, waiting, boost::system::system_error(err));
+    else fail(h, waiting, std::logic_error(msg));
+}
+
+static void deliver_results()
+{
+    assert(nc_delivering.empty());
+    {
+        boost::mutex::scoped_lock l(nc_results_mutex);
+        nc_delivering.swap(nc_results);
+    }
+    ++nc_batches;
+    nc_batched += nc_delivering.size();
+    for (size_t i = 0; i < nc_delivering.size(); ++i)
+        deliver(nc_delivering[i]);
+    nc_delivering.clear();
+    start_from_queue();
+}
+
+// makes room for a check of the given priority. Returns false if
+// everything queued is more important
+static bool make_room(int priority)
+{
+    while (nc_queued >= NatCheck::queue_size)
+    {
+        int p = 0;
+        while (p < priority && nc_queue[p].empty()) ++p;
+        if (p == priority) return false;
+        // the newest of the least important would wait the longest
+        nc_job j = nc_queue[p].back();
+        nc_queue[p].pop_back();
+        --nc_queued;
+
+        std::vector<CallbackHandler<int> > waiting;
+        finish_endpoint(j.endpoint, false, false, waiting);
+        nc_dropped += 1 + waiting.size();
+        fail(j.handler, waiting, std::logic_error("NAT check queue full"));
+    }
+    return true;
+}
+
+double nc_queue_average_age()
+{
+    nc_queue_type::iterator it;
+    double total = 0;
+    struct timeval now;
+    int n = nc_queued;
+
+    if (n == 0) return 0;
+
+    gettimeofday(&now, 0);
+
+    for (int p = 0; p < NatCheck::num_priorities; ++p)
+    {
+        for (it = nc_queue[p].begin(); it != nc_queue[p].end(); it++)
+        {
+            total += job_age(*it, &now);
+        }
     }
-    natcheck_timeout++;
-    natcheck_timeout_sum += age();
-    result(std::logic_error(msg));
-    handler_ = CallbackHandler<int>(swallow_success<int>, swallow_error);
-    assert(handler_);
-    socket_closed = true;
-    socket_.close();
+
+    return total / n;
 }
 
-void NatCheck::handle_handshake(const boost::system::error_code& err)
+void StartNatCheck(boost::asio::io_service& io_service, tcp::endpoint const& endpoint,
+                   const byte* binary_infohash, const byte* peer_id,
+                   CallbackHandler<int> handler, int priority)
 {
-    if (socket_closed)
+    assert(priority >= 0 && priority < NatCheck::num_priorities);
+    assert(nc_home == NULL || nc_home == &io_service);
+    nc_home = &io_service;
+
+    expire_cache(time(NULL));
+    nc_cache_type::iterator i = nc_cache.find(endpoint);
+    if (i != nc_cache.end())
     {
+        ++nc_cache_hits;
+        if (i->second.ok) handler(1);
+        else handler(std::logic_error("NAT check failed recently"));
         return;
     }
 
-    if (err) // EOF is an error.
+    // the handshake is only a reachability test, so a check of the endpoint
+    // for another torrent answers this one too
+    nc_waiting_type::iterator w = nc_waiting.find(endpoint);
+    if (w != nc_waiting.end())
     {
-        result(err);
+        ++nc_coalesced;
+        w->second.push_back(handler);
         return;
     }
+    ++nc_cache_misses;
 
-    std::stringstream s;
-    s << &response_;
-    socket_closed = true;
-    socket_.close();
-    assert(s.str().size() >= sizeof(PeerConnHeader));
-    try
+    if (!make_room(priority))
     {
-        ParseLoginPacket((PeerConnHeader*)s.str().c_str(), binary_infohash_, peer_id_);
-        result(1);
+        ++nc_dropped;
+        handler(std::logic_error("NAT check queue full"));
+        return;
     }
-    catch (std::exception& e)
+    nc_waiting[endpoint];
+
+    nc_queue[priority].push_back(nc_job());
+    nc_job& j = nc_queue[priority].back();
+    j.endpoint = endpoint;
+    memcpy(j.info_hash, binary_infohash, 20);
+    memcpy(j.peer_id, peer_id, SIZE_OF_PEER_ID);
+    j.handler = handler;
+    gettimeofday(&j.queued, 0);
+    ++nc_queued;
+    start_from_queue();
+}
+
+void NatCheck::start_engine()
+{
+    assert(!engine);
+    engine.reset(new nc_engine);
+    engine->work.reset(new boost::asio::io_service::work(engine->ios));
+    engine->thread.reset(new boost::thread(boost::bind(&run_engine, engine.get())));
+}
+
+void NatCheck::stop_engine()
+{
+    if (!engine) return;
+    engine->work.reset();
+    engine->ios.stop();
+    engine->thread->join();
+
+    // checks that were still running are abandoned
     {
-        result(e);
+        boost::mutex::scoped_lock l(nc_results_mutex);
+        nc_results.clear();
     }
+    for (size_t i = 0; i < nc_pool.size(); ++i) delete nc_pool[i];
+    nc_pool.clear();
+    nc_free.clear();
+    engine.reset();
+}
+
+std::string NatCheck::class_stats()
+{
+    std::stringstream st;
+
+    st << "NatCheck pool size: " << nc_pool.size() << std::endl;
+    st << "NatCheck pool free: " << nc_free.size() << std::endl;
+    st << "NatCheck engine thread: " << (engine ? 1 : 0) << std::endl;
+    st << "NatCheck started: " << natcheck_started << std::endl;
+    st << "NatCheck success: " << natcheck_success << std::endl;
+    st << "NatCheck success time: " << natcheck_success_sum << std::endl;
+    st << "NatCheck fail: " << natcheck_fail << std::endl;
+    st << "NatCheck fail time: " << natcheck_fail_sum << std::endl;
+    st << "NatCheck timeout: " << natcheck_timeout << std::endl;
+    st << "NatCheck timeout time: " << natcheck_timeout_sum << std::endl;
+    st << "NatCheck result batches: " << nc_batches << std::endl;
+    st << "NatCheck results per batch: "
+       << (nc_batches ? double(nc_batched) / nc_batches : 0.) << std::endl;
+    st << "NatCheck queue length: " << nc_queued << std::endl;
+    for (int p = 0; p < num_priorities; ++p)
+        st << "NatCheck queue length priority " << p << ": " << nc_queue[p].size() << std::endl;
+    st << "NatCheck dropped: " << nc_dropped << std::endl;
+    st << "NatCheck concurrency limit: " << nc_limit << std::endl;
+    st << "NatCheck queue average age: " << nc_queue_average_age() << std::endl;
+    st << "NatCheck num_checking: " << num_checking << std::endl;
+    st << "NatCheck cache hits: " << nc_cache_hits << std::endl;
+    st << "NatCheck cache misses: " << nc_cache_misses << std::endl;
+    st << "NatCheck coalesced: " << nc_coalesced << std::endl;
+    // the share of checks that didn't need a connection of their own
+    long lookups = nc_cache_hits + nc_coalesced + nc_cache_misses;
+    st << "NatCheck cache hit rate: "
+       << (lookups ? double(nc_cache_hits + nc_coalesced) / lookups : 0.) << std::endl;
+    st << "NatCheck cache size: " << nc_cache.size() << std::endl;
+    st << "NatCheck waiting endpoints: " << nc_waiting.size() << std::endl;
+
+    return st.str();
+}
+
+void NatCheck::setup_controls(ControlAPI &controls)
+{
+    controls.add_variable("natcheck_cache_ok_ttl",
+            boost::bind(&ControlAPI::set_int, &cache_ok_ttl, _1),
+            boost::bind(&ControlAPI::get_int, &cache_ok_ttl));
+    controls.add_variable("natcheck_cache_fail_ttl",
+            boost::bind(&ControlAPI::set_int, &cache_fail_ttl, _1),
+            boost::bind(&ControlAPI::get_int, &cache_fail_ttl));
+    controls.add_variable("natcheck_cache_size",
+            boost::bind(&ControlAPI::set_int, &cache_size, _1),
+            boost::bind(&ControlAPI::get_int, &cache_size));
+    controls.add_variable("natcheck_timeout",
+            boost::bind(&ControlAPI::set_int, &timeout, _1),
+            boost::bind(&ControlAPI::get_int, &timeout));
+    controls.add_variable("natcheck_max_checking",
+            boost::bind(&ControlAPI::set_int, &max_checking, _1),
+            boost::bind(&ControlAPI::get_int, &max_checking));
+    controls.add_variable("natcheck_min_checking",
+            boost::bind(&ControlAPI::set_int, &min_checking, _1),
+            boost::bind(&ControlAPI::get_int, &min_checking));
+    controls.add_variable("natcheck_timeout_target",
+            boost::bind(&ControlAPI::set_int, &timeout_target, _1),
+            boost::bind(&ControlAPI::get_int, &timeout_target));
+    controls.add_variable("natcheck_fd_reserve",
+            boost::bind(&ControlAPI::set_int, &fd_reserve, _1),
+            boost::bind(&ControlAPI::get_int, &fd_reserve));
+    controls.add_variable("natcheck_queue_size",
+            boost::bind(&ControlAPI::set_int, &queue_size, _1),
+            boost::bind(&ControlAPI::get_int, &queue_size));
+    controls.add_variable("natcheck_few_endpoints",
+            boost::bind(&ControlAPI::set_int, &few_endpoints, _1),
+            boost::bind(&ControlAPI::get_int, &few_endpoints));
 }
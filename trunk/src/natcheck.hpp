@@ -26,16 +26,15 @@ THE SOFTWARE.
 #define __NATCHECK_HPP__
 
 #include <boost/asio.hpp>
-#include <boost/noncopyable.hpp>
-#include <boost/shared_ptr.hpp>
-#include <boost/scoped_ptr.hpp>
-#include <boost/enable_shared_from_this.hpp>
+#include <boost/static_assert.hpp>
 #include "callback_handler.hpp"
 #include "boost_utils.hpp"
 #include "templates.h"
 
 using boost::asio::ip::tcp;
 
+class ControlAPI;
+
 static const char MAGIC_PEERID[] = "MAGICMAGICMAGICMAGIC";
 
 #define SIZE_OF_PEER_ID 20
@@ -46,60 +45,51 @@ struct PeerConnHeader {
     byte peer_id[SIZE_OF_PEER_ID];
 };
 
+BOOST_STATIC_ASSERT(sizeof(PeerConnHeader) == 68);
+
+// the handler is called on io_service's thread
 void StartNatCheck(boost::asio::io_service& io_service, tcp::endpoint const& endpoint,
                    const byte* binary_infohash, const byte* peer_id,
-                   CallbackHandler<int> handler);
+                   CallbackHandler<int> handler, int priority);
 
-class NatCheck :
-    public boost::enable_shared_from_this<NatCheck>,
-    private boost::noncopyable
+// The checks run on a thread of their own, with their state taken from
+// a pool that's reused. Results are handed back to the thread that
+// started them in batches, and the handlers called there.
+class NatCheck
 {
 public:
-    NatCheck(boost::asio::io_service& io_service, tcp::endpoint const& endpoint,
-             const byte* binary_infohash, const byte* peer_id,
-             CallbackHandler<int> handler);
-
-    ~NatCheck();
-
-    void start();
-
-    double age(struct timeval *now = 0);
+    // starts the thread the checks run on, and stops it. Until it's
+    // started they run on the thread that starts them
+    static void start_engine();
+    static void stop_engine();
 
     static std::string class_stats();
-private:
-
-    static long natcheck_started;
-    static long natcheck_created;
-    static long natcheck_deleted;
-    static long natcheck_success;
-    static double natcheck_success_sum;
-    static long natcheck_fail;
-    static double natcheck_fail_sum;
-    static long natcheck_timeout;
-    static double natcheck_timeout_sum;
-
-    void handle_connect(const boost::system::error_code& err);
-
-    void handle_write_handshake(const boost::system::error_code& err);
-    void handle_handshake(const boost::system::error_code& err);
-    void handle_timeout(const char* msg, const boost::system::error_code& err);
-
-    void result(int r);
-    void result(const boost::system::error_code& err);
-    void result(const std::exception& exc);
-
-
-    tcp::socket socket_;
-    bool socket_closed;
-
-    boost::asio::streambuf response_;
-    Timer timer_;
-    CallbackHandler<int> handler_;
-    struct timeval birthtime_;
-    tcp::endpoint endpoint_;
-    byte binary_infohash_[20];
-    byte peer_id_[20];
-    boost::scoped_ptr<PeerConnHeader> hdr_;
+    static void setup_controls(ControlAPI &controls);
+
+    // how long, in seconds, a passed or failed check of an endpoint
+    // answers later checks of it, from any swarm. 0 doesn't cache
+    static int cache_ok_ttl;
+    static int cache_fail_ttl;
+    // the most endpoints cached. The soonest to expire go first
+    static int cache_size;
+
+    // checks are queued by priority and the highest served first
+    static const int num_priorities = 4;
+
+    // seconds to wait for each step of the handshake
+    static int timeout;
+    // the bounds of the number of checks run at once. It's lowered when
+    // more than timeout_target percent of them time out
+    static int max_checking;
+    static int min_checking;
+    static int timeout_target;
+    // file descriptors left for everything but natchecks
+    static int fd_reserve;
+    // the most checks queued. When it's full, the newest of the least
+    // important are dropped, and fail
+    static int queue_size;
+    // swarms with fewer routable endpoints than this check theirs first
+    static int few_endpoints;
 };
 
 #endif //__NATCHECK_HPP__
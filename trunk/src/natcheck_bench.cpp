@@ -0,0 +1,262 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+// starts thousands of NAT checks at once against a farm of fake peers
+// on the loopback interface, with the checks running on the network
+// thread and on a thread of their own. It measures how long they take,
+// and how late a timer on the network thread fires meanwhile, which is
+// how long an announce would have waited.
+//
+// The fake peers listen on every interface, and the checks connect to
+// them on different 127.0.x.y addresses, so that every endpoint is
+// checked once.
+//
+// usage: natcheck_bench [checks] [ports]
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <sys/resource.h>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+
+#include "natcheck.hpp"
+#include "utils.hpp"
+
+bool verbose_logging = false;
+
+using boost::asio::ip::tcp;
+
+namespace
+{
+    // answers every handshake with the same one
+    class peer_farm
+    {
+    public:
+        peer_farm(int num_ports) : connections(0)
+        {
+            for (int i = 0; i < num_ports; ++i)
+            {
+                tcp::acceptor* a = new tcp::acceptor(ios, tcp::endpoint(tcp::v4(), 0));
+                acceptors.push_back(a);
+                ports.push_back(a->local_endpoint().port());
+                accept(a);
+            }
+            thread.reset(new boost::thread(boost::bind(&peer_farm::run, this)));
+        }
+
+        ~peer_farm()
+        {
+            ios.stop();
+            thread->join();
+            for (size_t i = 0; i < acceptors.size(); ++i) delete acceptors[i];
+        }
+
+        std::vector<unsigned short> ports;
+        int connections;
+
+    private:
+        struct peer
+        {
+            peer(boost::asio::io_service& ios) : socket(ios) {}
+            tcp::socket socket;
+            PeerConnHeader hdr;
+        };
+
+        void run() { ios.run(); }
+
+        void accept(tcp::acceptor* a)
+        {
+            peer* p = new peer(ios);
+            a->async_accept(p->socket, boost::bind(&peer_farm::on_accept, this, a, p,
+                boost::asio::placeholders::error));
+        }
+
+        void on_accept(tcp::acceptor* a, peer* p, boost::system::error_code const& err)
+        {
+            if (err)
+            {
+                delete p;
+                if (err != boost::asio::error::operation_aborted) accept(a);
+                return;
+            }
+            ++connections;
+            boost::asio::async_read(p->socket, boost::asio::buffer(&p->hdr, sizeof(p->hdr)),
+                boost::bind(&peer_farm::on_read, this, p, boost::asio::placeholders::error));
+            accept(a);
+        }
+
+        void on_read(peer* p, boost::system::error_code const& err)
+        {
+            if (err) { delete p; return; }
+            memcpy(p->hdr.peer_id, MAGIC_PEERID, SIZE_OF_PEER_ID);
+            boost::asio::async_write(p->socket, boost::asio::buffer(&p->hdr, sizeof(p->hdr)),
+                boost::bind(&peer_farm::on_write, this, p, boost::asio::placeholders::error));
+        }
+
+        void on_write(peer* p, boost::system::error_code const&)
+        {
+            delete p;
+        }
+
+        boost::asio::io_service ios;
+        std::vector<tcp::acceptor*> acceptors;
+        boost::scoped_ptr<boost::thread> thread;
+    };
+
+    int passed = 0;
+    int failed = 0;
+    std::string first_error;
+
+    void on_pass(int) { ++passed; }
+    void on_fail(std::exception const& e)
+    {
+        if (failed++ == 0) first_error = e.what();
+    }
+
+    // measures how late a timer that should fire every millisecond is
+    struct lag_probe
+    {
+        lag_probe(boost::asio::io_service& ios, int total)
+            : ios(ios), timer(ios), total(total), max_ms(0), sum_ms(0), ticks(0)
+        {
+            tick(boost::system::error_code());
+        }
+
+        void tick(boost::system::error_code const& err)
+        {
+            if (err) return;
+            if (ticks > 0)
+            {
+                double late = sw.get_msec() - 1.;
+                max_ms = std::max(max_ms, late);
+                sum_ms += late;
+            }
+            if (passed + failed == total)
+            {
+                ios.stop();
+                return;
+            }
+            ++ticks;
+            sw.restart();
+            timer.expires_from_now(boost::posix_time::milliseconds(1));
+            timer.async_wait(boost::bind(&lag_probe::tick, this, _1));
+        }
+
+        boost::asio::io_service& ios;
+        boost::asio::deadline_timer timer;
+        StopWatch sw;
+        int total;
+        double max_ms;
+        double sum_ms;
+        int ticks;
+    };
+
+    void bench(boost::asio::io_service& ios, peer_farm& farm, int num_checks,
+               int round, char const* name)
+    {
+        passed = 0;
+        failed = 0;
+        CallbackHandler<int> handler(&on_pass, &on_fail);
+        byte info_hash[20];
+        memset(info_hash, 'b', sizeof(info_hash));
+
+        StopWatch sw;
+        for (int i = 0; i < num_checks; ++i)
+        {
+            // every round checks different addresses, none are cached
+            int const host = round * num_checks + i / farm.ports.size();
+            boost::asio::ip::address_v4 addr((127 << 24) | ((1 + host / 250) << 8) | (1 + host % 250));
+            StartNatCheck(ios, tcp::endpoint(addr, farm.ports[i % farm.ports.size()]),
+                info_hash, (byte const*)MAGIC_PEERID, handler, 0);
+        }
+        double start_ms = sw.get_msec();
+
+        lag_probe probe(ios, num_checks);
+        ios.reset();
+        ios.run();
+        double ms = sw.get_msec();
+
+        std::cout << name << ": " << string_format("%.0f", ms) << " ms, "
+            << string_format("%.0f", num_checks * 1000. / ms) << " checks/s, "
+            << string_format("%.1f", start_ms) << " ms to start them, timer late by "
+            << string_format("%.2f", probe.sum_ms / std::max(probe.ticks - 1, 1))
+            << " ms on average, " << string_format("%.1f", probe.max_ms) << " ms at most"
+            << std::endl;
+        if (failed > 0)
+            std::cout << "  " << failed << " failed: " << first_error << std::endl;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+#ifdef DISABLE_NATCHECK
+    std::cerr << "natcheck_bench needs NAT checks enabled" << std::endl;
+    return 1;
+#endif
+    int num_checks = argc > 1 ? atoi(argv[1]) : 10000;
+    int num_ports = argc > 2 ? atoi(argv[2]) : 40;
+    if (num_checks <= 0 || num_ports <= 0)
+    {
+        std::cerr << "usage: natcheck_bench [checks] [ports]" << std::endl;
+        return 1;
+    }
+
+    std::ostream quiet(NULL);
+    logger_p = &quiet;
+    NatCheck::max_checking = num_checks;
+    NatCheck::min_checking = num_checks;
+    NatCheck::queue_size = num_checks;
+    NatCheck::fd_reserve = num_ports + 64;
+
+    // a socket for each check, and one for the farm's end of it
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur != RLIM_INFINITY
+        && rlim_t(2 * num_checks + NatCheck::fd_reserve) > rl.rlim_cur)
+    {
+        NatCheck::fd_reserve += rl.rlim_cur / 2;
+        std::cout << "only " << rl.rlim_cur << " file descriptors, some checks "
+            "wait for others" << std::endl;
+    }
+
+    peer_farm farm(num_ports);
+    boost::asio::io_service ios;
+    std::cout << num_checks << " checks against " << num_ports << " ports" << std::endl;
+
+    bench(ios, farm, num_checks, 0, "on the network thread");
+    NatCheck::start_engine();
+    bench(ios, farm, num_checks, 1, "on their own thread");
+    NatCheck::stop_engine();
+
+    std::string stats = NatCheck::class_stats();
+    std::string::size_type b = stats.find("NatCheck results per batch");
+    std::cout << stats.substr(b, stats.find('\n', b) - b) << std::endl;
+    std::cout << farm.connections << " connections" << std::endl;
+    return 0;
+}
@@ -0,0 +1,115 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "peer_list.hpp"
+#include <iterator>
+#include <cassert>
+#include "libtorrent/bencode.hpp"
+
+void peer_list::append(char const* p, size_t len)
+{
+    if (len == 0) return;
+    size_ += len;
+    if (!runs_.empty() && runs_.back().first + runs_.back().second == p)
+    {
+        runs_.back().second += len;
+        return;
+    }
+    runs_.push_back(std::make_pair(p, len));
+}
+
+void peer_list::clear()
+{
+    runs_.clear();
+    size_ = 0;
+}
+
+void peer_list::copy_to(std::string& out) const
+{
+    for (size_t i = 0; i < runs_.size(); ++i)
+        out.append(runs_[i].first, runs_[i].second);
+}
+
+std::string peer_list::str() const
+{
+    std::string ret;
+    ret.reserve(size_);
+    copy_to(ret);
+    return ret;
+}
+
+namespace
+{
+    void bencode_key(std::string& out, std::string const& key)
+    {
+        std::back_insert_iterator<std::string> i(out);
+        libtorrent::detail::write_integer(i, key.size());
+        out += ':';
+        out += key;
+    }
+
+    void bencode_peers(std::string& out, char const* key,
+        peer_list const& peers)
+    {
+        bencode_key(out, key);
+        std::back_insert_iterator<std::string> i(out);
+        libtorrent::detail::write_integer(i, peers.size());
+        out += ':';
+        peers.copy_to(out);
+    }
+}
+
+void bencode_announce(std::string& out,
+    libtorrent::entry::dictionary_type const& dict,
+    peer_list const& peers, peer_list const& peers6)
+{
+    assert(dict.count("peers") == 0);
+    assert(dict.count("peers6") == 0);
+
+    // bencoded keys are sorted, like the keys of dict
+    bool peers_done = false;
+    bool peers6_done = peers6.empty();
+    std::back_insert_iterator<std::string> i(out);
+    out += 'd';
+    for (libtorrent::entry::dictionary_type::const_iterator e = dict.begin();
+        e != dict.end(); ++e)
+    {
+        if (!peers_done && e->first > "peers")
+        {
+            bencode_peers(out, "peers", peers);
+            peers_done = true;
+        }
+        if (!peers6_done && e->first > "peers6")
+        {
+            bencode_peers(out, "peers6", peers6);
+            peers6_done = true;
+        }
+        bencode_key(out, e->first);
+        libtorrent::detail::bencode_recursive(i, e->second);
+    }
+    if (!peers_done) bencode_peers(out, "peers", peers);
+    if (!peers6_done) bencode_peers(out, "peers6", peers6);
+    out += 'e';
+}
@@ -0,0 +1,68 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef __PEER_LIST_HPP__
+#define __PEER_LIST_HPP__
+
+#include <string>
+#include <vector>
+#include <utility>
+#include "libtorrent/entry.hpp"
+
+/// The compact peer records (6 bytes per IPv4 peer, 18 per IPv6 peer)
+/// handed out to an announce, as runs pointing straight into the
+/// swarm's endpoint lists. They're only valid until the swarm changes,
+/// so they're copied into the reply before the handler returns.
+class peer_list
+{
+public:
+    peer_list() : size_(0) {}
+
+    // adds len bytes of records. A run that continues the last one
+    // is merged with it
+    void append(char const* p, size_t len);
+    void clear();
+
+    // the number of bytes of records
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    // copies the records to the end of out
+    void copy_to(std::string& out) const;
+    std::string str() const;
+
+private:
+    std::vector<std::pair<char const*, size_t> > runs_;
+    size_t size_;
+};
+
+/// Bencodes an announce reply to the end of out. The peer lists are
+/// written in their place among the keys of dict, as the "peers" and
+/// (unless it's empty) "peers6" strings, which dict mustn't have.
+void bencode_announce(std::string& out,
+    libtorrent::entry::dictionary_type const& dict,
+    peer_list const& peers, peer_list const& peers6);
+
+#endif //__PEER_LIST_HPP__
@@ -0,0 +1,390 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "replication.hpp"
+#include "utils.hpp"
+
+#include <sstream>
+#include <string.h>
+#include <boost/bind.hpp>
+
+using boost::asio::ip::tcp;
+
+// the number of seconds to wait before reconnecting to the primary
+#define REPLICATION_RETRY_SECONDS 5
+// the size of the follower's receive buffer
+#define REPLICATION_READ_SIZE (64 * 1024)
+
+int ReplicationServer::max_queued_bytes = 64 * 1024 * 1024;
+
+ReplicationServer::ReplicationServer(boost::asio::io_service& ios,
+    const std::string& port, snapshot_f_t snapshot, int batch_ms)
+    : ios_(ios),
+      acceptor_(ios),
+      snapshot_(snapshot),
+      flush_timer_(ios),
+      snapshots_sent_(0),
+      records_sent_(0),
+      batches_sent_(0),
+      followers_dropped_(0)
+{
+    try
+    {
+        tcp::endpoint ep(tcp::v4(), atoi(port.c_str()));
+        acceptor_.open(ep.protocol());
+        acceptor_.set_option(tcp::acceptor::reuse_address(true));
+        acceptor_.bind(ep);
+        acceptor_.listen();
+        start_accept();
+        logger << "accepting replication followers on port " << port << std::endl;
+    }
+    catch (const std::exception& e)
+    {
+        logger << "Unable to listen for replication followers on port '"
+            << port << "': " << e.what() << std::endl;
+    }
+
+    if (batch_ms <= 0) batch_ms = 1;
+    flush_timer_.start(boost::posix_time::milliseconds(batch_ms),
+        boost::bind(&ReplicationServer::flush, this));
+}
+
+void ReplicationServer::start_accept()
+{
+    follower_ptr f(new follower(ios_));
+    acceptor_.async_accept(f->socket, f->endpoint,
+        boost::bind(&ReplicationServer::handle_accept, this, f,
+            boost::asio::placeholders::error));
+}
+
+void ReplicationServer::handle_accept(follower_ptr f, const boost::system::error_code& e)
+{
+    if (e) return;
+    start_accept();
+
+    // everything logged before the snapshot is part of it, send it
+    // to the followers that already have the state before the new
+    // one starts queuing changes
+    flush();
+
+    buffer_ptr snapshot(new std::vector<char>(sizeof(uint64)));
+    std::vector<char> image;
+    snapshot_(image);
+    uint64 size = image.size();
+    memcpy(&(*snapshot)[0], &size, sizeof(size));
+    snapshot->insert(snapshot->end(), image.begin(), image.end());
+
+    f->socket.set_option(tcp::no_delay(true));
+    f->snapshot_bytes = snapshot->size();
+    followers_.insert(f);
+    ++snapshots_sent_;
+    logger << "replication follower " << f->endpoint << " connected, sending "
+        << size << " bytes of state" << std::endl;
+    send(f, snapshot);
+}
+
+void ReplicationServer::flush()
+{
+    if (pending_.empty()) return;
+
+    // one copy of the batch is shared by all followers
+    buffer_ptr batch(new std::vector<char>((char const*)&pending_[0],
+        (char const*)(&pending_[0] + pending_.size())));
+    records_sent_ += pending_.size();
+    ++batches_sent_;
+    pending_.clear();
+
+    std::vector<follower_ptr> followers(followers_.begin(), followers_.end());
+    for (size_t i = 0; i < followers.size(); ++i)
+        send(followers[i], batch);
+}
+
+void ReplicationServer::send(follower_ptr f, buffer_ptr buf)
+{
+    f->queue.push_back(buf);
+    f->queued_bytes += buf->size();
+    // the snapshot doesn't count, it's only sent once
+    if (f->queued_bytes - f->snapshot_bytes > size_t(max_queued_bytes))
+    {
+        drop(f, "too far behind");
+        return;
+    }
+    write(f);
+}
+
+void ReplicationServer::write(follower_ptr f)
+{
+    if (f->writing || f->queue.empty()) return;
+
+    // send everything queued with a single write
+    std::vector<boost::asio::const_buffer> buffers;
+    for (std::deque<buffer_ptr>::iterator i = f->queue.begin();
+        i != f->queue.end(); ++i)
+    {
+        buffers.push_back(boost::asio::buffer(**i));
+    }
+
+    f->writing = true;
+    f->in_flight = f->queue.size();
+    boost::asio::async_write(f->socket, buffers,
+        boost::bind(&ReplicationServer::handle_write, this, f,
+            boost::asio::placeholders::error));
+}
+
+void ReplicationServer::handle_write(follower_ptr f, const boost::system::error_code& e)
+{
+    f->writing = false;
+    if (followers_.count(f) == 0) return;
+    if (e)
+    {
+        drop(f, e.message());
+        return;
+    }
+
+    // new buffers may have been queued while writing, only
+    // remove the ones that were part of the write
+    for (; f->in_flight > 0; --f->in_flight)
+    {
+        f->queued_bytes -= f->queue.front()->size();
+        f->queue.pop_front();
+    }
+    // the snapshot is always part of the first write
+    f->snapshot_bytes = 0;
+    write(f);
+}
+
+void ReplicationServer::drop(follower_ptr f, const std::string& reason)
+{
+    logger << "dropping replication follower " << f->endpoint << ": "
+        << reason << std::endl;
+    boost::system::error_code ec;
+    f->socket.close(ec);
+    followers_.erase(f);
+    ++followers_dropped_;
+}
+
+std::string ReplicationServer::instance_stats()
+{
+    std::stringstream st;
+
+    size_t queued = 0;
+    for (std::set<follower_ptr>::iterator i = followers_.begin();
+        i != followers_.end(); ++i)
+    {
+        queued += (*i)->queued_bytes;
+    }
+
+    st << "Replication followers: " << followers_.size() << std::endl;
+    st << "Replication snapshots sent: " << snapshots_sent_ << std::endl;
+    st << "Replication records sent: " << records_sent_ << std::endl;
+    st << "Replication batches sent: " << batches_sent_ << std::endl;
+    st << "Replication bytes queued: " << queued << std::endl;
+    st << "Replication followers dropped: " << followers_dropped_ << std::endl;
+
+    return st.str();
+}
+
+ReplicationClient::ReplicationClient(boost::asio::io_service& ios,
+    const std::string& primary, load_f_t load, apply_f_t apply)
+    : ios_(ios),
+      load_(load),
+      apply_(apply),
+      socket_(ios),
+      retry_timer_(ios),
+      running_(false),
+      connected_(false),
+      snapshot_size_(0),
+      buffer_(REPLICATION_READ_SIZE),
+      buffered_(0),
+      snapshots_loaded_(0),
+      records_applied_(0),
+      reconnects_(0)
+{
+    // host:port, where host may be a bracketed v6 address
+    std::string::size_type colon = primary.rfind(':');
+    if (colon != std::string::npos)
+    {
+        host_ = primary.substr(0, colon);
+        port_ = primary.substr(colon + 1);
+    }
+    else
+    {
+        host_ = primary;
+    }
+    if (host_.size() > 1 && host_[0] == '[' && host_[host_.size() - 1] == ']')
+        host_ = host_.substr(1, host_.size() - 2);
+}
+
+void ReplicationClient::start()
+{
+    running_ = true;
+    connect();
+}
+
+void ReplicationClient::stop()
+{
+    running_ = false;
+    connected_ = false;
+    boost::system::error_code ec;
+    retry_timer_.cancel(ec);
+    socket_.close(ec);
+}
+
+void ReplicationClient::connect()
+{
+    if (!running_) return;
+
+    try
+    {
+        tcp::resolver resolver(ios_);
+        tcp::resolver::query query(host_, port_);
+        tcp::endpoint ep = *resolver.resolve(query);
+        socket_.async_connect(ep, boost::bind(&ReplicationClient::handle_connect,
+            this, boost::asio::placeholders::error));
+    }
+    catch (const std::exception& e)
+    {
+        reconnect(e.what());
+    }
+}
+
+void ReplicationClient::handle_connect(const boost::system::error_code& e)
+{
+    if (!running_) return;
+    if (e)
+    {
+        reconnect(e.message());
+        return;
+    }
+
+    logger << "connected to replication primary " << host_ << ":" << port_ << std::endl;
+    boost::asio::async_read(socket_,
+        boost::asio::buffer(&snapshot_size_, sizeof(snapshot_size_)),
+        boost::bind(&ReplicationClient::handle_size, this,
+            boost::asio::placeholders::error));
+}
+
+void ReplicationClient::handle_size(const boost::system::error_code& e)
+{
+    if (!running_) return;
+    if (e)
+    {
+        reconnect(e.message());
+        return;
+    }
+
+    snapshot_.resize(snapshot_size_);
+    boost::asio::async_read(socket_, boost::asio::buffer(snapshot_),
+        boost::bind(&ReplicationClient::handle_snapshot, this,
+            boost::asio::placeholders::error));
+}
+
+void ReplicationClient::handle_snapshot(const boost::system::error_code& e)
+{
+    if (!running_) return;
+    if (e)
+    {
+        reconnect(e.message());
+        return;
+    }
+
+    StopWatch sw;
+    load_(snapshot_.empty() ? NULL : &snapshot_[0], snapshot_.size());
+    logger << "loaded " << snapshot_.size() << " bytes of replicated state in "
+        << sw.get_msec() << "ms" << std::endl;
+    std::vector<char>().swap(snapshot_);
+    ++snapshots_loaded_;
+
+    connected_ = true;
+    buffered_ = 0;
+    read_records();
+}
+
+void ReplicationClient::read_records()
+{
+    socket_.async_read_some(
+        boost::asio::buffer(&buffer_[buffered_], buffer_.size() - buffered_),
+        boost::bind(&ReplicationClient::handle_records, this,
+            boost::asio::placeholders::error,
+            boost::asio::placeholders::bytes_transferred));
+}
+
+void ReplicationClient::handle_records(const boost::system::error_code& e,
+    size_t bytes_transferred)
+{
+    if (!running_) return;
+    if (e)
+    {
+        reconnect(e.message());
+        return;
+    }
+
+    buffered_ += bytes_transferred;
+    size_t num_records = buffered_ / sizeof(journal_record);
+    journal_record r;
+    for (size_t i = 0; i < num_records; ++i)
+    {
+        // the buffer isn't necessarily aligned for the record
+        memcpy(&r, &buffer_[i * sizeof(journal_record)], sizeof(r));
+        apply_(r);
+    }
+    records_applied_ += num_records;
+
+    // keep the partial record at the end for the next read
+    size_t used = num_records * sizeof(journal_record);
+    memmove(&buffer_[0], &buffer_[used], buffered_ - used);
+    buffered_ -= used;
+
+    read_records();
+}
+
+void ReplicationClient::reconnect(const std::string& reason)
+{
+    if (!running_) return;
+
+    logger << "replication from " << host_ << ":" << port_ << " failed: "
+        << reason << ". Retrying in " << REPLICATION_RETRY_SECONDS
+        << " seconds" << std::endl;
+
+    connected_ = false;
+    ++reconnects_;
+    boost::system::error_code ec;
+    socket_.close(ec);
+    std::vector<char>().swap(snapshot_);
+
+    retry_timer_.expires_from_now(boost::posix_time::seconds(REPLICATION_RETRY_SECONDS));
+    retry_timer_.async_wait(boost::bind(&ReplicationClient::connect, this));
+}
+
+std::string ReplicationClient::instance_stats()
+{
+    std::stringstream st;
+
+    st << "Replication connected: " << (connected_ ? 1 : 0) << std::endl;
+    st << "Replication snapshots loaded: " << snapshots_loaded_ << std::endl;
+    st << "Replication records applied: " << records_applied_ << std::endl;
+    st << "Replication reconnects: " << reconnects_ << std::endl;
+
+    return st.str();
+}
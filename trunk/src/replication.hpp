@@ -0,0 +1,176 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __REPLICATION_HPP__
+#define __REPLICATION_HPP__
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include "boost_utils.hpp"
+#include "journal.hpp"
+#include "templates.h"
+
+/*
+
+replication protocol:
+
+a follower connects to the primary's replication port and receives:
+
+8 bytes    size of the state image (host order, primary and
+           followers are expected to run on the same architecture)
+           the state image (see state_segment.hpp)
+
+followed by a stream of journal records (see journal.hpp), in the
+order the changes were made on the primary. Records are collected
+on the primary and written to all followers in batches.
+
+a follower that falls too far behind is disconnected. It reconnects
+and starts over with a new snapshot.
+
+*/
+
+/// The primary side of the replication. Accepts followers, sends them
+/// a snapshot and then every peer change.
+class ReplicationServer : private boost::noncopyable
+{
+public:
+    typedef boost::function<void (std::vector<char>&)> snapshot_f_t;
+
+    ReplicationServer(boost::asio::io_service& ios, const std::string& port,
+        snapshot_f_t snapshot, int batch_ms);
+
+    // called from the network thread for every change. Only copies
+    // the record, it's sent with the next batch
+    void log(journal_record const& r)
+    {
+        if (followers_.empty()) return;
+        pending_.push_back(r);
+    }
+
+    std::string instance_stats();
+
+    // followers with more than this many bytes waiting to be sent
+    // are disconnected
+    static int max_queued_bytes;
+
+private:
+    typedef boost::shared_ptr<std::vector<char> > buffer_ptr;
+
+    struct follower
+    {
+        follower(boost::asio::io_service& ios)
+            : socket(ios), queued_bytes(0), snapshot_bytes(0),
+              in_flight(0), writing(false) {}
+        boost::asio::ip::tcp::socket socket;
+        boost::asio::ip::tcp::endpoint endpoint;
+        std::deque<buffer_ptr> queue;
+        size_t queued_bytes;
+        // the part of queued_bytes that is the initial snapshot
+        size_t snapshot_bytes;
+        // the number of buffers (from the front of the queue) in
+        // the current write
+        size_t in_flight;
+        bool writing;
+    };
+    typedef boost::shared_ptr<follower> follower_ptr;
+
+    void start_accept();
+    void handle_accept(follower_ptr f, const boost::system::error_code& e);
+    void flush();
+    void send(follower_ptr f, buffer_ptr buf);
+    void write(follower_ptr f);
+    void handle_write(follower_ptr f, const boost::system::error_code& e);
+    void drop(follower_ptr f, const std::string& reason);
+
+    boost::asio::io_service& ios_;
+    boost::asio::ip::tcp::acceptor acceptor_;
+    snapshot_f_t snapshot_;
+    LoopingCall flush_timer_;
+
+    std::vector<journal_record> pending_;
+    std::set<follower_ptr> followers_;
+
+    int64 snapshots_sent_;
+    int64 records_sent_;
+    int64 batches_sent_;
+    int64 followers_dropped_;
+};
+
+/// The follower side of the replication. Keeps a connection to the
+/// primary and applies everything it receives.
+class ReplicationClient : private boost::noncopyable
+{
+public:
+    // load is called with every snapshot, and should replace the
+    // current state with it. apply is called with every change
+    typedef boost::function<void (char const*, uint64)> load_f_t;
+    typedef boost::function<void (journal_record const&)> apply_f_t;
+
+    ReplicationClient(boost::asio::io_service& ios, const std::string& primary,
+        load_f_t load, apply_f_t apply);
+
+    void start();
+    void stop();
+
+    bool is_connected() const { return connected_; }
+
+    std::string instance_stats();
+
+private:
+    void connect();
+    void handle_connect(const boost::system::error_code& e);
+    void handle_size(const boost::system::error_code& e);
+    void handle_snapshot(const boost::system::error_code& e);
+    void read_records();
+    void handle_records(const boost::system::error_code& e, size_t bytes_transferred);
+    void reconnect(const std::string& reason);
+
+    boost::asio::io_service& ios_;
+    std::string host_;
+    std::string port_;
+    load_f_t load_;
+    apply_f_t apply_;
+
+    boost::asio::ip::tcp::socket socket_;
+    boost::asio::deadline_timer retry_timer_;
+    bool running_;
+    bool connected_;
+
+    uint64 snapshot_size_;
+    std::vector<char> snapshot_;
+    std::vector<char> buffer_;
+    size_t buffered_;
+
+    int64 snapshots_loaded_;
+    int64 records_applied_;
+    int64 reconnects_;
+};
+
+#endif //__REPLICATION_HPP__
@@ -100,6 +100,13 @@ const char crlf[] = { '\r', '\n' };
 
 } // namespace misc_strings
 
+void reply::swap(reply& other)
+{
+  std::swap(status, other.status);
+  headers.swap(other.headers);
+  content.swap(other.content);
+}
+
 std::vector<boost::asio::const_buffer> reply::to_buffers()
 {
   std::vector<boost::asio::const_buffer> buffers;
@@ -54,6 +54,9 @@ struct reply
   /// not be changed until the write operation has completed.
   std::vector<boost::asio::const_buffer> to_buffers();
 
+  /// Exchange the contents of two replies, without copying them.
+  void swap(reply& other);
+
   /// Get a stock reply.
   static reply stock_reply(status_type status, const char *text = NULL);
 };
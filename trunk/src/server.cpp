@@ -11,6 +11,7 @@
 
 #include "server.hpp"
 #include <boost/bind.hpp>
+#include <errno.h>
 #include "utils.hpp"
 
 struct v6only
@@ -30,11 +31,39 @@ struct v6only
 namespace http {
 namespace server {
 
-server::server(const std::vector<std::string>& addresses, const std::string& port)
+int server::drain_timeout = 10;
+
+server::server(const std::vector<std::string>& addresses, const std::string& port,
+               const std::vector<int>& listen_fds)
   : io_service_(),
     connection_manager_(),
+    drain_timer_(io_service_),
     request_handler_(NULL)
 {
+    for (size_t i = 0; i < listen_fds.size(); i++)
+    {
+        try
+        {
+            sockaddr_storage addr;
+            socklen_t len = sizeof(addr);
+            if (getsockname(listen_fds[i], (sockaddr*)&addr, &len) != 0)
+                throw boost::system::system_error(errno, boost::system::system_category());
+            boost::asio::ip::tcp protocol = addr.ss_family == AF_INET6
+                ? boost::asio::ip::tcp::v6() : boost::asio::ip::tcp::v4();
+            boost::asio::ip::tcp::acceptor *acceptor = new boost::asio::ip::tcp::acceptor(io_service_);
+            acceptor_ptr pacceptor(acceptor);
+            acceptor->assign(protocol, listen_fds[i]);
+            connection_ptr new_connection(new connection(*this));
+            start_accept(pacceptor, new_connection);
+            acceptors_.push_back(pacceptor);
+        }
+        catch (const std::exception& e)
+        {
+            logger << "Unable to accept on socket " << listen_fds[i] << ": " << e.what() << std::endl;
+        }
+    }
+    if (!listen_fds.empty()) return;
+
     // Open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
     boost::asio::ip::tcp::resolver resolver(io_service_);
     for (size_t i = 0; i < addresses.size(); i++)
@@ -78,6 +107,14 @@ void server::stop()
     io_service_.post(boost::bind(&server::handle_stop, this));
 }
 
+std::vector<int> server::listen_fds() const
+{
+    std::vector<int> ret;
+    for (size_t i = 0; i < acceptors_.size(); i++)
+        ret.push_back(acceptors_[i]->native_handle());
+    return ret;
+}
+
 void server::start_accept(const acceptor_ptr acceptor, const connection_ptr pconnection)
 {
     acceptor->async_accept(pconnection->socket(), pconnection->peer_endpoint(),
@@ -107,8 +144,16 @@ void server::handle_stop()
         acceptors_.pop_back(); // ah, relief.
         a->close();
     }
+    // give the connections a chance to finish what they're doing, the
+    // io_service is stopped once they're all closed or the timeout expires
+    drain_timer_.expires_from_now(boost::posix_time::seconds(drain_timeout));
+    drain_timer_.async_wait(boost::bind(&server::handle_drained, this));
+    connection_manager_.drain(boost::bind(&server::handle_drained, this));
+}
+
+void server::handle_drained()
+{
     connection_manager_.stop_all();
-    // BUG: forceful shutdown
     io_service_.stop();
 }
 
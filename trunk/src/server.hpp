@@ -28,15 +28,26 @@ class server
   : private boost::noncopyable
 {
 public:
-  /// Construct the server to listen on the specified TCP address(es) and port
-  explicit server(const std::vector<std::string>& addresses, const std::string& port);
+  /// Construct the server to listen on the specified TCP address(es) and port.
+  /// If listen_fds is not empty, the server accepts connections on those
+  /// (already listening) sockets instead, for instance ones handed over by
+  /// another process.
+  explicit server(const std::vector<std::string>& addresses, const std::string& port,
+                  const std::vector<int>& listen_fds = std::vector<int>());
 
   /// Run the server's io_service loop.
   void run();
 
-  /// Stop the server.
+  /// Stop the server. Requests that have already been received are
+  /// answered before the connections are closed, for at most drain_timeout
+  /// seconds.
   void stop();
 
+  /// The native handles of the listening sockets.
+  std::vector<int> listen_fds() const;
+
+  static int drain_timeout;
+
   /// Get the io_service associated with the object.
   boost::asio::io_service& io_service() { return io_service_; }
 
@@ -57,6 +68,9 @@ private:
   /// Handle a request to stop the server.
   void handle_stop();
 
+  /// Handle completion of the connection drain (or its timeout).
+  void handle_drained();
+
   /// The io_service used to perform asynchronous operations.
   boost::asio::io_service io_service_;
 
@@ -66,6 +80,9 @@ private:
   /// The connection manager which owns all live connections.
   connection_manager connection_manager_;
 
+  /// Forces the shutdown if the connections don't drain in time.
+  boost::asio::deadline_timer drain_timer_;
+
   /// The handler for all incoming requests.
   request_handler* request_handler_;
 };
@@ -0,0 +1,142 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "slab.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <map>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+    size_t const first_slab_size = 64 * 1024;
+    size_t const huge_slab_size = 2 * 1024 * 1024;
+
+    std::vector<slab_pool*>& all_pools()
+    {
+        static std::vector<slab_pool*>* pools = new std::vector<slab_pool*>;
+        return *pools;
+    }
+
+    char* allocate_slab(size_t size)
+    {
+#if defined(_WIN32)
+        return static_cast<char*>(malloc(size));
+#else
+        // huge pages need the slab aligned to their size
+        size_t align = size == huge_slab_size ? huge_slab_size : 64;
+        void* ret = NULL;
+        if (posix_memalign(&ret, align, size) != 0) return NULL;
+#ifdef MADV_HUGEPAGE
+        if (slab_pool::huge_pages && size == huge_slab_size)
+            madvise(ret, size, MADV_HUGEPAGE);
+#endif
+        return static_cast<char*>(ret);
+#endif
+    }
+}
+
+bool slab_pool::huge_pages = false;
+
+slab_pool& slab_pool::get(char const* category, size_t size)
+{
+    // the free list is kept in the objects
+    size = (std::max(size, sizeof(void*)) + 15) & ~size_t(15);
+
+    std::vector<slab_pool*>& pools = all_pools();
+    for (std::vector<slab_pool*>::iterator i = pools.begin();
+        i != pools.end(); ++i)
+    {
+        if ((*i)->size_ == size && strcmp((*i)->category_, category) == 0)
+            return **i;
+    }
+    slab_pool* p = new slab_pool(category, size);
+    pools.push_back(p);
+    return *p;
+}
+
+slab_pool::slab_pool(char const* category, size_t size)
+    : category_(category),
+      size_(size),
+      free_(NULL),
+      next_(NULL),
+      end_(NULL),
+      slab_size_(first_slab_size),
+      reserved_(0),
+      live_(0),
+      num_free_(0)
+{
+    while (slab_size_ < size_) slab_size_ *= 2;
+}
+
+void slab_pool::add_slab()
+{
+    char* slab = allocate_slab(slab_size_);
+    if (slab == NULL) throw std::bad_alloc();
+    reserved_ += slab_size_;
+    next_ = slab;
+    end_ = slab + slab_size_ / size_ * size_;
+    if (slab_size_ < huge_slab_size) slab_size_ *= 2;
+}
+
+std::string slab_pool::class_stats()
+{
+    std::vector<slab_pool*> const& pools = all_pools();
+
+    // in use and reserved bytes per category
+    std::map<std::string, std::pair<size_t, size_t> > categories;
+    for (std::vector<slab_pool*>::const_iterator i = pools.begin();
+        i != pools.end(); ++i)
+    {
+        std::pair<size_t, size_t>& c = categories[(*i)->category_];
+        c.first += (*i)->live_ * (*i)->size_;
+        c.second += (*i)->reserved_;
+    }
+
+    std::stringstream st;
+    for (std::map<std::string, std::pair<size_t, size_t> >::const_iterator i
+        = categories.begin(); i != categories.end(); ++i)
+    {
+        st << "Memory in " << i->first << ": " << i->second.first
+            << " bytes, " << i->second.second << " reserved" << std::endl;
+    }
+    for (std::vector<slab_pool*>::const_iterator i = pools.begin();
+        i != pools.end(); ++i)
+    {
+        slab_pool const& p = **i;
+        st << "Slab pool " << p.category_ << " " << p.size_ << ": "
+            << p.live_ << " live, " << p.num_free_ << " free, "
+            << p.reserved_ << " bytes reserved" << std::endl;
+    }
+    st << "Slab huge pages: " << huge_pages << std::endl;
+
+    return st.str();
+}
@@ -0,0 +1,166 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef __SLAB_HPP__
+#define __SLAB_HPP__
+
+#include <cstddef>
+#include <cassert>
+#include <new>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+/// A pool of objects of one size, for the records the tracker keeps
+/// millions of. Objects are carved out of large slabs that are never
+/// given back, and freed objects are kept for the next allocation
+/// from the pool. That saves malloc's per object overhead, doesn't
+/// fragment the heap and keeps records of the same type together.
+/// Slabs start at 64 kB and double up to 2 MB. With huge_pages set,
+/// the 2 MB slabs are aligned and backed by transparent huge pages.
+///
+/// The pools aren't thread safe. They're only used by the network
+/// thread, and before it starts and after it stops.
+class slab_pool : private boost::noncopyable
+{
+public:
+    // returns the pool of objects of size bytes reported as category,
+    // creating it the first time. Pools are never destroyed
+    static slab_pool& get(char const* category, size_t size);
+
+    void* allocate()
+    {
+        ++live_;
+        if (free_)
+        {
+            void* ret = free_;
+            free_ = *static_cast<void**>(ret);
+            --num_free_;
+            return ret;
+        }
+        if (next_ == end_) add_slab();
+        void* ret = next_;
+        next_ += size_;
+        return ret;
+    }
+
+    void deallocate(void* p)
+    {
+        assert(live_ > 0);
+        --live_;
+        *static_cast<void**>(p) = free_;
+        free_ = p;
+        ++num_free_;
+    }
+
+    size_t object_size() const { return size_; }
+    size_t live() const { return live_; }
+
+    // the bytes in use and reserved by each category, and the objects
+    // of each pool
+    static std::string class_stats();
+
+    // back 2 MB slabs with transparent huge pages. Only slabs added
+    // after it's set are affected
+    static bool huge_pages;
+
+private:
+    slab_pool(char const* category, size_t size);
+    void add_slab();
+
+    char const* category_;
+    size_t size_;
+    // freed objects, linked through their first word
+    void* free_;
+    // the part of the last slab that's never been handed out
+    char* next_;
+    char* end_;
+    // the size of the next slab
+    size_t slab_size_;
+    size_t reserved_;
+    size_t live_;
+    size_t num_free_;
+};
+
+// the categories the memory is reported as
+struct swarm_memory { static char const* name() { return "swarms"; } };
+struct peer_memory { static char const* name() { return "peers"; } };
+struct endpoint_memory { static char const* name() { return "endpoints"; } };
+struct connection_memory { static char const* name() { return "connections"; } };
+
+/// Allocates single objects from the slab_pool for their size in
+/// Category, for node based containers. Arrays (a hash table's
+/// buckets) come from operator new.
+template <class T, class Category>
+class slab_allocator
+{
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef T const* const_pointer;
+    typedef T& reference;
+    typedef T const& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <class U> struct rebind { typedef slab_allocator<U, Category> other; };
+
+    slab_allocator() {}
+    template <class U> slab_allocator(slab_allocator<U, Category> const&) {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+    size_type max_size() const { return size_t(-1) / sizeof(T); }
+
+    pointer allocate(size_type n, void const* = 0)
+    {
+        if (n == 1) return static_cast<pointer>(pool().allocate());
+        return static_cast<pointer>(::operator new(n * sizeof(T)));
+    }
+    void deallocate(pointer p, size_type n)
+    {
+        if (n == 1) pool().deallocate(p);
+        else ::operator delete(p);
+    }
+
+    void construct(pointer p, T const& v) { new (p) T(v); }
+    void destroy(pointer p) { p->~T(); }
+
+private:
+    static slab_pool& pool()
+    {
+        static slab_pool& p = slab_pool::get(Category::name(), sizeof(T));
+        return p;
+    }
+};
+
+template <class T, class U, class C>
+bool operator==(slab_allocator<T, C> const&, slab_allocator<U, C> const&)
+{ return true; }
+template <class T, class U, class C>
+bool operator!=(slab_allocator<T, C> const&, slab_allocator<U, C> const&)
+{ return false; }
+
+#endif //__SLAB_HPP__
@@ -0,0 +1,204 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "state_segment.hpp"
+#include "utils.hpp"
+
+#include <errno.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace
+{
+    const char segment_magic[8] = { 'H', 'E', 'L', 'I', 'X', 'S', 'E', 'G' };
+
+    // segments are sized in multiples of this, which also makes
+    // them valid sizes for 2 MB pages on hugetlbfs
+    const uint64 segment_granularity = 2 * 1024 * 1024;
+}
+
+void init_segment_header(segment_header* h, uint64 size)
+{
+    memcpy(h->magic, segment_magic, sizeof(segment_magic));
+    h->version = STATE_SEGMENT_VERSION;
+    h->complete = 0;
+    h->size = size;
+    h->num_swarms = 0;
+    h->num_peers = 0;
+    h->saved_time = 0;
+    h->swarm_table = sizeof(segment_header);
+}
+
+bool segment_header_valid(segment_header const* h, uint64 size)
+{
+    return memcmp(h->magic, segment_magic, sizeof(segment_magic)) == 0
+        && h->version == STATE_SEGMENT_VERSION
+        && h->complete == 1
+        && h->size <= size
+        && h->swarm_table + h->num_swarms * sizeof(uint64) <= h->size;
+}
+
+StateSegment::StateSegment(const std::string& name)
+    : name_(name),
+      base_(NULL),
+      mapped_size_(0)
+{}
+
+StateSegment::~StateSegment()
+{
+    detach();
+}
+
+#if defined(_WIN32)
+
+// shared memory segments are not supported on windows, the
+// tracker always starts from the checkpoint file there
+
+int StateSegment::open_segment(int) { return -1; }
+bool StateSegment::attach() { return false; }
+bool StateSegment::create(uint64) { return false; }
+void StateSegment::finish() {}
+void StateSegment::detach() {}
+
+#else
+
+int StateSegment::open_segment(int flags)
+{
+    if (name_.find('/', 1) != std::string::npos)
+        return open(name_.c_str(), flags, 0600);
+
+    std::string name = name_;
+    if (name.empty() || name[0] != '/') name = "/" + name;
+    return shm_open(name.c_str(), flags, 0600);
+}
+
+bool StateSegment::attach()
+{
+    detach();
+
+    int fd = open_segment(O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || uint64(st.st_size) < sizeof(segment_header))
+    {
+        close(fd);
+        return false;
+    }
+
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        int e = errno;
+        logger << "unable to map state segment '" << name_ << "': "
+            << strerror(e) << std::endl;
+        return false;
+    }
+    base_ = (char*)p;
+    mapped_size_ = st.st_size;
+
+    if (!segment_header_valid(header(), mapped_size_))
+    {
+        logger << "ignoring incompatible or incomplete state segment '"
+            << name_ << "'" << std::endl;
+        detach();
+        return false;
+    }
+    return true;
+}
+
+bool StateSegment::create(uint64 size)
+{
+    detach();
+
+    uint64 mapped = (size + segment_granularity - 1)
+        / segment_granularity * segment_granularity;
+
+    int fd = open_segment(O_RDWR | O_CREAT);
+    if (fd < 0)
+    {
+        int e = errno;
+        logger << "unable to create state segment '" << name_ << "': "
+            << strerror(e) << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || uint64(st.st_size) != mapped)
+    {
+        if (ftruncate(fd, mapped) != 0)
+        {
+            int e = errno;
+            logger << "unable to resize state segment '" << name_ << "' to "
+                << mapped << " bytes: " << strerror(e) << std::endl;
+            close(fd);
+            return false;
+        }
+    }
+
+    void* p = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        int e = errno;
+        logger << "unable to map state segment '" << name_ << "': "
+            << strerror(e) << std::endl;
+        return false;
+    }
+    base_ = (char*)p;
+    mapped_size_ = mapped;
+
+    // invalidate the old image before anything else is overwritten,
+    // a crash while saving must not leave a half written segment
+    // that looks complete
+    header()->complete = 0;
+    msync(base_, sizeof(segment_header), MS_SYNC);
+    return true;
+}
+
+void StateSegment::finish()
+{
+    if (base_ == NULL) return;
+    // the complete flag must not become visible before the rest
+    // of the image
+    __sync_synchronize();
+    header()->complete = 1;
+}
+
+void StateSegment::detach()
+{
+    if (base_ == NULL) return;
+    munmap(base_, mapped_size_);
+    base_ = NULL;
+    mapped_size_ = 0;
+}
+
+#endif
@@ -0,0 +1,145 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __STATE_SEGMENT_HPP__
+#define __STATE_SEGMENT_HPP__
+
+#include <string>
+#include <boost/noncopyable.hpp>
+#include <boost/static_assert.hpp>
+#include "templates.h"
+
+// bump this whenever any of the structures below change. A segment
+// with a different version is ignored and the tracker falls back
+// to the checkpoint file.
+#define STATE_SEGMENT_VERSION 1
+
+/*
+
+segment layout:
+
+The segment lives in POSIX shared memory (or a file on hugetlbfs)
+and survives the process. It never contains pointers, everything
+refers to other parts of the segment by its offset from the start
+of the segment, so it can be mapped at any address. The same image
+is also streamed to a new process during a handoff.
+
+segment_header
+uint64[num_swarms]      offsets of the segment_swarm records
+
+for each swarm:
+segment_swarm
+segment_peer[num_peers]
+
+*/
+
+struct segment_header
+{
+    char magic[8];
+    uint32 version;
+    // set to 1 once the segment is completely written
+    uint32 complete;
+    uint64 size;
+    uint64 num_swarms;
+    uint64 num_peers;
+    int64 saved_time;
+    // offset of the swarm offset table
+    uint64 swarm_table;
+};
+
+struct segment_swarm
+{
+    byte info_hash[20];
+    int32 flags;
+    uint32 num_peers;
+    uint32 reserved;
+    // offset of the first segment_peer
+    uint64 peers;
+};
+
+struct segment_peer
+{
+    byte peer_id[20];
+    int32 last_check_in;
+    uint8 status;
+    uint8 reserved;
+    // ports are in network order, like the endpoint tables
+    uint16 port;
+    byte ip[4];
+    uint16 port6;
+    uint16 reserved2;
+    byte ip6[16];
+};
+
+BOOST_STATIC_ASSERT(sizeof(segment_header) == 56);
+BOOST_STATIC_ASSERT(sizeof(segment_swarm) == 40);
+BOOST_STATIC_ASSERT(sizeof(segment_peer) == 52);
+
+// fills in the header of an image of size bytes. It's left
+// incomplete, set complete once everything else is written
+void init_segment_header(segment_header* h, uint64 size);
+
+// returns true if h is the header of a complete image from a
+// compatible version that fits in size bytes
+bool segment_header_valid(segment_header const* h, uint64 size);
+
+/// A named shared memory segment holding a complete image of the
+/// tracker state. Names containing a '/' after the first character
+/// are treated as a path (for instance on a hugetlbfs mount), other
+/// names are passed to shm_open().
+class StateSegment : private boost::noncopyable
+{
+public:
+    explicit StateSegment(const std::string& name);
+    ~StateSegment();
+
+    // maps an existing segment. Returns false if it doesn't exist
+    // or wasn't completely written by a compatible version.
+    bool attach();
+
+    // creates (or resizes) the segment to hold at least size bytes
+    // and maps it writable. The old image is marked incomplete
+    // until finish() is called.
+    bool create(uint64 size);
+    void finish();
+
+    char* base() const { return base_; }
+
+    void detach();
+
+    segment_header* header() const { return (segment_header*)base_; }
+    template <typename T>
+    T* at(uint64 offset) const { return (T*)(base_ + offset); }
+
+    const std::string& name() const { return name_; }
+
+private:
+    int open_segment(int flags);
+
+    std::string name_;
+    char* base_;
+    uint64 mapped_size_;
+};
+
+#endif //__STATE_SEGMENT_HPP__
@@ -41,6 +41,9 @@ THE SOFTWARE.
 #include <libtorrent/io.hpp>
 #include "server.hpp"
 #include "natcheck.hpp"
+#include "journal.hpp"
+#include "replication.hpp"
+#include "state_segment.hpp"
 #include "utils.hpp"
 
 #ifdef DISABLE_INVARIANT_CHECK
@@ -63,6 +66,36 @@ bool Swarm::enforce_dna_only = false;
 bool Swarm::default_dna_only = false;
 std::string Swarm::dna_only_prefix = "DNA";
 int Swarm::max_peer_handout_per_interval = 50;
+Journal* Swarm::journal = NULL;
+ReplicationServer* Swarm::replicator = NULL;
+bool Swarm::replica = false;
+int Swarm::idle_timeout = 2 * 60 * 60;
+size_t Swarm::max_pooled = 10000;
+std::vector<Swarm*> Swarm::pool;
+int64_t Swarm::num_swarms_recycled;
+int64_t Swarm::num_swarms_reused;
+int64_t Swarm::num_swarms_promoted;
+int64_t Swarm::num_swarms_demoted;
+int64_t Swarm::num_swarms_compacted;
+int64_t Swarm::num_bytes_compacted;
+int Swarm::max_peers = 0;
+int Swarm::locality_share = 0;
+int Swarm::locality_min_peers = 1000;
+int Swarm::numwant_default = 50;
+int Swarm::numwant_max = 200;
+int Swarm::numwant_seed_percent = 100;
+int Swarm::numwant_paused_percent = 50;
+int Swarm::numwant_shed_cpu = 80;
+int Swarm::numwant_shed_min = 10;
+double Swarm::tracker_cpu = 0;
+int64_t Swarm::num_peers_replaced;
+int64_t Swarm::num_local_peers_delivered;
+int64_t Swarm::num_numwant_capped;
+int64_t Swarm::numwant_bytes_saved;
+int64_t Swarm::handout_ages[Swarm::num_age_buckets];
+int64_t Swarm::num_announces_untracked;
+int64_t Swarm::num_capped_swarms;
+int64_t Swarm::untracked_estimate;
 
 Swarm::flagnames_t Swarm::flagnames[] = {
         { DISABLED, "disabled" },
@@ -87,9 +120,57 @@ namespace
         memcpy(&ret[0], flat_file, 20);
         return ret;
     }
+
+    // writes one peer to the checkpoint file
+    void write_state_peer(char*& out, peer_id const& pid,
+        int last_check_in, unsigned char status,
+        peer_endpoint_struct const& pe)
+    {
+        // for write_* functions
+        namespace io = libtorrent::detail;
+
+        // peer_id (20 bytes)
+        std::copy(pid.begin(), pid.begin() + 20, out);
+        out += 20;
+        // last_check_in (4 bytes)
+        io::write_int32(last_check_in, out);
+        // status (1 byte)
+        io::write_int8(status & ~(IS_ROUTABLE6 | HAS_V6), out);
+        assert(status & IS_ROUTABLE);
+        // ip + port (6 bytes)
+        memcpy(out, &pe, 6);
+        out += 6;
+    }
+
+    // writes one peer to the state segment
+    void write_image_peer(segment_peer* out, peer_id const& pid,
+        int last_check_in, unsigned char status,
+        peer_endpoint_struct const* pe, peer6_endpoint_struct const* pe6)
+    {
+        memset(out, 0, sizeof(segment_peer));
+        std::copy(pid.begin(), pid.end(), out->peer_id);
+        out->last_check_in = last_check_in;
+        out->status = status;
+
+        if (pe)
+        {
+            std::copy(pe->ip.begin(), pe->ip.end(), out->ip);
+            out->port = pe->port;
+        }
+        if (pe6)
+        {
+            std::copy(pe6->ip.begin(), pe6->ip.end(), out->ip6);
+            out->port6 = pe6->port;
+        }
+    }
 }
 
 void peer_struct::update_status(stats_struct const& stats)
+{
+    peer_ref(*this).update_status(stats);
+}
+
+void peer_ref::update_status(stats_struct const& stats)
 {
     last_check_in = time(NULL);
     if (stats.left == 0)
@@ -112,29 +193,461 @@ void peer_struct::update_status(stats_struct const& stats)
 }
 
 Swarm::Swarm(const std::string& info_hash, boost::asio::io_service& ios)
-    : info_hash(info_hash),
-      timeout(ios),
-      io_service_(ios),
-      flags(0)
+    : num_small_peers(0),
+      io_service_(ios)
+{
+    reset(info_hash);
+    //logger << sizeof(peer_endpoint_struct) << std::endl;
+}
+
+// (re)initializes an empty swarm
+void Swarm::reset(const std::string& ih)
 {
+    assert(size() == 0);
+
+    info_hash = ih;
+    flags = 0;
+    if (default_dna_only)
+        flags |= DNA_ONLY;
+
     for (int i = 0; i < peer_struct::num_categories; ++i)
     {
        peer_counts[i] = 0;
-       peer4_counts[i] = 0;
-       peer4_list_cursor[i] = 0.f;
-       next_handout4[i] = 0;
-       peer6_counts[i] = 0;
-       peer6_list_cursor[i] = 0.f;
-       next_handout6[i] = 0;
+       handout4.counts[i] = 0;
+       handout6.counts[i] = 0;
     }
+    reset_cursors();
 
+    stats_logger = StatsLogger();
     rank = UINT_MAX;
     cpuload = 0;
-    timeout.start(boost::posix_time::seconds(INTERVAL/2),
-                  boost::bind(&Swarm::timeout_peers, this));
-    if (default_dna_only)
-        flags |= DNA_ONLY;
-    //logger << sizeof(peer_endpoint_struct) << std::endl;
+    last_announce = time(NULL);
+    natchecks_pending = 0;
+    next_timeout = last_announce + INTERVAL/2;
+    untracked.reset();
+}
+
+void Swarm::reset_cursors()
+{
+    for (int i = 0; i < peer_struct::num_categories; ++i)
+    {
+       handout4.list_cursor[i] = 0.f;
+       handout4.next_handout[i] = 0;
+       handout6.list_cursor[i] = 0.f;
+       handout6.next_handout[i] = 0;
+    }
+}
+
+namespace
+{
+    slab_pool& swarm_pool()
+    {
+        static slab_pool& p = slab_pool::get(swarm_memory::name(), sizeof(Swarm));
+        return p;
+    }
+}
+
+void* Swarm::operator new(size_t size)
+{
+    assert(size == sizeof(Swarm));
+    return swarm_pool().allocate();
+}
+
+void Swarm::operator delete(void* p)
+{
+    if (p) swarm_pool().deallocate(p);
+}
+
+void* Swarm::peer_table::operator new(size_t size)
+{
+    assert(size == sizeof(peer_table));
+    static slab_pool& pool = slab_pool::get(peer_memory::name(), sizeof(peer_table));
+    return pool.allocate();
+}
+
+void Swarm::peer_table::operator delete(void* p)
+{
+    static slab_pool& pool = slab_pool::get(peer_memory::name(), sizeof(peer_table));
+    if (p) pool.deallocate(p);
+}
+
+Swarm* Swarm::create(const std::string& info_hash, boost::asio::io_service& ios)
+{
+    if (pool.empty()) return new Swarm(info_hash, ios);
+
+    Swarm* s = pool.back();
+    pool.pop_back();
+    assert(&s->io_service_ == &ios);
+    s->reset(info_hash);
+    ++num_swarms_reused;
+    return s;
+}
+
+void Swarm::recycle(Swarm* s)
+{
+    ++num_swarms_recycled;
+    if (s->size() > 0 || pool.size() >= max_pooled)
+    {
+        delete s;
+        return;
+    }
+
+    // pooled swarms shouldn't hold on to any memory
+    s->table.reset();
+    s->untracked.reset();
+    std::string().swap(s->info_hash);
+    pool.push_back(s);
+}
+
+bool Swarm::is_idle(time_t now) const
+{
+    if (idle_timeout <= 0) return false;
+    // nat_ok() and nat_bad() still refer to the swarm
+    if (size() > 0 || untracked || natchecks_pending > 0) return false;
+    // a blacklisted or terminated swarm must be remembered, and so
+    // must a DNA-only flag that isn't the default
+    if (flags & (DISABLED | TERMINATE | SELECTION_MASK)) return false;
+    if (((flags & DNA_ONLY) != 0) != default_dna_only) return false;
+    return now - last_announce > idle_timeout;
+}
+
+int Swarm::find_peer(peer_id const& pid)
+{
+    if (table)
+    {
+        peer_map::iterator i = table->peers.find(pid);
+        return i == table->peers.end() ? -1 : i->second;
+    }
+    for (int i = 0; i < num_small_peers; ++i)
+    {
+        if (small_peers[i].pid == pid) return i;
+    }
+    return -1;
+}
+
+void Swarm::insert_peer(peer_id const& pid, peer_struct const& peer,
+    peer_endpoint_struct const* ep, peer6_endpoint_struct const* ep6)
+{
+    assert(((peer.status & IS_ROUTABLE) != 0) == (ep != NULL));
+    assert(((peer.status & IS_ROUTABLE6) != 0) == (ep6 != NULL));
+
+    int category = peer.category();
+    ++peer_counts[category];
+    if (peer.status & HAS_V4) ++handout4.counts[category];
+    if (peer.status & HAS_V6) ++handout6.counts[category];
+
+    if (peer.status & IS_COMPLETE)
+        stats_logger.update_peer_counts(0, 1);
+    else
+        stats_logger.update_peer_counts(1, 0);
+
+    if (!table && (num_small_peers == SMALL_SWARM_PEERS || ep6))
+        promote();
+
+    if (!table)
+    {
+        small_peer& sp = small_peers[num_small_peers];
+        sp.pid = pid;
+        sp.p = peer;
+        sp.p.ep_pos = num_small_peers;
+        sp.p.ep6_pos = -1;
+        if (ep) sp.ep = *ep;
+        ++num_small_peers;
+        return;
+    }
+
+    int slot = table->insert(pid, peer);
+    if (ep) table->add_endpoint<ipv4_family>(slot, *ep);
+    if (ep6) table->add_endpoint<ipv6_family>(slot, *ep6);
+}
+
+void Swarm::uncount_peer(unsigned char status)
+{
+    int category = peer_struct::category_of(status);
+    --peer_counts[category];
+    if (status & HAS_V4) --handout4.counts[category];
+    if (status & HAS_V6) --handout6.counts[category];
+    assert(handout4.counts[category] >= 0);
+    assert(handout6.counts[category] >= 0);
+
+    if (status & IS_COMPLETE)
+    {
+        stats_logger.update_peer_counts(0, -1);
+    }
+    else
+    {
+        stats_logger.update_peer_counts(-1, 0);
+    }
+}
+
+void Swarm::promote()
+{
+    assert(!table);
+    table.reset(new peer_table);
+    for (int n = 0; n < num_small_peers; ++n)
+    {
+        small_peer const& sp = small_peers[n];
+        int slot = table->insert(sp.pid, sp.p);
+        if (sp.p.status & IS_ROUTABLE)
+            table->add_endpoint<ipv4_family>(slot, sp.ep);
+    }
+    num_small_peers = 0;
+    // the endpoint lists are in a different order now
+    reset_cursors();
+    ++num_swarms_promoted;
+}
+
+void Swarm::maybe_demote()
+{
+    // only demote at half the size, so a swarm around the threshold
+    // doesn't keep moving back and forth
+    if (!table || table->size() > SMALL_SWARM_PEERS / 2) return;
+
+    int const n = table->size();
+    for (int slot = 0; slot < n; ++slot)
+    {
+        if (table->status[slot] & IS_ROUTABLE6) return;
+    }
+
+    // the slots are dense, so the peers keep their order
+    assert(num_small_peers == 0);
+    for (int slot = 0; slot < n; ++slot)
+    {
+        small_peer& sp = small_peers[num_small_peers];
+        sp.pid = table->ids[slot];
+        sp.p.last_check_in = table->last_check_in[slot];
+        sp.p.status = table->status[slot];
+        sp.p.ep6_pos = -1;
+        if (sp.p.status & IS_ROUTABLE)
+        {
+            sp.ep = table->endpoints4.endpoints[sp.p.category()]
+                [table->ep_pos[slot]];
+        }
+        sp.p.ep_pos = num_small_peers;
+        ++num_small_peers;
+    }
+    table.reset();
+    reset_cursors();
+    ++num_swarms_demoted;
+}
+
+Swarm::untracked_peers::untracked_peers()
+    : current(0),
+      window_start(time(NULL)),
+      seen(max_peers),
+      estimated(0),
+      num_seeds(0),
+      num_downloaders(0)
+{
+    ++num_capped_swarms;
+}
+
+Swarm::untracked_peers::~untracked_peers()
+{
+    --num_capped_swarms;
+    untracked_estimate -= num_seeds + num_downloaders;
+}
+
+bool Swarm::make_room()
+{
+    rotate_untracked(time(NULL));
+    if (!untracked) untracked.reset(new untracked_peers);
+
+    // the n:th new peer replaces one with probability max_peers / n
+    ++untracked->seen;
+    if (fast_rand_unit() * untracked->seen >= max_peers)
+        return false;
+    return remove_random_peer();
+}
+
+bool Swarm::remove_random_peer()
+{
+    // only routable peers are replaced, they're the ones handed out
+    int total = 0;
+    for (int c = 0; c < peer_struct::num_categories; ++c)
+        total += num_endpoints<ipv4_family>(c);
+    if (total == 0) return false;
+    int pick = fast_rand(total);
+
+    ++num_peers_replaced;
+    if (!table)
+    {
+        for (int n = 0; n < num_small_peers; ++n)
+        {
+            small_peer const& sp = small_peers[n];
+            if (!(sp.p.status & IS_ROUTABLE) || pick-- > 0) continue;
+            count_untracked(sp.pid, sp.p.status & IS_COMPLETE);
+            remove_peer_at(n);
+            return true;
+        }
+        assert(false);
+        return false;
+    }
+
+    for (int c = 0; c < peer_struct::num_categories; ++c)
+    {
+        int num = table->endpoints4.endpoints[c].size();
+        if (pick >= num)
+        {
+            pick -= num;
+            continue;
+        }
+        int slot = table->endpoints4.peer[c][pick];
+        count_untracked(table->ids[slot], table->status[slot] & IS_COMPLETE);
+        remove_peer_at(slot);
+        return true;
+    }
+    assert(false);
+    return false;
+}
+
+void Swarm::count_untracked(peer_id const& pid, bool seed)
+{
+    rotate_untracked(time(NULL));
+    if (!untracked) untracked.reset(new untracked_peers);
+    HyperLogLog* sketches = seed ? untracked->seeds : untracked->downloaders;
+    sketches[untracked->current].add(&pid[0], pid.size);
+}
+
+void Swarm::rotate_untracked(time_t now)
+{
+    if (!untracked || now - untracked->window_start < INTERVAL) return;
+
+    untracked_peers& u = *untracked;
+    // peers that haven't announced for two windows are gone
+    if (now - u.window_start >= 2 * INTERVAL
+        || (u.seeds[u.current].estimate() == 0
+            && u.downloaders[u.current].estimate() == 0))
+    {
+        untracked.reset();
+        return;
+    }
+    u.current ^= 1;
+    u.seeds[u.current].clear();
+    u.downloaders[u.current].clear();
+    u.window_start = now;
+    u.seen = max_peers;
+    u.estimated = 0;
+}
+
+void Swarm::update_estimate() const
+{
+    untracked_peers& u = *untracked;
+    time_t now = time(NULL);
+    if (u.estimated == now) return;
+    u.estimated = now;
+
+    // the previous window has every untracked peer that's still
+    // announcing, the current one may have new ones
+    int64_t seeds = std::max(u.seeds[0].estimate(), u.seeds[1].estimate());
+    int64_t downloaders = std::max(u.downloaders[0].estimate(),
+        u.downloaders[1].estimate());
+    untracked_estimate += seeds + downloaders - u.num_seeds - u.num_downloaders;
+    u.num_seeds = seeds;
+    u.num_downloaders = downloaders;
+}
+
+int64_t Swarm::untracked_seeds() const
+{
+    if (!untracked) return 0;
+    update_estimate();
+    return untracked->num_seeds;
+}
+
+int64_t Swarm::untracked_downloaders() const
+{
+    if (!untracked) return 0;
+    update_estimate();
+    return untracked->num_downloaders;
+}
+
+size_t Swarm::compact()
+{
+    if (!table) return 0;
+
+    size_t freed = table->shrink();
+
+    // the peer_map never gives back its buckets either
+    size_t buckets = table->peers.bucket_count();
+    if (buckets > 1024 && buckets > 8 * table->peers.size())
+    {
+        rebuild_table();
+        freed += (buckets - table->peers.bucket_count()) * sizeof(void*);
+    }
+
+    if (freed > 0)
+    {
+        ++num_swarms_compacted;
+        num_bytes_compacted += freed;
+    }
+    return freed;
+}
+
+void Swarm::rebuild_table()
+{
+    // the peers keep their slots, so the columns and the endpoint
+    // lists don't change
+    peer_map peers;
+    peers.resize(table->size());
+    int const n = table->size();
+    for (int slot = 0; slot < n; ++slot)
+        peers.insert(std::make_pair(table->ids[slot], slot));
+    table->peers.swap(peers);
+}
+
+void Swarm::peer_table::erase(int slot)
+{
+    assert(slot >= 0 && slot < int(size()));
+    assert(ep_pos[slot] == -1 && ep6_pos[slot] == -1);
+    peers.erase(ids[slot]);
+
+    int last = size() - 1;
+    if (slot != last)
+    {
+        // move the last peer into the free slot, and point its
+        // map entry and endpoints at the new slot
+        ids[slot] = ids[last];
+        last_check_in[slot] = last_check_in[last];
+        status[slot] = status[last];
+        ep_pos[slot] = ep_pos[last];
+        ep6_pos[slot] = ep6_pos[last];
+        cursor[slot] = cursor[last];
+
+        peers[ids[slot]] = slot;
+        int category = peer_struct::category_of(status[slot]);
+        if (ep_pos[slot] != -1)
+            endpoints4.peer[category][ep_pos[slot]] = slot;
+        if (ep6_pos[slot] != -1)
+            endpoints6.peer[category][ep6_pos[slot]] = slot;
+    }
+
+    ids.pop_back();
+    last_check_in.pop_back();
+    status.pop_back();
+    ep_pos.pop_back();
+    ep6_pos.pop_back();
+    cursor.pop_back();
+}
+
+size_t Swarm::peer_table::shrink()
+{
+    return ids.shrink() + last_check_in.shrink() + status.shrink()
+        + ep_pos.shrink() + ep6_pos.shrink() + cursor.shrink()
+        + endpoints4.shrink() + endpoints6.shrink();
+}
+
+template <class Family>
+int Swarm::num_endpoints(int category) const
+{
+    if (table) return table->endpoints(Family()).endpoints[category].size();
+    if (!Family::in_small_swarms) return 0;
+    int ret = 0;
+    for (int i = 0; i < num_small_peers; ++i)
+    {
+        peer_struct const& p = small_peers[i].p;
+        if ((p.status & IS_ROUTABLE) && p.category() == category) ++ret;
+    }
+    return ret;
 }
 
 /*
@@ -161,17 +674,14 @@ void Swarm::save_state(std::vector<char>& file) const
     return;
 #endif
 
-    if (peers.empty()) return;
+    if (size() == 0) return;
 
     // for write_* functions
     namespace io = libtorrent::detail;
 
     int num_peers = 0;
     for (int i = 0; i < peer_struct::num_categories; ++i)
-    {
-        num_peers += peer_endpoints[i].size();
-        assert(peer_endpoints[i].size() == peer_endpoint_to_peer[i].size());
-    }
+        num_peers += num_endpoints<ipv4_family>(i);
     // save at most 40 peers per swarm
     if (num_peers > 40) num_peers = 40;
 
@@ -188,131 +698,195 @@ void Swarm::save_state(std::vector<char>& file) const
     for (int category = 0; category < peer_struct::num_categories; ++category)
     {
         if (num_peers <= 0) break;
-        typedef std::vector<peer_endpoint_struct> endpoints_t;
-        typedef std::vector<peer_map::iterator> endpoint_to_peer_t;
 
-        int size = std::min(int(peer_endpoints[category].size()), num_peers);
-        endpoint_to_peer_t::const_iterator j = peer_endpoint_to_peer[category].begin();
-        endpoints_t::const_iterator i = peer_endpoints[category].begin();
-        endpoints_t::const_iterator end = peer_endpoints[category].begin() + size;
+        if (!table)
+        {
+            for (int n = 0; n < num_small_peers && num_peers > 0; ++n)
+            {
+                small_peer const& sp = small_peers[n];
+                if (!(sp.p.status & IS_ROUTABLE)) continue;
+                if (sp.p.category() != category) continue;
+                write_state_peer(out, sp.pid, sp.p.last_check_in,
+                    sp.p.status, sp.ep);
+                --num_peers;
+            }
+            continue;
+        }
+
+        chunked_vector<peer_endpoint_struct, endpoint_memory> const& endpoints
+            = table->endpoints4.endpoints[category];
+        chunked_vector<int, endpoint_memory> const& endpoint_to_peer
+            = table->endpoints4.peer[category];
+        assert(endpoints.size() == endpoint_to_peer.size());
+        int size = std::min(int(endpoints.size()), num_peers);
 
-        for (;i != end; ++i, ++j)
+        for (int i = 0; i < size; ++i)
         {
-            peer_struct& p = (*j)->second;
-            peer_id const& pid = (*j)->first;
-            // peer_id (20 bytes)
-            std::copy(pid.begin(), pid.begin() + 20, out);
-            out += 20;
-            // last_check_in (4 bytes)
-            io::write_int32(p.last_check_in, out);
-            // status (1 byte)
-            io::write_int8(p.status & ~(IS_ROUTABLE6 | HAS_V6), out);
-            assert(p.status & IS_ROUTABLE);
-            // ip + port (6 bytes)
-            peer_endpoint_struct const& pe = *i;
-            memcpy(out, &pe, 6);
-            out += 6;
+            int slot = endpoint_to_peer[i];
+            write_state_peer(out, table->ids[slot],
+                table->last_check_in[slot], table->status[slot],
+                endpoints[i]);
             --num_peers;
         }
     }
 }
 
-// restore state
-Swarm::Swarm(char const* flat_file, int& size, boost::asio::io_service& ios, int &num_peers)
-    : info_hash(read_20_bytes(flat_file)),
-      timeout(ios),
+// parses one swarm from the checkpoint file
+int Swarm::read_state(char const* flat_file, int size,
+    std::string& info_hash, std::vector<segment_peer>& peers)
+{
+    // for read_* functions
+    namespace io = libtorrent::detail;
+
+    if (size < 20 + 4) return 0;
+    char const* start = flat_file;
+
+    info_hash = read_20_bytes(flat_file);
+    flat_file += 20;
+
+    int num_peers = io::read_int32(flat_file);
+    if (num_peers < 0) return -1;
+    // save_state() never saves more than this
+    if (num_peers > 40) return -1;
+    if (size < 20 + 4 + num_peers * (20 + 4 + 1 + 4 + 2)) return 0;
+
+    peers.clear();
+    for (int i = 0; i < num_peers; ++i)
+    {
+        segment_peer p;
+        memset(&p, 0, sizeof(p));
+        std::copy(flat_file, flat_file + 20, p.peer_id);
+        flat_file += 20;
+        p.last_check_in = io::read_int32(flat_file);
+        p.status = io::read_uint8(flat_file);
+        // ip + port, the port is already in network order
+        memcpy(p.ip, flat_file, 4);
+        memcpy(&p.port, flat_file + 4, 2);
+        flat_file += 6;
+
+        // only routable peers are saved, and we don't save
+        // v6 addresses, so we must clear those flags
+        if ((p.status & IS_ROUTABLE) == 0) continue;
+        p.status |= HAS_V4;
+        p.status &= ~(IS_ROUTABLE6 | HAS_V6);
+        peers.push_back(p);
+    }
+
+    return flat_file - start;
+}
+
+// saves the complete swarm to the state segment
+void Swarm::save_image(segment_swarm& image, segment_peer* out) const
+{
+    std::copy(info_hash.begin(), info_hash.end(), image.info_hash);
+    image.flags = flags;
+    image.num_peers = size();
+    image.reserved = 0;
+
+    if (!table)
+    {
+        for (int n = 0; n < num_small_peers; ++n, ++out)
+        {
+            small_peer const& sp = small_peers[n];
+            write_image_peer(out, sp.pid, sp.p.last_check_in, sp.p.status,
+                (sp.p.status & IS_ROUTABLE) ? &sp.ep : NULL, NULL);
+        }
+        return;
+    }
+
+    int const n = table->size();
+    for (int slot = 0; slot < n; ++slot, ++out)
+    {
+        int category = peer_struct::category_of(table->status[slot]);
+        int ep_pos = table->ep_pos[slot];
+        int ep6_pos = table->ep6_pos[slot];
+
+        write_image_peer(out, table->ids[slot],
+            table->last_check_in[slot], table->status[slot],
+            ep_pos >= 0 ? &table->endpoints4.endpoints[category][ep_pos] : NULL,
+            ep6_pos >= 0 ? &table->endpoints6.endpoints[category][ep6_pos] : NULL);
+    }
+}
+
+// restore the complete swarm from the state segment
+Swarm::Swarm(segment_swarm const& image, segment_peer const* image_peers,
+    boost::asio::io_service& ios)
+    : info_hash((char const*)image.info_hash, 20),
+      num_small_peers(0),
       io_service_(ios),
-      flags(0)
+      flags(image.flags)
 {
     for (int i = 0; i < peer_struct::num_categories; ++i)
     {
        peer_counts[i] = 0;
-       peer4_counts[i] = 0;
-       peer4_list_cursor[i] = 0.f;
-       next_handout4[i] = 0;
-       peer6_counts[i] = 0;
-       peer6_list_cursor[i] = 0.f;
-       next_handout6[i] = 0;
+       handout4.counts[i] = 0;
+       handout6.counts[i] = 0;
     }
+    reset_cursors();
 
     rank = UINT_MAX;
     cpuload = 0;
-    timeout.start(boost::posix_time::seconds(INTERVAL/2),
-        boost::bind(&Swarm::timeout_peers, this));
-
-    if (default_dna_only)
-        flags |= DNA_ONLY;
-
-    size -= 20;
-    flat_file += 20;
-
-    // for write_* functions
-    namespace io = libtorrent::detail;
+    last_announce = time(NULL);
+    natchecks_pending = 0;
+    next_timeout = last_announce + INTERVAL/2;
 
-    if (size < 4) return;
+    if (image.num_peers > SMALL_SWARM_PEERS)
+    {
+        table.reset(new peer_table);
+        table->peers.resize(image.num_peers);
+    }
+    merge_peers(image_peers, image.num_peers);
 
-    num_peers = io::read_int32(flat_file);
-    size -= 4;
-    if (size <= 0) return;
+    INVARIANT_CHECK;
+}
 
-    if (num_peers < 0) return;
-    if (num_peers > 40) num_peers = 40;
+// adds the peers that aren't in the swarm already
+size_t Swarm::merge_peers(segment_peer const* new_peers, size_t num_peers)
+{
+    INVARIANT_CHECK;
 
-    for (int i = 0; i < num_peers; ++i)
+    size_t added = 0;
+    for (size_t n = 0; n < num_peers; ++n)
     {
-        if (size < 20 + 4 + 1 + 4 + 2) return;
+        segment_peer const& sp = new_peers[n];
         peer_id pid;
-        std::copy(flat_file, flat_file + 20, &pid[0]);
-        flat_file += 20;
-        size -= 20;
+        std::copy(sp.peer_id, sp.peer_id + 20, pid.begin());
+        // peers we already know are more recent
+        if (find_peer(pid) != -1) continue;
 
         peer_struct peer;
-        peer.last_check_in = io::read_int32(flat_file);
-        size -= 4;
-        peer.status = io::read_uint8(flat_file);
-        size -= 1;
-
-        if (peer.status & IS_COMPLETE)
-            stats_logger.update_peer_counts(0, 1);
-        else
-            stats_logger.update_peer_counts(1, 0);
-
-        peer.status |= HAS_V4;
-        if ((peer.status & IS_ROUTABLE) == 0) return;
-        // since we don't save v6 addresses, we must clear this flag
-        peer.status &= ~(IS_ROUTABLE6 | HAS_V6);
+        peer.last_check_in = sp.last_check_in;
+        peer.status = sp.status;
+        if (peer.status & IS_ROUTABLE) peer.status |= HAS_V4;
+        if (peer.status & IS_ROUTABLE6) peer.status |= HAS_V6;
 
         peer_endpoint_struct pe;
-        pe.ip[0] = io::read_uint8(flat_file);
-        pe.ip[1] = io::read_uint8(flat_file);
-        pe.ip[2] = io::read_uint8(flat_file);
-        pe.ip[3] = io::read_uint8(flat_file);
-        pe.port = io::read_uint16(flat_file);
-        size -= 6;
-        int category = peer.category();
-        ++peer4_counts[category];
-        ++peer_counts[category];
-        peer_endpoints[category].push_back(pe);
-        peer.ep_pos = peer_endpoints[category].size() - 1;
-        peer_map::iterator iter = this->peers.insert(std::make_pair(pid, peer)).first;
-        peer_endpoint_to_peer[category].push_back(iter);
+        std::copy(sp.ip, sp.ip + 4, pe.ip.begin());
+        pe.port = sp.port;
+        peer6_endpoint_struct pe6;
+        std::copy(sp.ip6, sp.ip6 + 16, pe6.ip.begin());
+        pe6.port = sp.port6;
+
+        insert_peer(pid, peer,
+            (peer.status & IS_ROUTABLE) ? &pe : NULL,
+            (peer.status & IS_ROUTABLE6) ? &pe6 : NULL);
+        ++added;
     }
-
-    INVARIANT_CHECK;
+    return added;
 }
 
 void Swarm::nat_ok(peer_id const& pid, tcp::endpoint ep, int r)
 {
+    --natchecks_pending;
     nc_pass++;
     //logger << "Natcheck pass! " << r << " (" << nc_pass << "/" << nc_fail << "=" << ((double)nc_pass/(nc_pass+nc_fail)) << ")" << "\n";
-    peer_map::iterator i = peers.find(pid);
-    if (i == peers.end()) return;
-    add_peer_endpoint(i, ep.address(), ep.port());
+    add_peer_endpoint(pid, ep.address(), ep.port());
 }
 
 
 void Swarm::nat_bad(peer_id const& pid, tcp::endpoint ep, const std::exception &e)
 {
+    --natchecks_pending;
     nc_fail++;
     //logger << "Natcheck fail! " << e.what() << " (" << nc_pass << "/" << nc_fail << "=" << ((double)nc_pass/(nc_pass+nc_fail)) << ")" << "\n";
 }
@@ -328,13 +902,20 @@ bool Swarm::peer_permitted(const std::string &peer_id)
     return false;
 }
 
+bool Swarm::new_swarm_permits(const std::string& peer_id)
+{
+    if (!enforce_dna_only || !default_dna_only)
+        return true;
+    return starts_with(peer_id, dna_only_prefix);
+}
+
 void Swarm::handle_announce(const std::string &peer_id,
     boost::asio::ip::address_v4 ip, uint16 port,
     boost::asio::ip::address_v6 ipv6, uint16 port6,
     int numwant,
     stats_struct& stats,
-    std::string& peers,
-    std::string& peers6,
+    peer_list& peers,
+    peer_list& peers6,
     bool client_debug)
 {
     libtorrent::peer_id const pid(peer_id);
@@ -353,43 +934,58 @@ void Swarm::handle_announce(const std::string &peer_id,
     }
 
     stats_logger.log_request(stats);
-
-    // stopped event should not return peers
-    if (stats.event == STOPPED)
-        numwant = 0;
+    last_announce = time(NULL);
 
     int category = stats.left == 0 ? peer_struct::seeding
        : stats.event == PAUSED ? peer_struct::paused
        : peer_struct::active;
 
+    // stopped event should not return peers
+    int const asked = numwant < 0 ? numwant_default : numwant;
+    if (stats.event == STOPPED)
+        numwant = 0;
+    else
+        numwant = cap_numwant(numwant, category);
+
     //logger << "returning " << peers.size() << " bytes" << std::endl;
 
     if (port != 0 || port6 != 0)
     {
-        peer_map::iterator i = this->peers.find(pid);
+        int slot = find_peer(pid);
         if (stats.event != STOPPED)
         {
-            if (i == this->peers.end())
+            if (slot == -1 && max_peers > 0 && int(size()) >= max_peers
+                && !make_room())
+            {
+                // the swarm is full, the peer is only counted
+                ++num_announces_untracked;
+                count_untracked(pid, stats.left == 0);
+            }
+            else if (slot == -1)
             {
                 //logger << "adding: " << peer_id << std::endl;
                 add_peer(pid, ip != boost::asio::ip::address_v4::any(),
                    ipv6 != boost::asio::ip::address_v6::any(), stats);
 
                 if (ip != boost::asio::ip::address_v4::any())
-                    start_natcheck(pid, tcp::endpoint(ip, port));
+                    start_natcheck(pid, tcp::endpoint(ip, port), stats.left == 0);
                 if (ipv6 != boost::asio::ip::address_v6::any())
-                    start_natcheck(pid, tcp::endpoint(ipv6, port6));
+                    start_natcheck(pid, tcp::endpoint(ipv6, port6), stats.left == 0);
             }
             else
             {
                 //logger << "updating" << std::endl;
-                update_peer(i, ip, port, ipv6, port6, stats, client_debug);
+                update_peer(pid, slot, ip, port, ipv6, port6, stats, client_debug);
             }
         }
         else
         {
             //logger << "removing" << std::endl;
-            if (i != this->peers.end()) remove_peer(i);
+            if (slot != -1)
+            {
+                remove_peer_at(slot);
+                maybe_demote();
+            }
         }
     }
     else
@@ -398,10 +994,37 @@ void Swarm::handle_announce(const std::string &peer_id,
             logger << "   port = 0 rejected" << std::endl;
     }
 
+    update_locality();
+    update_freshness();
+    // the peer may have been added, or moved to a peer table
+    int const requester_slot = numwant > 0 ? find_peer(pid) : -1;
+    requester to = make_requester(requester_slot);
+    to.sample_ages = table && fast_rand(16) == 0;
     if (ip != boost::asio::ip::address_v4::any())
-        get_peers(peers, numwant, category, false);
+        get_peers<ipv4_family>(peers, numwant, category, ip, to);
     if (ipv6 != boost::asio::ip::address_v6::any())
-        get_peers(peers6, numwant, category, true);
+        get_peers<ipv6_family>(peers6, numwant, category, ipv6, to);
+    if (to.has_cursor)
+        table->cursor[requester_slot] += to.walked;
+
+    if (numwant < asked && stats.event != STOPPED)
+    {
+        // what the reply would have had without the cap, if the
+        // swarm had that many to hand out
+        ++num_numwant_capped;
+        if (ip != boost::asio::ip::address_v4::any())
+        {
+            numwant_bytes_saved += sizeof(peer_endpoint_struct)
+                * std::max(0, std::min(asked, num_candidates<ipv4_family>(category, to))
+                    - int(peers.size() / sizeof(peer_endpoint_struct)));
+        }
+        if (ipv6 != boost::asio::ip::address_v6::any())
+        {
+            numwant_bytes_saved += sizeof(peer6_endpoint_struct)
+                * std::max(0, std::min(asked, num_candidates<ipv6_family>(category, to))
+                    - int(peers6.size() / sizeof(peer6_endpoint_struct)));
+        }
+    }
 
     if (verbose_logging)
        logger << "   returned " << (peers.size() / 6) << " IPv4 peers and "
@@ -409,13 +1032,28 @@ void Swarm::handle_announce(const std::string &peer_id,
     //logger << this->peers.size() << " total peers known" << std::endl;
 }
 
-void Swarm::start_natcheck(libtorrent::peer_id const& pid, tcp::endpoint const& ep)
+template <class Family>
+int Swarm::num_routable() const
+{
+    return num_endpoints<Family>(peer_struct::seeding)
+        + num_endpoints<Family>(peer_struct::active)
+        + num_endpoints<Family>(peer_struct::paused);
+}
+
+void Swarm::start_natcheck(libtorrent::peer_id const& pid, tcp::endpoint const& ep,
+    bool seed)
 {
+    ++natchecks_pending;
+    // a swarm with few peers to connect to gains the most from another,
+    // and seeds are worth more than downloaders
+    int const routable = ep.address().is_v4()
+        ? num_routable<ipv4_family>() : num_routable<ipv6_family>();
+    int const priority = (routable < NatCheck::few_endpoints ? 2 : 0) + (seed ? 1 : 0);
     CallbackHandler<int> handler(
         boost::bind(&Swarm::nat_ok, this, pid, ep, _1),
         boost::bind(&Swarm::nat_bad, this, pid, ep, _1));
     StartNatCheck(this->io_service_, ep, (const byte*)&this->info_hash[0],
-        (byte*)&pid[0], handler);
+        (byte*)&pid[0], handler, priority);
 }
 
 void Swarm::add_peer(peer_id const& pid, bool ipv4, bool ipv6,
@@ -427,79 +1065,120 @@ void Swarm::add_peer(peer_id const& pid, bool ipv4, bool ipv6,
 
     num_peers_created++;
 
-    if (stats.left == 0)
-    {
-        peer.status |= IS_COMPLETE;
-        stats_logger.update_peer_counts(0, 1);
-    }
-    else
-    {
-        stats_logger.update_peer_counts(1, 0);
-    }
-
     peer.update_status(stats);
     assert(peer.ep_pos == -1);
     assert(peer.ep6_pos == -1);
 
-    int category = peer.category();
-    ++peer_counts[category];
-    if (ipv4)
-    {
-       ++peer4_counts[category];
-       peer.status |= HAS_V4;
-    }
-    if (ipv6)
-    {
-       ++peer6_counts[category];
-       peer.status |= HAS_V6;
-    }
+    if (ipv4) peer.status |= HAS_V4;
+    if (ipv6) peer.status |= HAS_V6;
 
-    this->peers[pid] = peer;
+    insert_peer(pid, peer, NULL, NULL);
+    log_change(JOURNAL_ADD, pid, peer);
 
     if (verbose_logging)
-        logger << "   ADDED PEER category: " << category
+        logger << "   ADDED PEER category: " << peer.category()
             << std::endl;
 }
 
 
-void Swarm::add_peer_endpoint(peer_map::iterator peer,
+namespace
+{
+    int journal_endpoint_type(ipv4_family) { return JOURNAL_ENDPOINT4; }
+    int journal_endpoint_type(ipv6_family) { return JOURNAL_ENDPOINT6; }
+
+    // small swarms only keep v4 endpoints, with their peers
+    void store_small_endpoint(peer_endpoint_struct& small_ep,
+        peer_endpoint_struct const& ep)
+    {
+        small_ep = ep;
+    }
+    void store_small_endpoint(peer_endpoint_struct&,
+        peer6_endpoint_struct const&)
+    {
+        assert(false);
+    }
+}
+
+void Swarm::add_peer_endpoint(peer_id const& pid,
     boost::asio::ip::address ip, uint16 port)
 {
     INVARIANT_CHECK;
 
-    // if the peer is already added, just ignore it
-    // multiple pending NAT checks could complete if the peer
-    // stops and restarts quickly. just drop later successes.
-    if (ip.is_v6() && (peer->second.status & IS_ROUTABLE6)) return;
-    if (ip.is_v4() && (peer->second.status & IS_ROUTABLE)) return;
+    int slot = find_peer(pid);
+    if (slot == -1) return;
 
-    int category = peer->second.category();
     if (ip.is_v6())
-    {
-        peer6_endpoint_struct peer_endpoint;
-        peer_endpoint.ip = ip.to_v6().to_bytes(); 
-        peer_endpoint.port = htons(port);
-        this->peer6_endpoints[category].push_back(peer_endpoint);
-        this->peer6_endpoint_to_peer[category].push_back(peer);
-        assert(peer->second.ep6_pos == -1);
-        peer->second.ep6_pos = this->peer6_endpoints[category].size() - 1;
-        peer->second.status |= IS_ROUTABLE6;
-    }
+        add_peer_endpoint<ipv6_family>(pid, slot, ip.to_v6(), port);
     else
+        add_peer_endpoint<ipv4_family>(pid, slot, ip.to_v4(), port);
+}
+
+template <class Family>
+void Swarm::add_peer_endpoint(peer_id const& pid, int slot,
+    typename Family::address_type const& ip, uint16 port)
+{
+    typename Family::endpoint_type peer_endpoint;
+    peer_endpoint.ip = ip.to_bytes();
+    peer_endpoint.port = htons(port);
+
     {
-        peer_endpoint_struct peer_endpoint;
-        peer_endpoint.ip = ip.to_v4().to_bytes(); 
-        peer_endpoint.port = htons(port);
-        this->peer_endpoints[category].push_back(peer_endpoint);
-        this->peer_endpoint_to_peer[category].push_back(peer);
-        assert(peer->second.ep_pos == -1);
-        peer->second.ep_pos = this->peer_endpoints[category].size() - 1;
-        peer->second.status |= IS_ROUTABLE;
+        // if the peer is already added, just ignore it
+        // multiple pending NAT checks could complete if the peer
+        // stops and restarts quickly. just drop later successes.
+        peer_ref p = peer_at(slot);
+        if (p.status & Family::routable) return;
+
+        if (!table)
+        {
+            if (Family::in_small_swarms)
+            {
+                store_small_endpoint(small_peers[slot].ep, peer_endpoint);
+                p.status |= Family::routable;
+                log_change(journal_endpoint_type(Family()), pid, p, ip,
+                    peer_endpoint.port);
+                return;
+            }
+            // small swarms have no room for v6 endpoints. The
+            // peers keep their slots
+            promote();
+        }
     }
+
+    peer_ref p = table->at(slot);
+    assert(Family::position(p) == -1);
+    p.status |= Family::routable;
+    table->add_endpoint<Family>(slot, peer_endpoint);
+    log_change(journal_endpoint_type(Family()), pid, p, ip,
+        peer_endpoint.port);
+}
+
+template <class Family>
+bool Swarm::add_address(peer_ref const& p)
+{
+    if (p.status & Family::has_address) return false;
+    ++handout(Family()).counts[p.category()];
+    p.status |= Family::has_address;
+    return true;
 }
 
+template <class Family>
+void Swarm::update_endpoint(peer_ref const& p,
+    typename Family::address_type const& ip, uint16 port)
+{
+    if (!(p.status & Family::routable)) return;
+
+    int pos = Family::position(p);
+    assert(pos >= 0);
+    typename Family::endpoint_type peer_endpoint;
+    peer_endpoint.ip = ip.to_bytes();
+    peer_endpoint.port = htons(port);
+    if (table)
+        table->endpoints(Family()).set(p.category(), pos, peer_endpoint);
+    else
+        store_small_endpoint(small_peers[pos].ep, peer_endpoint);
+}
 
-void Swarm::update_peer(peer_map::iterator iter,
+void Swarm::update_peer(peer_id const& pid, int slot,
     boost::asio::ip::address_v4 ip, uint16 port,
     boost::asio::ip::address_v6 ipv6, uint16 port6,
     stats_struct& stats,
@@ -507,24 +1186,19 @@ void Swarm::update_peer(peer_map::iterator iter,
 {
     INVARIANT_CHECK;
 
-    peer_struct& p = iter->second;
-    peer_id const& pid = iter->first;
-
-    int category = p.category();
+    peer_ref p = peer_at(slot);
 
     // if the peer has another endpoint that it didn't use
     // to have, issue a nat-check for it
-    if (ip != boost::asio::ip::address_v4::any() && !(p.status & HAS_V4))
+    if (ip != boost::asio::ip::address_v4::any()
+        && add_address<ipv4_family>(p))
     {
-        ++peer4_counts[category];
-        p.status |= HAS_V4;
-        start_natcheck(pid, tcp::endpoint(ip, port));
+        start_natcheck(pid, tcp::endpoint(ip, port), stats.left == 0);
     }
-    if (ipv6 != boost::asio::ip::address_v6::any() && !(p.status & HAS_V6))
+    if (ipv6 != boost::asio::ip::address_v6::any()
+        && add_address<ipv6_family>(p))
     {
-        ++peer6_counts[category];
-        p.status |= HAS_V6;
-        start_natcheck(pid, tcp::endpoint(ipv6, port6));
+        start_natcheck(pid, tcp::endpoint(ipv6, port6), stats.left == 0);
     }
 
     // is true if we allow the peer to check in sooner than the
@@ -552,8 +1226,8 @@ void Swarm::update_peer(peer_map::iterator iter,
     // only routable peer, and it will always join the swarm second.
     // the published the has to announce again to be able to connect
     // to the bt-seeder, and upload to it.
-    if (peer_endpoints[peer_struct::active].size()
-        + peer_endpoints[peer_struct::seeding].size() <= 2)
+    if (num_endpoints<ipv4_family>(peer_struct::active)
+        + num_endpoints<ipv4_family>(peer_struct::seeding) <= 2)
         grant_exception = true;
 
     // peer-id used by the load tester
@@ -574,48 +1248,10 @@ void Swarm::update_peer(peer_map::iterator iter,
 
     if (new_category != old_category)
     {
-        --peer_counts[old_category];
-        ++peer_counts[new_category];
-        if (p.status & HAS_V4)
-        {
-            --peer4_counts[old_category];
-            ++peer4_counts[new_category];
-            assert(peer4_counts[old_category] >= 0);
-        }
-        if (p.status & HAS_V6)
-        {
-            --peer6_counts[old_category];
-            ++peer6_counts[new_category];
-            assert(peer6_counts[old_category] >= 0);
-        }
-
-        // move the endpoint from the old list to the new one
-
-        if (p.status & IS_ROUTABLE)
-        {
-            assert(p.status & HAS_V4);
-            peer_endpoint_struct endp = peer_endpoints[category][p.ep_pos];
-            remove_endpoint(old_category, p.ep_pos);
-            p.ep_pos = add_endpoint(iter, endp);
-        }
-        if (p.status & IS_ROUTABLE6)
-        {
-            assert(p.status & HAS_V6);
-            peer6_endpoint_struct endp = peer6_endpoints[category][p.ep6_pos];
-            remove_endpoint6(old_category, p.ep6_pos);
-            p.ep6_pos = add_endpoint6(iter, endp);
-        }
-
-        if (new_category == peer_struct::seeding)
-        {
-            stats_logger.update_peer_counts(-1, 1);
-        }
-        else if (old_category == peer_struct::seeding)
-        {
-            // wtf, they were complete and now are not?
-            stats_logger.update_peer_counts(1, -1);
-        }
+        move_peer(slot, old_category);
+        log_change(JOURNAL_UPDATE, pid, p);
     }
+    if (table) table->checked_in(slot);
 
     if (verbose_logging)
         logger << "   UPDATE PEER "
@@ -628,93 +1264,453 @@ void Swarm::update_peer(peer_map::iterator iter,
     // TODO: compare the reported IP with the one in the endpoint table
     // If different, remove the endpoint (and ROUTABLE flag on the peer)
     // and issue a new NAT-check
-    if (p.status & IS_ROUTABLE)
+    update_endpoint<ipv4_family>(p, ip, port);
+    update_endpoint<ipv6_family>(p, ipv6, port6);
+}
+
+
+void Swarm::move_peer(int slot, int old_category)
+{
+    peer_ref p = peer_at(slot);
+    int new_category = p.category();
+    assert(new_category != old_category);
+
+    --peer_counts[old_category];
+    ++peer_counts[new_category];
+    if (p.status & HAS_V4)
+    {
+        --handout4.counts[old_category];
+        ++handout4.counts[new_category];
+        assert(handout4.counts[old_category] >= 0);
+    }
+    if (p.status & HAS_V6)
+    {
+        --handout6.counts[old_category];
+        ++handout6.counts[new_category];
+        assert(handout6.counts[old_category] >= 0);
+    }
+
+    // move the endpoint from the old list to the new one. The
+    // endpoint of a small swarm's peer stays where it is
+    if (table)
+    {
+        move_endpoint<ipv4_family>(slot, old_category);
+        move_endpoint<ipv6_family>(slot, old_category);
+    }
+
+    if (new_category == peer_struct::seeding)
+    {
+        stats_logger.update_peer_counts(-1, 1);
+    }
+    else if (old_category == peer_struct::seeding)
+    {
+        // wtf, they were complete and now are not?
+        stats_logger.update_peer_counts(1, -1);
+    }
+}
+
+template <class Family>
+void Swarm::move_endpoint(int slot, int old_category)
+{
+    peer_ref p = table->at(slot);
+    if (!(p.status & Family::routable)) return;
+    assert(p.status & Family::has_address);
+
+    typename Family::endpoint_type endp
+        = table->endpoints(Family()).endpoints[old_category][Family::position(p)];
+    table->remove_endpoint<Family>(slot, old_category);
+    table->add_endpoint<Family>(slot, endp);
+}
+
+void Swarm::log_change(int type, peer_id const& pid, peer_ref const& p,
+    boost::asio::ip::address const& ip, uint16 port)
+{
+    if (journal == NULL && replicator == NULL) return;
+
+    journal_record r;
+    memset(&r, 0, sizeof(r));
+    r.type = type;
+    r.status = p.status;
+    r.port = port;
+    r.time = type == JOURNAL_REMOVE ? time(NULL) : p.last_check_in;
+    memcpy(r.info_hash, &info_hash[0], 20);
+    memcpy(r.peer_id, &pid[0], 20);
+    if (ip.is_v4())
+    {
+        boost::asio::ip::address_v4::bytes_type b = ip.to_v4().to_bytes();
+        memcpy(r.ip, &b[0], b.size());
+    }
+    else
+    {
+        boost::asio::ip::address_v6::bytes_type b = ip.to_v6().to_bytes();
+        memcpy(r.ip, &b[0], b.size());
+    }
+    if (journal) journal->log(r);
+    if (replicator) replicator->log(r);
+}
+
+void Swarm::replay(journal_record const& r)
+{
+    INVARIANT_CHECK;
+
+    peer_id pid;
+    std::copy(r.peer_id, r.peer_id + 20, pid.begin());
+    int slot = find_peer(pid);
+
+    switch (r.type)
+    {
+    case JOURNAL_ADD:
+    case JOURNAL_UPDATE:
+    {
+        // the checkpoint only has a subset of the peers, so an
+        // update may be for a peer we haven't seen yet
+        if (slot == -1)
+        {
+            peer_struct peer;
+            peer.status = r.status & ~(IS_ROUTABLE | IS_ROUTABLE6);
+            peer.last_check_in = r.time;
+            insert_peer(pid, peer, NULL, NULL);
+            break;
+        }
+
+        peer_ref p = peer_at(slot);
+        if (r.time < p.last_check_in) break;
+        p.last_check_in = r.time;
+
+        int old_category = p.category();
+        int category_bits = IS_COMPLETE | IS_DOWNLOADING;
+        if (r.status & HAS_V4) add_address<ipv4_family>(p);
+        if (r.status & HAS_V6) add_address<ipv6_family>(p);
+        p.status = (p.status & ~category_bits) | (r.status & category_bits);
+        if (p.category() != old_category)
+            move_peer(slot, old_category);
+        if (table) table->checked_in(slot);
+        break;
+    }
+    case JOURNAL_ENDPOINT4:
+    case JOURNAL_ENDPOINT6:
+    {
+        if (slot == -1) break;
+        if (r.type == JOURNAL_ENDPOINT4)
+        {
+            add_address<ipv4_family>(peer_at(slot));
+            boost::asio::ip::address_v4::bytes_type b;
+            std::copy(r.ip, r.ip + b.size(), b.begin());
+            add_peer_endpoint<ipv4_family>(pid, slot,
+                boost::asio::ip::address_v4(b), ntohs(r.port));
+        }
+        else
+        {
+            add_address<ipv6_family>(peer_at(slot));
+            boost::asio::ip::address_v6::bytes_type b;
+            std::copy(r.ip, r.ip + b.size(), b.begin());
+            add_peer_endpoint<ipv6_family>(pid, slot,
+                boost::asio::ip::address_v6(b), ntohs(r.port));
+        }
+        break;
+    }
+    case JOURNAL_REMOVE:
+        if (slot != -1 && r.time >= peer_at(slot).last_check_in)
+        {
+            remove_peer_at(slot);
+            maybe_demote();
+        }
+        break;
+    }
+}
+
+void Swarm::renew_peers()
+{
+    int now = time(NULL);
+    if (!table)
     {
-        assert(p.ep_pos >= 0);
-        peer_endpoint_struct& peer_endpoint = this->peer_endpoints[new_category][p.ep_pos];
-        peer_endpoint.ip = ip.to_bytes();
-        peer_endpoint.port = htons(port);
+        for (int n = 0; n < num_small_peers; ++n)
+        {
+            peer_struct& p = small_peers[n].p;
+            p.last_check_in = std::max(p.last_check_in, now);
+        }
+        return;
     }
-    if (p.status & IS_ROUTABLE6)
+    chunked_vector<int, peer_memory>& last_check_in = table->last_check_in;
+    for (size_t i = 0, len = 0; i < last_check_in.size(); i += len)
     {
-        assert(p.ep6_pos >= 0);
-        peer6_endpoint_struct& peer_endpoint = this->peer6_endpoints[new_category][p.ep6_pos];
-        peer_endpoint.ip = ipv6.to_bytes();
-        peer_endpoint.port = htons(port6);
+        int* run = last_check_in.run(i, len);
+        for (size_t j = 0; j < len; ++j)
+            run[j] = std::max(run[j], now);
     }
+    // the next announce groups the endpoints by their new age
+    table->group_by_age(false);
 }
 
+void Swarm::remove_peer(peer_id const& pid)
+{
+    int slot = find_peer(pid);
+    if (slot == -1) return;
+    remove_peer_at(slot);
+    maybe_demote();
+}
 
-void Swarm::remove_peer(peer_map::iterator& peer_iter)
+void Swarm::remove_peer_at(int slot)
 {
     if (verbose_logging)
         logger << "   REMOVE PEER" << std::endl;
     INVARIANT_CHECK;
-    assert(peer_iter != this->peers.end());
 
-    peer_struct& peer = peer_iter->second;
+    if (!table)
+    {
+        assert(slot >= 0 && slot < num_small_peers);
+
+        small_peer& sp = small_peers[slot];
+        uncount_peer(sp.p.status);
+        log_change(JOURNAL_REMOVE, sp.pid, sp.p);
+
+        int last = num_small_peers - 1;
+        if (slot != last)
+        {
+            sp = small_peers[last];
+            sp.p.ep_pos = slot;
+        }
+        --num_small_peers;
+        return;
+    }
+
+    assert(slot >= 0 && slot < int(table->size()));
+    peer_ref peer = table->at(slot);
 
     int category = peer.category();
 
     if (peer.status & IS_ROUTABLE)
-    {
-        assert(this->peer_endpoints[category].size() ==
-               this->peer_endpoint_to_peer[category].size());
-        assert(this->peer_endpoints[category].size() > 0);
-        assert(this->peer_endpoint_to_peer[category][peer.ep_pos] == peer_iter);
+        table->remove_endpoint<ipv4_family>(slot, category);
+    if (peer.status & IS_ROUTABLE6)
+        table->remove_endpoint<ipv6_family>(slot, category);
 
-        remove_endpoint(category, peer.ep_pos);
+    uncount_peer(peer.status);
+    log_change(JOURNAL_REMOVE, table->ids[slot], peer);
+    table->erase(slot);
+}
+
+namespace
+{
+    // handout counters decay a step at a time
+    int const handout_step_seconds = INTERVAL / 16 > 0 ? INTERVAL / 16 : 1;
+
+    uint16 handout_step(time_t now)
+    {
+        return uint16(now / handout_step_seconds);
     }
 
-    if (peer.status & IS_ROUTABLE6)
+    // e^(-k/16) in 16.16 fixed point, for k steps. Counters older
+    // than that are 0
+    struct handout_decay
     {
-        assert(this->peer6_endpoints[category].size() ==
-               this->peer6_endpoint_to_peer[category].size());
-        assert(this->peer6_endpoints[category].size() > 0);
-        assert(this->peer6_endpoint_to_peer[category][peer.ep6_pos] == peer_iter);
+        enum { steps = 256 };
+        handout_decay()
+        {
+            for (int k = 0; k < steps; ++k)
+                factor[k] = uint32(65536 * exp(-k / 16.0));
+        }
+        uint32 factor[steps];
+    };
+    handout_decay const decay;
 
-        remove_endpoint6(category, peer.ep6_pos);
+    // the counter's handouts at step, in 16ths
+    uint32 current_handouts(handout_counter const& c, uint16 step)
+    {
+        uint16 k = step - c.step;
+        if (k >= handout_decay::steps) return 0;
+        return (uint32(c.count) * decay.factor[k]) >> 16;
     }
-    //assert(!contains(this->peer_endpoint_to_peer, peer));
 
-    --peer_counts[category];
-    if (peer.status & HAS_V4) --peer4_counts[category];
-    if (peer.status & HAS_V6) --peer6_counts[category];
-    assert(peer4_counts[category] >= 0);
-    assert(peer6_counts[category] >= 0);
+    // checks and counts the handouts of the endpoints of a category.
+    // Without counters everything is handed out
+    struct handout_budget
+    {
+        handout_budget(chunked_vector<handout_counter, endpoint_memory>* c,
+            time_t now, int max_handouts)
+            : counters(c), step(handout_step(now)),
+              budget(std::max(max_handouts, 0) * 16) {}
+
+        // counts a handout of endpoint i, unless it has had its
+        // budget. Returns true if it may be handed out
+        bool operator()(int i) const
+        {
+            if (counters == NULL) return true;
+            handout_counter& c = (*counters)[i];
+            uint32 n = current_handouts(c, step);
+            if (n >= budget) return false;
+            c.count = uint16(std::min(n + 16, uint32(0xffff)));
+            c.step = step;
+            return true;
+        }
 
-    if (peer.status & IS_COMPLETE)
+        chunked_vector<handout_counter, endpoint_memory>* counters;
+        uint16 step;
+        uint32 budget;
+    };
+
+    // lets through the endpoints budget does, except the requester's
+    // own one at skip
+    struct all_but
     {
-        stats_logger.update_peer_counts(0, -1);
+        all_but(handout_budget const& b, int s) : budget(b), skip(s) {}
+        bool operator()(int i) const { return i != skip && budget(i); }
+        handout_budget const& budget;
+        int skip;
+    };
+}
+
+int Swarm::cap_numwant(int numwant, int category)
+{
+    if (numwant < 0) numwant = numwant_default;
+    if (category == peer_struct::seeding)
+        numwant = numwant * numwant_seed_percent / 100;
+    else if (category == peer_struct::paused)
+        numwant = numwant * numwant_paused_percent / 100;
+
+    // a loaded tracker hands out shorter lists. It's the big swarms
+    // that are cut, the small ones don't have that many peers anyway
+    int cap = numwant_max;
+    if (numwant_shed_cpu < 100 && tracker_cpu > numwant_shed_cpu)
+    {
+        double left = (100 - std::min(tracker_cpu, 100.)) / (100 - numwant_shed_cpu);
+        cap = std::max(std::min(cap, numwant_shed_min), int(cap * left));
     }
-    else
+    return std::max(0, std::min(numwant, cap));
+}
+
+template <class Family>
+int Swarm::num_candidates(int category, requester const& to) const
+{
+    // the requester isn't handed its own endpoint
+    bool const own = to.category != -1
+        && to.self(Family(), to.category) != -1;
+    if (category != peer_struct::active)
     {
-        stats_logger.update_peer_counts(-1, 0);
+        return num_endpoints<Family>(peer_struct::active)
+            - (own && to.category == peer_struct::active);
     }
+    return num_endpoints<Family>(peer_struct::seeding)
+        + num_endpoints<Family>(peer_struct::active)
+        + num_endpoints<Family>(peer_struct::paused) - own;
+}
+
+template <class Family>
+float Swarm::get_handout_ratio(int num_category, int denom_category) const
+{
+    int denom = handout(Family()).counts[denom_category];
+    if (denom == 0) return max_peer_handout_per_interval;
+    return float(max_peer_handout_per_interval)
+        * float(num_endpoints<Family>(num_category))
+        / float(denom);
+}
+
+void Swarm::update_freshness()
+{
+    if (!table) return;
+    bool const grouped = table->endpoints4.ages;
+    bool const fresh = selection_algorithm() == FRESH;
+    if (fresh != grouped) table->group_by_age(fresh);
+}
+
+int Swarm::age_bucket(int age)
+{
+    int const steps = age / age_group_seconds;
+    if (steps < 1) return 0;
+    if (steps < 2) return 1;
+    if (steps < 4) return 2;
+    if (steps < 8) return 3;
+    return 4;
+}
 
-    this->peers.erase(peer_iter);
+template <class Family>
+void Swarm::count_handout_age(int category, int index)
+{
+    int slot = table->endpoints(Family()).peer[category][index];
+    ++handout_ages[age_bucket(last_announce - table->last_check_in[slot])];
+}
+
+void Swarm::update_locality()
+{
+    if (!table) return;
+    bool const grouped = table->endpoints4.groups;
+    int const threshold = grouped ? locality_min_peers / 2 : locality_min_peers;
+    bool const group = locality_share > 0 && int(table->size()) >= threshold;
+    if (group == grouped) return;
+    table->endpoints4.group_by_network(group);
+    table->endpoints6.group_by_network(group);
 }
 
-float Swarm::get_handout_ratio(int num_category, int denom_category, bool ipv6) const
+Swarm::requester Swarm::make_requester(int slot) const
 {
-    if (ipv6)
+    requester ret;
+    if (slot == -1) return ret;
+    if (!table)
     {
-        if (peer6_counts[denom_category] == 0) return max_peer_handout_per_interval;
-        return float(max_peer_handout_per_interval)
-            * float(peer6_endpoints[num_category].size())
-            / float(peer6_counts[denom_category]);
+        peer_struct const& p = small_peers[slot].p;
+        ret.category = p.category();
+        if ((p.status & IS_ROUTABLE) == 0) return ret;
+        // the lists of a small swarm are in the order of small_peers
+        ret.self4 = 0;
+        for (int i = 0; i < slot; ++i)
+        {
+            peer_struct const& q = small_peers[i].p;
+            if ((q.status & IS_ROUTABLE) && q.category() == ret.category)
+                ++ret.self4;
+        }
+        return ret;
     }
-    else
+    ret.category = peer_struct::category_of(table->status[slot]);
+    ret.self4 = table->ep_pos[slot];
+    ret.self6 = table->ep6_pos[slot];
+    ret.has_cursor = true;
+    ret.cursor = table->cursor[slot];
+    return ret;
+}
+
+template <class Family>
+int Swarm::get_local_peers(peer_list& peers, int count, int category,
+    uint64 network, requester const& to)
+{
+    // the categories get_peers() hands out to each category
+    static int const to_active[] = {
+        peer_struct::seeding, peer_struct::active, peer_struct::paused };
+    static int const to_others[] = { peer_struct::active };
+    int const* categories = category == peer_struct::active ? to_active : to_others;
+    int const num_categories = category == peer_struct::active ? 3 : 1;
+
+    endpoint_list<Family>& list = table->endpoints(Family());
+    int ret = 0;
+    for (int i = 0; i < num_categories && ret < count; ++i)
     {
-        if (peer4_counts[denom_category] == 0) return max_peer_handout_per_interval;
-        return float(max_peer_handout_per_interval)
-            * float(peer_endpoints[num_category].size())
-            / float(peer4_counts[denom_category]);
+        int c = categories[i];
+        handout_budget budget(budgeted(category, c) ? &list.handouts[c] : NULL,
+            last_announce, max_peer_handout_per_interval);
+        ret += list.groups[c].hand_out(network, count - ret,
+            list.endpoints[c], peers, all_but(budget, to.self(Family(), c)));
     }
+    Swarm::peers_delivered += ret;
+    num_local_peers_delivered += ret;
+    return ret;
 }
 
-void Swarm::get_peers(std::string& peers, int count, int category, bool ipv6)
+template <class Family>
+void Swarm::get_peers(peer_list& peers, int count, int category,
+    typename Family::address_type const& ip, requester& to)
 {
+    // the share from the peer's network comes first. The rest is
+    // picked from the whole swarm, and may include some of them
+    // again, which costs less than looking for them
+    if (table && table->endpoints(Family()).groups)
+    {
+        count -= get_local_peers<Family>(peers,
+            std::min(count, (count * locality_share + 50) / 100), category,
+            network_map::network(ip.to_bytes()), to);
+    }
+
+    // large swarms count the handouts of each endpoint against
+    // max_peer_handout_per_interval, and skip the endpoints that have
+    // had theirs (see budgeted()). Small swarms don't count them, the
+    // number handed out is capped by the ratio of the categories
     switch (category)
     {
     default:
@@ -726,24 +1722,32 @@ void Swarm::get_peers(std::string& peers, int count, int category, bool ipv6)
         // on the downloaders/seeders ratio
         // to avoid handing out seeds too many times to downloaders
         // and to avoid handing out downloaders to too many seeds
-        float max_peers = get_handout_ratio(peer_struct::seeding, peer_struct::active, ipv6);
-        count -= get_peers_sequential(peers, std::min(float(count), max_peers), peer_struct::seeding, ipv6);
+        float max_peers = table ? count
+            : get_handout_ratio<Family>(peer_struct::seeding, peer_struct::active);
+        count -= select_peers<Family>(peers, std::min(float(count), max_peers),
+            peer_struct::seeding, true, to);
         if (count)
-           count -= get_peers_sequential(peers, count, peer_struct::active, ipv6);
+           count -= select_peers<Family>(peers, count, peer_struct::active,
+               false, to);
         if (count)
-           count -= get_peers_sequential(peers, count, peer_struct::paused, ipv6);
+           count -= select_peers<Family>(peers, count, peer_struct::paused,
+               false, to);
         break;
     }
     case peer_struct::paused:
     {
-        float max_peers = get_handout_ratio(peer_struct::active, peer_struct::paused, ipv6);
-        count -= get_peers_sequential(peers, std::min(float(count), max_peers), peer_struct::active, ipv6);
+        float max_peers = table ? count
+            : get_handout_ratio<Family>(peer_struct::active, peer_struct::paused);
+        count -= select_peers<Family>(peers, std::min(float(count), max_peers),
+            peer_struct::active, true, to);
         break;
     }
     case peer_struct::seeding:
     {
-        float max_peers = get_handout_ratio(peer_struct::active, peer_struct::seeding, ipv6);
-        count -= get_peers_sequential(peers, std::min(float(count), max_peers), peer_struct::active, ipv6);
+        float max_peers = table ? count
+            : get_handout_ratio<Family>(peer_struct::active, peer_struct::seeding);
+        count -= select_peers<Family>(peers, std::min(float(count), max_peers),
+            peer_struct::active, true, to);
         break;
     }
     }
@@ -751,28 +1755,45 @@ void Swarm::get_peers(std::string& peers, int count, int category, bool ipv6)
 
 
 Swarm::peer_selection_algorithm_t Swarm::peer_selection_algorithm = PRUNED;
+// indexed by peer_selection_algorithm_t
 Swarm::peer_selection_function_t Swarm::peer_selection_funcs[] = {
-    { RANDOM, "random" },
-    { PRUNED, "pruned" },
+    { RANDOM, "random",
+      &Swarm::get_peers_random<ipv4_family>, &Swarm::get_peers_random<ipv6_family> },
+    { PRUNED, "pruned",
+      &Swarm::get_peers_sequential<ipv4_family>, &Swarm::get_peers_sequential<ipv6_family> },
+    { FRESH, "fresh",
+      &Swarm::get_peers_fresh<ipv4_family>, &Swarm::get_peers_fresh<ipv6_family> },
 };
 
 #define NELEM(array) (sizeof(array) / sizeof(array[0]))
 
-void Swarm::set_peer_selection_algorithm(
-            enum peer_selection_algorithm_t *p,
-            std::vector<std::string> & args)
+int Swarm::find_peer_selection_algorithm(const std::string& name)
 {
-    std::string &name = args[0];
-
     for (int i = 0; i < (int)NELEM(peer_selection_funcs); i++)
     {
-        if (name.compare(peer_selection_funcs[i].name) == 0)
-        {
-            peer_selection_algorithm = peer_selection_funcs[i].algo;
-            return;
-        }
+        if (name == peer_selection_funcs[i].name)
+            return i;
     }
-    throw std::runtime_error("not a valid peer selection algorithm");
+    return -1;
+}
+
+Swarm::peer_selection_algorithm_t Swarm::selection_algorithm() const
+{
+    int algo = (flags & SELECTION_MASK) >> SELECTION_SHIFT;
+    if (algo == 0) return peer_selection_algorithm;
+    return peer_selection_algorithm_t(algo - 1);
+}
+
+void Swarm::set_peer_selection_algorithm(
+            enum peer_selection_algorithm_t *p,
+            std::vector<std::string> & args)
+{
+    if (args.size() != 1)
+        throw std::runtime_error("expected one peer selection algorithm");
+    int i = find_peer_selection_algorithm(args[0]);
+    if (i == -1)
+        throw std::runtime_error("not a valid peer selection algorithm");
+    *p = peer_selection_funcs[i].algo;
 }
 
 std::string Swarm::get_peer_selection_algorithm(
@@ -786,11 +1807,20 @@ std::string Swarm::get_peer_selection_algorithm(
     throw std::runtime_error("not a valid peer selection algorithm");
 }
 
-int Swarm::get_peers_sequential(std::string& peers, float count, int category, bool ipv6)
+template <class Family>
+int Swarm::select_peers(peer_list& peers, float count, int category,
+    bool budgeted, requester& to)
+{
+    peer_selector select = selector(
+        peer_selection_funcs[selection_algorithm()], Family());
+    return (this->*select)(peers, count, category, budgeted && table, to);
+}
+
+template <class Family>
+int Swarm::get_peers_sequential(peer_list& peers, float count, int category,
+    bool budgeted, requester& to)
 {
-    int num_peers;
-    if (ipv6) num_peers = this->peer6_endpoints[category].size();
-    else num_peers = this->peer_endpoints[category].size();
+    int num_peers = num_endpoints<Family>(category);
 /*
     std::cout << "get_peers_sequential: " << count
         << " next: " << next_handout[category]
@@ -802,30 +1832,34 @@ int Swarm::get_peers_sequential(std::string& peers, float count, int category, b
 */
     if (num_peers == 0) return 0;
     if (count > num_peers) count = num_peers;
-    int hand_out;
-    if (ipv6)
-    {
-        peer6_list_cursor[category] += count;
-        if (peer6_list_cursor[category] < next_handout6[category])
-            return 0;
-        hand_out = ceil(peer6_list_cursor[category]) - next_handout6[category];
-        if (next_handout6[category] >= num_peers)
-        {
-            peer6_list_cursor[category] -= num_peers;
-            next_handout6[category] -= num_peers;
-        }
+
+    if (to.has_cursor)
+    {
+        // the list continues where the peer's last one ended. Table
+        // swarms don't hand out fractions
+        int hand_out = int(count);
+        if (hand_out == 0) return 0;
+        int start_peer = to.cursor % uint32(num_peers);
+        int walked;
+        int ret = budgeted
+            ? get_budgeted_peers_at<Family>(peers, start_peer, hand_out,
+                category, to, walked)
+            : get_peers_at<Family>(peers, start_peer, hand_out, category,
+                to, walked);
+        to.walked = std::max(to.walked, walked);
+        return ret;
     }
-    else
+
+    float& list_cursor = handout(Family()).list_cursor[category];
+    int& next_handout = handout(Family()).next_handout[category];
+    list_cursor += count;
+    if (list_cursor < next_handout)
+        return 0;
+    int hand_out = ceil(list_cursor) - next_handout;
+    while (next_handout >= num_peers)
     {
-        peer4_list_cursor[category] += count;
-        if (peer4_list_cursor[category] < next_handout4[category])
-            return 0;
-        hand_out = ceil(peer4_list_cursor[category]) - next_handout4[category];
-        if (next_handout4[category] >= num_peers)
-        {
-            peer4_list_cursor[category] -= num_peers;
-            next_handout4[category] -= num_peers;
-        }
+        list_cursor -= num_peers;
+        next_handout -= num_peers;
     }
 
 /*
@@ -835,89 +1869,381 @@ int Swarm::get_peers_sequential(std::string& peers, float count, int category, b
         << std::endl;
 */
 
-    int start_peer;
-    if (ipv6) start_peer = next_handout6[category] % num_peers;
-    else start_peer = next_handout4[category] % num_peers;
-    int ret = get_peers_at(peers, start_peer, hand_out, category, ipv6);
+    int start_peer = next_handout % num_peers;
+    // the endpoints skipped over don't count as handed out, the
+    // cursor moves past them
+    int walked;
+    int ret = budgeted
+        ? get_budgeted_peers_at<Family>(peers, start_peer, hand_out,
+            category, to, walked)
+        : get_peers_at<Family>(peers, start_peer, hand_out, category,
+            to, walked);
+    list_cursor += walked - hand_out;
+    next_handout += walked;
+    assert(list_cursor <= next_handout || list_cursor > num_peers - 1);
+    return ret;
+}
 
-    if (ipv6)
+template <class Family>
+int Swarm::get_budgeted_peers_at(peer_list& peers, int start_peer, int count,
+    int category, requester const& to, int& scanned)
+{
+    int const skip = to.self(Family(), category);
+    typedef typename Family::endpoint_type endpoint;
+    endpoint_list<Family>& list = table->endpoints(Family());
+    chunked_vector<endpoint, endpoint_memory> const& endpoints = list.endpoints[category];
+    int const num_peers = endpoints.size();
+    int const max_scan = std::min(num_peers, count * 4 + 16);
+    handout_budget budget(&list.handouts[category], last_announce,
+        max_peer_handout_per_interval);
+
+    scanned = 0;
+    if (list.exhausted[category] == budget.step) return 0;
+    int ret = 0;
+    int i = start_peer;
+    for (; scanned < max_scan && ret < count; ++scanned)
     {
-       next_handout6[category] += hand_out;
-       assert(peer6_list_cursor[category] <= next_handout6[category]
-          || peer6_list_cursor[category] > num_peers - 1);
+        // consecutive endpoints are merged into one run
+        if (i != skip && budget(i))
+        {
+            peers.append((char const*)&endpoints[i], sizeof(endpoint));
+            if (to.sample_ages) count_handout_age<Family>(category, i);
+            ++ret;
+        }
+        if (++i == num_peers) i = 0;
     }
-    else
+    if (ret == 0 && scanned == num_peers)
+        list.exhausted[category] = budget.step;
+    Swarm::peers_delivered += ret;
+    return ret;
+}
+
+namespace
+{
+    // appends up to count endpoints starting at start_peer, and wraps
+    // around to the first one if it reaches the end. The one at skip
+    // is left out. walked is set to the number of positions passed
+    template <class Endpoint>
+    int append_endpoints(peer_list& peers,
+        chunked_vector<Endpoint, endpoint_memory> const& endpoints,
+        int start_peer, int count, int skip, int& walked)
     {
-       next_handout4[category] += hand_out;
-       assert(peer4_list_cursor[category] <= next_handout4[category]
-          || peer4_list_cursor[category] > num_peers - 1);
+        int num_peers = endpoints.size();
+        int ret = 0;
+        int i = start_peer;
+        walked = 0;
+        while (ret < count && walked < num_peers)
+        {
+            if (i == num_peers) i = 0;
+            if (i == skip)
+            {
+                ++i;
+                ++walked;
+                continue;
+            }
+            size_t len;
+            // the endpoints are packed compact peer records, the
+            // run is handed out as it is
+            char const* run = (char const*)endpoints.run(i, len);
+            int n = std::min(int(len), count - ret);
+            // don't wrap around to where we started
+            n = std::min(n, num_peers - walked);
+            if (i < skip) n = std::min(n, skip - i);
+            peers.append(run, n * sizeof(Endpoint));
+            ret += n;
+            i += n;
+            walked += n;
+        }
+        return ret;
     }
-    return ret;
 }
 
-int Swarm::get_peers_at(std::string& peers, int start_peer, int count, int category, bool ipv6)
+int Swarm::get_small_peers_at(peer_list& peers, int start_peer, int count,
+    int category, int skip, int& walked)
 {
-    assert(count >= 0);
-    int ret = 0;
-    int num_peers;
-    if (ipv6) num_peers = this->peer6_endpoints[category].size();
-    else num_peers = this->peer_endpoints[category].size();
+    // the endpoints of a small swarm are stored with its peers,
+    // collect the ones in this category
+    peer_endpoint_struct const* small_endpoints[SMALL_SWARM_PEERS];
+    int num_peers = 0;
+    for (int n = 0; n < num_small_peers; ++n)
+    {
+        small_peer const& sp = small_peers[n];
+        if ((sp.p.status & IS_ROUTABLE) && sp.p.category() == category)
+            small_endpoints[num_peers++] = &sp.ep;
+    }
+    walked = 0;
     if (num_peers == 0) return 0;
 
-    // TODO: this cast assumes that the peer_endpoint_struct
-    // is packed.
-    char* start_pos;
-    if (ipv6) start_pos = (char*)&this->peer6_endpoints[category][start_peer];
-    else start_pos = (char*)&this->peer_endpoints[category][start_peer];
-
-    int count_avail = min<int>(count, num_peers - start_peer);
+    // wrap around and take from the beginning if necessary
+    int ret = 0;
+    for (int i = start_peer % num_peers; ret < count && walked < num_peers;
+        ++walked)
+    {
+        if (i != skip)
+        {
+            peers.append((char const*)small_endpoints[i],
+                sizeof(peer_endpoint_struct));
+            ++ret;
+        }
+        if (++i == num_peers) i = 0;
+    }
+    Swarm::peers_delivered += ret;
+    return ret;
+}
 
-    Swarm::peers_delivered += count_avail;
+template <class Family>
+int Swarm::get_peers_at(peer_list& peers, int start_peer, int count,
+    int category, requester const& to, int& walked)
+{
+    assert(count >= 0);
+    walked = 0;
+    int const skip = to.self(Family(), category);
 
-    int len;
-    if (ipv6) len = count_avail * sizeof(peer6_endpoint_struct);
-    else len = count_avail * sizeof(peer_endpoint_struct);
-    peers.append(start_pos, len);
-    ret += count_avail;
+    if (!table)
+    {
+        if (!Family::in_small_swarms) return 0;
+        return get_small_peers_at(peers, start_peer, count, category,
+            skip, walked);
+    }
 
-    // wrap around and copy from the beginning if necessary
-    if (count_avail < count)
+    int num_peers = num_endpoints<Family>(category);
+    if (num_peers == 0) return 0;
+    int ret = append_endpoints(peers,
+        table->endpoints(Family()).endpoints[category], start_peer, count,
+        skip, walked);
+    if (to.sample_ages)
     {
-        if (ipv6) start_pos = (char*)&this->peer6_endpoints[category][0];
-        else start_pos = (char*)&this->peer_endpoints[category][0];
-        count_avail = min<int>(count - count_avail, start_peer);
-        if (ipv6) len = count_avail * sizeof(peer6_endpoint_struct);
-        else len = count_avail * sizeof(peer_endpoint_struct);
-        peers.append(start_pos, len);
-        ret += count_avail;
+        for (int i = 0, j = start_peer; i < walked; ++i)
+        {
+            if (j != skip) count_handout_age<Family>(category, j);
+            if (++j == num_peers) j = 0;
+        }
     }
+    Swarm::peers_delivered += ret;
     return ret;
 }
 
-int Swarm::get_peers_random(std::string& peers, int count, int category, bool ipv6)
+namespace
 {
-    INVARIANT_CHECK;
+    // the index of the lowest set bit of a non-zero word
+    inline int lowest_bit(uint64 w)
+    {
+#ifdef __GNUC__
+        return __builtin_ctzll(w);
+#else
+        int b = 0;
+        if ((w & 0xffffffff) == 0) { w >>= 32; b += 32; }
+        if ((w & 0xffff) == 0) { w >>= 16; b += 16; }
+        if ((w & 0xff) == 0) { w >>= 8; b += 8; }
+        if ((w & 0xf) == 0) { w >>= 4; b += 4; }
+        if ((w & 0x3) == 0) { w >>= 2; b += 2; }
+        if ((w & 0x1) == 0) ++b;
+        return b;
+#endif
+    }
+
+    // picks n distinct indices below num_peers at random. It's
+    // Floyd's algorithm, which draws only n numbers, so a large swarm
+    // costs no more than a small one
+    void sample_indices(int num_peers, int n, std::vector<int>& picks)
+    {
+        assert(n <= num_peers);
+        picks.clear();
+        if (size_t(n) * 64 >= size_t(num_peers))
+        {
+            // the indices drawn are marked in a bitmap no bigger than
+            // n words. Half of them may be drawn already, so there's no
+            // branch on it
+            static std::vector<uint64> drawn;
+            drawn.assign((num_peers + 63) / 64, 0);
+            for (uint32 j = num_peers - n; j < uint32(num_peers); ++j)
+            {
+                uint32 t = fast_rand(j + 1);
+                // j wasn't a candidate before, it can't be drawn yet
+                uint32 hit = uint32(drawn[t >> 6] >> (t & 63)) & 1;
+                t += (j - t) & (0u - hit);
+                drawn[t >> 6] |= uint64(1) << (t & 63);
+            }
+            for (size_t w = 0; w < drawn.size(); ++w)
+            {
+                for (uint64 bits = drawn[w]; bits; bits &= bits - 1)
+                    picks.push_back(int(w * 64) + lowest_bit(bits));
+            }
+            return;
+        }
+
+        // few out of many, the ones drawn are kept in an open
+        // addressed set at most half full
+        static std::vector<int> drawn;
+        size_t mask = 15;
+        while (mask < size_t(n) * 2) mask = mask * 2 + 1;
+        drawn.assign(mask + 1, -1);
+        for (int j = num_peers - n; j < num_peers; ++j)
+        {
+            int t = fast_rand(j + 1);
+            size_t h = (uint32(t) * 2654435761u) & mask;
+            while (drawn[h] != -1 && drawn[h] != t) h = (h + 1) & mask;
+            if (drawn[h] == t)
+            {
+                t = j;
+                h = (uint32(t) * 2654435761u) & mask;
+                while (drawn[h] != -1) h = (h + 1) & mask;
+            }
+            drawn[h] = t;
+            picks.push_back(t);
+        }
+    }
+}
+
+template <class Family>
+int Swarm::get_peers_random(peer_list& peers, float count, int category,
+    bool budgeted, requester& to)
+{
+    int num_peers = num_endpoints<Family>(category);
+    if (num_peers == 0 || count <= 0) return 0;
+    if (budgeted && table->endpoints(Family()).exhausted[category]
+        == handout_step(last_announce))
+        return 0;
+
+    // the fraction of a peer is handed out with that probability, so
+    // the ratios of get_peers() hold on average
+    int n = int(count);
+    if (fast_rand_unit() < count - n) ++n;
+    // the requester's own endpoint isn't a candidate, the picks past
+    // it are moved up by one
+    int const skip = to.self(Family(), category);
+    int const num_candidates = num_peers - (skip != -1);
+    n = std::min(n, num_candidates);
+    if (n <= 0) return 0;
+
+    static std::vector<int> picks;
+    sample_indices(num_candidates, n, picks);
+    if (skip != -1)
+    {
+        for (int i = 0; i < n; ++i)
+            picks[i] += picks[i] >= skip;
+    }
 
-    int num_peers = this->peer_endpoints[category].size();
+    if (!table)
+    {
+        if (!Family::in_small_swarms) return 0;
+        peer_endpoint_struct const* small_endpoints[SMALL_SWARM_PEERS];
+        int num_small = 0;
+        for (int i = 0; i < num_small_peers; ++i)
+        {
+            small_peer const& sp = small_peers[i];
+            if ((sp.p.status & IS_ROUTABLE) && sp.p.category() == category)
+                small_endpoints[num_small++] = &sp.ep;
+        }
+        assert(num_small == num_peers);
+        for (int i = 0; i < n; ++i)
+        {
+            peers.append((char const*)small_endpoints[picks[i]],
+                sizeof(peer_endpoint_struct));
+        }
+    }
+    else
+    {
+        // the picks that have had their budget are dropped, there
+        // are no more candidates that are as cheap
+        typedef typename Family::endpoint_type endpoint;
+        endpoint_list<Family>& list = table->endpoints(Family());
+        chunked_vector<endpoint, endpoint_memory> const& endpoints
+            = list.endpoints[category];
+        handout_budget budget(budgeted ? &list.handouts[category] : NULL,
+            last_announce, max_peer_handout_per_interval);
+        int handed_out = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            if (!budget(picks[i])) continue;
+            peers.append((char const*)&endpoints[picks[i]], sizeof(endpoint));
+            if (to.sample_ages) count_handout_age<Family>(category, picks[i]);
+            ++handed_out;
+        }
+        n = handed_out;
+    }
+    Swarm::peers_delivered += n;
+    return n;
+}
 
-    // start at a random peer
-    int start_peer = (int)((rand() / (RAND_MAX + 1.0)) * num_peers);
-    assert((start_peer < num_peers) ||
-           ((start_peer == 0) && (num_peers == 0)));
+template <class Family>
+int Swarm::get_peers_fresh(peer_list& peers, float count, int category,
+    bool budgeted, requester& to)
+{
+    int num_peers = num_endpoints<Family>(category);
+    if (num_peers == 0 || count <= 0) return 0;
+    int n = int(count);
+    if (fast_rand_unit() < count - n) ++n;
+    if (n == 0) return 0;
+    int const skip = to.self(Family(), category);
+
+    if (!table)
+    {
+        if (!Family::in_small_swarms) return 0;
+        // there are few enough to sort them, newest first
+        small_peer const* small[SMALL_SWARM_PEERS];
+        int num_small = 0;
+        int index = 0;
+        for (int i = 0; i < num_small_peers; ++i)
+        {
+            small_peer const& sp = small_peers[i];
+            if (!(sp.p.status & IS_ROUTABLE) || sp.p.category() != category)
+                continue;
+            if (index++ != skip) small[num_small++] = &sp;
+        }
+        for (int i = 1; i < num_small; ++i)
+        {
+            for (int j = i; j > 0 && small[j]->p.last_check_in
+                > small[j - 1]->p.last_check_in; --j)
+                std::swap(small[j], small[j - 1]);
+        }
+        n = std::min(n, num_small);
+        for (int i = 0; i < n; ++i)
+        {
+            peers.append((char const*)&small[i]->ep,
+                sizeof(peer_endpoint_struct));
+        }
+        Swarm::peers_delivered += n;
+        return n;
+    }
 
-    return get_peers_at(peers, start_peer, count, category, ipv6);
+    // the endpoints are grouped by age from the next announce on
+    endpoint_list<Family>& list = table->endpoints(Family());
+    if (!list.ages)
+        return get_peers_sequential<Family>(peers, count, category, budgeted, to);
+
+    // the groups are walked newest first, each one rotates through
+    // its endpoints. Peers time out after INTERVAL + 10%, older
+    // groups than two intervals aren't looked for. A replica's clock
+    // may be behind its master's, the walk starts a group ahead
+    handout_budget budget(budgeted ? &list.handouts[category] : NULL,
+        last_announce, max_peer_handout_per_interval);
+    uint64 const newest = age_group(last_announce) + 1;
+    int const num_groups = 2 * INTERVAL / age_group_seconds + 2;
+    int ret = 0;
+    for (int g = 0; g < num_groups && ret < n; ++g)
+    {
+        int got = list.ages[category].hand_out(newest - g, n - ret,
+            list.endpoints[category], peers, all_but(budget, skip));
+        if (to.sample_ages)
+            handout_ages[age_bucket(std::max(g - 1, 0) * age_group_seconds)] += got;
+        ret += got;
+    }
+    Swarm::peers_delivered += ret;
+    return ret;
 }
 
 // incompletes only
 size_t Swarm::get_num_peers() const
 {
     return peer_counts[peer_struct::active]
-        + peer_counts[peer_struct::paused];
+        + peer_counts[peer_struct::paused]
+        + untracked_downloaders();
 }
 
 size_t Swarm::get_num_downloaders() const
 {
-    return peer_counts[peer_struct::active];
+    return peer_counts[peer_struct::active] + untracked_downloaders();
 }
 
 size_t Swarm::get_num_paused() const
@@ -927,7 +2253,7 @@ size_t Swarm::get_num_paused() const
 
 size_t Swarm::get_num_seeds() const
 {
-    return peer_counts[peer_struct::seeding];
+    return peer_counts[peer_struct::seeding] + untracked_seeds();
 }
 
 size_t Swarm::get_num_completes() const
@@ -952,9 +2278,18 @@ void Swarm::print_peers() const
 
     for (int c = 0; c < peer_struct::num_categories; ++c)
     {
-       for (unsigned int i = 0; i < this->peer_endpoints[c].size(); i++)
+       std::vector<peer_endpoint_struct> endpoints;
+       for (size_t i = 0; table && i < table->endpoints4.endpoints[c].size(); ++i)
+          endpoints.push_back(table->endpoints4.endpoints[c][i]);
+       for (int n = 0; n < num_small_peers; ++n)
+       {
+          small_peer const& sp = small_peers[n];
+          if ((sp.p.status & IS_ROUTABLE) && sp.p.category() == c)
+             endpoints.push_back(sp.ep);
+       }
+       for (unsigned int i = 0; i < endpoints.size(); i++)
        {
-          peer_endpoint_struct const& peer_endpoint = this->peer_endpoints[c][i];
+          peer_endpoint_struct const& peer_endpoint = endpoints[i];
           logger
              << i << ": "
              << (int)peer_endpoint.ip[0] << "."
@@ -971,43 +2306,73 @@ void Swarm::timeout_peers()
 {
     INVARIANT_CHECK;
 
+    time_t now = time(NULL);
+    next_timeout = now + INTERVAL/2;
+    rotate_untracked(now);
+
+    // the primary sends the removals
+    if (replica) return;
+
+    if (!table)
+    {
+        // removing a peer moves the last one into its place, which
+        // has been looked at already
+        for (int n = num_small_peers - 1; n >= 0; --n)
+        {
+            if (now - small_peers[n].p.last_check_in > (INTERVAL + INTERVAL/10))
+                remove_peer_at(n);
+        }
+        return;
+    }
+
     StopWatch sw;
 
-    int out = 0;
-    time_t now = time(NULL);
-    if (this->peers.size() > 100)
+    if (table->size() > 100)
     {
-        logger << "starting timeout of " << this->peers.size() << " peers" << std::endl;
+        logger << "starting timeout of " << table->size() << " peers" << std::endl;
     }
 
-    for(peer_map::iterator iter = this->peers.begin();
-        !this->peers.empty() && iter != this->peers.end();)
+    // collect the expired slots a chunk of the last_check_in column
+    // at a time, with a branch free filter
+    int const cutoff = now - (INTERVAL + INTERVAL/10);
+    std::vector<int> expired;
+    chunked_vector<int, peer_memory> const& last_check_in = table->last_check_in;
+    for (size_t i = 0, len = 0; i < last_check_in.size(); i += len)
     {
-        peer_map::iterator cur = iter;
-        iter++;
-        peer_struct& peer = cur->second;
-        if (now - peer.last_check_in > (INTERVAL + INTERVAL/10))
+        int const* run = last_check_in.run(i, len);
+        int found[chunked_vector<int, peer_memory>::chunk_size];
+        int num_found = 0;
+        for (size_t j = 0; j < len; ++j)
         {
-            //logger << "timing out peer '" << peer_id << "'" << std::endl;
-            //logger << this->peers.size() << " before remove" << std::endl;
-            remove_peer(cur);
-            //logger << this->peers.size() << " after remove" << std::endl;
-            out++;
+            found[num_found] = int(i + j);
+            num_found += run[j] < cutoff;
         }
+        expired.insert(expired.end(), found, found + num_found);
+    }
+
+    // removing a peer moves the last one into its slot, so go from
+    // the back. The peers moved have been looked at already
+    for (std::vector<int>::reverse_iterator i = expired.rbegin();
+        i != expired.rend(); ++i)
+    {
+        remove_peer_at(*i);
     }
+    int out = expired.size();
 
     if (sw.get_msec() > 10.0)
     {
         std::string dstr = string_format("%.0f ms", sw.get_msec());
         if (out > 0)
         {
-            logger << "timed out " << out << " peers in " << dstr << ", " << this->peers.size() << " total peers remaining" << std::endl;
+            logger << "timed out " << out << " peers in " << dstr << ", " << table->size() << " total peers remaining" << std::endl;
         }
         else
         {
-            logger << "scanned " << this->peers.size() << " peers in " << dstr << std::endl;
+            logger << "scanned " << table->size() << " peers in " << dstr << std::endl;
         }
     }
+
+    maybe_demote();
 }
 
 std::string Swarm::class_stats()
@@ -1016,6 +2381,44 @@ std::string Swarm::class_stats()
 
     st << "Swarm peers delivered: " << peers_delivered << std::endl;
     st << "Swarm peers created: " << num_peers_created << std::endl;
+    st << "Swarms recycled: " << num_swarms_recycled << std::endl;
+    st << "Swarms reused: " << num_swarms_reused << std::endl;
+    st << "Swarms pooled: " << pool.size() << std::endl;
+    st << "Swarms promoted: " << num_swarms_promoted << std::endl;
+    st << "Swarms demoted: " << num_swarms_demoted << std::endl;
+    st << "Swarms compacted: " << num_swarms_compacted << std::endl;
+    st << "Swarm bytes compacted: " << num_bytes_compacted << std::endl;
+
+    // what capping the swarms at max_peers saves, and what it costs
+    // (the map node, the columns and the endpoint)
+    size_t peer_bytes = sizeof(peer_map::value_type) + 2 * sizeof(void*)
+        + sizeof(peer_id) + 3 * sizeof(int) + 1
+        + sizeof(peer_endpoint_struct) + sizeof(int);
+    size_t sketch_bytes = sizeof(untracked_peers)
+        + 4 * (size_t(1) << HyperLogLog::default_precision);
+    st << "Swarm peer cap: " << max_peers << std::endl;
+    st << "Swarms at peer cap: " << num_capped_swarms << std::endl;
+    st << "Swarm peers replaced: " << num_peers_replaced << std::endl;
+    st << "Swarm announces untracked: " << num_announces_untracked << std::endl;
+    st << "Swarm peers untracked (estimate): " << untracked_estimate << std::endl;
+    st << "Swarm untracked peer bytes saved: " << untracked_estimate * peer_bytes << std::endl;
+    st << "Swarm untracked estimate bytes: " << num_capped_swarms * sketch_bytes << std::endl;
+    st << "Swarm untracked estimate error: "
+        << string_format("%.1f%%", HyperLogLog::error() * 100) << std::endl;
+    st << "Swarm peers delivered by locality: " << num_local_peers_delivered << std::endl;
+    // of a sample of the announces to large swarms
+    static char const* const age_names[num_age_buckets] = {
+        "< 1/8 interval", "< 1/4 interval", "< 1/2 interval",
+        "< 1 interval", ">= 1 interval" };
+    for (int i = 0; i < num_age_buckets; ++i)
+    {
+        st << "Swarm peers sampled by age " << age_names[i] << ": "
+            << handout_ages[i] << std::endl;
+    }
+    st << "AS table prefixes: " << network_map::size() << std::endl;
+    st << "Swarm numwant cap: " << cap_numwant(numwant_max, peer_struct::active) << std::endl;
+    st << "Swarm announces numwant capped: " << num_numwant_capped << std::endl;
+    st << "Swarm numwant bytes saved: " << numwant_bytes_saved << std::endl;
     return st.str();
 }
 
@@ -1052,17 +2455,89 @@ int Swarm::flag_from_name(const std::string &name)
     return -1;
 }
 
+namespace
+{
+    // prints how many endpoints of a category have had 0, 1, 2-3,
+    // 4-7... handouts
+    void print_handout_counters(std::ostream& os, char const* family,
+        char const* category,
+        chunked_vector<handout_counter, endpoint_memory> const& counters,
+        uint16 step, uint32 budget)
+    {
+        if (counters.empty()) return;
+        int buckets[17] = { 0 };
+        int at_budget = 0;
+        uint32 max_handouts = 0;
+        uint64 total = 0;
+        for (size_t i = 0; i < counters.size(); ++i)
+        {
+            uint32 n = current_handouts(counters[i], step);
+            total += n;
+            max_handouts = std::max(max_handouts, n);
+            if (n >= budget) ++at_budget;
+            int b = 0;
+            for (uint32 whole = n / 16; whole; whole >>= 1) ++b;
+            ++buckets[b];
+        }
+        os << family << " " << category << ": " << counters.size()
+            << " endpoints, " << at_budget << " at budget, mean "
+            << string_format("%.1f", total / 16.0 / counters.size())
+            << ", max " << string_format("%.1f", max_handouts / 16.0)
+            << std::endl;
+        for (int b = 0; b < 17; ++b)
+        {
+            if (buckets[b] == 0) continue;
+            int low = b == 0 ? 0 : 1 << (b - 1);
+            int high = b == 0 ? 0 : (1 << b) - 1;
+            os << "  " << low;
+            if (high > low) os << "-" << high;
+            os << ": " << buckets[b] << std::endl;
+        }
+    }
+}
+
+std::string Swarm::get_handout_distribution() const
+{
+    std::stringstream os;
+    os << "Handouts per interval budget: " << max_peer_handout_per_interval << std::endl;
+    if (!table)
+    {
+        os << "Small swarm, handouts aren't counted" << std::endl;
+        return os.str();
+    }
+
+    static char const* category_names[] = { "seeding", "active", "paused" };
+    handout_budget budget(NULL, time(NULL), max_peer_handout_per_interval);
+    for (int c = 0; c < peer_struct::num_categories; ++c)
+    {
+        print_handout_counters(os, "v4", category_names[c],
+            table->endpoints4.handouts[c], budget.step, budget.budget);
+    }
+    for (int c = 0; c < peer_struct::num_categories; ++c)
+    {
+        print_handout_counters(os, "v6", category_names[c],
+            table->endpoints6.handouts[c], budget.step, budget.budget);
+    }
+    return os.str();
+}
+
 std::string Swarm::get_flags()
 {
     std::stringstream os;
 
-    for(int f = flags; f; f &= f-1)
+    int const bits = flags & ~SELECTION_MASK;
+    for(int f = bits; f; f &= f-1)
     {
         int flag = f & ~(f-1);
-        if (f != flags)
+        if (f != bits)
             os << ",";
         os << flag_name(flag);
     }
+    if (flags & SELECTION_MASK)
+    {
+        if (bits) os << ",";
+        os << "selection=" << peer_selection_funcs[selection_algorithm()].name;
+    }
     return os.str();
 }
 
@@ -1076,6 +2551,20 @@ bool Swarm::set_flags(const query_param_map& query_params)
     {
         if (it->second.size() != 1)
             return false;
+        if (it->first == "selection")
+        {
+            // "default" goes back to the global algorithm
+            int algo = 0;
+            if (it->second[0] != "default")
+            {
+                algo = find_peer_selection_algorithm(it->second[0]) + 1;
+                if (algo == 0)
+                    throw std::runtime_error("No such peer selection algorithm '"
+                        + it->second[0] + "'.\n");
+            }
+            new_flags = (new_flags & ~SELECTION_MASK) | (algo << SELECTION_SHIFT);
+            continue;
+        }
         int f = flag_from_name(it->first);
         if (f == -1)
             throw std::runtime_error(std::string("No such flag '") + it->first + "'.\n");
@@ -1090,6 +2579,14 @@ bool Swarm::set_flags(const query_param_map& query_params)
     return true;
 }
 
+void Swarm::set_as_table(std::vector<std::string> args)
+{
+    if (args.size() != 1)
+        throw std::runtime_error("expected one file name");
+    size_t n = network_map::load(args[0]);
+    logger << "AS table: " << n << " prefixes loaded from " << args[0] << std::endl;
+}
+
 void Swarm::setup_controls(ControlAPI &controls)
 {
     controls.add_variable("swarm_enforce_dna_only",
@@ -1104,16 +2601,94 @@ void Swarm::setup_controls(ControlAPI &controls)
     controls.add_variable("max_handouts_per_interval",
             boost::bind(&ControlAPI::set_int, &max_peer_handout_per_interval, _1),
             boost::bind(&ControlAPI::get_int, &max_peer_handout_per_interval));
+    controls.add_variable("swarm_idle_timeout",
+            boost::bind(&ControlAPI::set_int, &idle_timeout, _1),
+            boost::bind(&ControlAPI::get_int, &idle_timeout));
+    controls.add_variable("max_swarm_peers",
+            boost::bind(&ControlAPI::set_int, &max_peers, _1),
+            boost::bind(&ControlAPI::get_int, &max_peers));
+    controls.add_variable("locality_share",
+            boost::bind(&ControlAPI::set_int, &locality_share, _1),
+            boost::bind(&ControlAPI::get_int, &locality_share));
+    controls.add_variable("locality_min_peers",
+            boost::bind(&ControlAPI::set_int, &locality_min_peers, _1),
+            boost::bind(&ControlAPI::get_int, &locality_min_peers));
+    controls.add_variable("numwant_default",
+            boost::bind(&ControlAPI::set_int, &numwant_default, _1),
+            boost::bind(&ControlAPI::get_int, &numwant_default));
+    controls.add_variable("numwant_max",
+            boost::bind(&ControlAPI::set_int, &numwant_max, _1),
+            boost::bind(&ControlAPI::get_int, &numwant_max));
+    controls.add_variable("numwant_seed_percent",
+            boost::bind(&ControlAPI::set_int, &numwant_seed_percent, _1),
+            boost::bind(&ControlAPI::get_int, &numwant_seed_percent));
+    controls.add_variable("numwant_paused_percent",
+            boost::bind(&ControlAPI::set_int, &numwant_paused_percent, _1),
+            boost::bind(&ControlAPI::get_int, &numwant_paused_percent));
+    controls.add_variable("numwant_shed_cpu",
+            boost::bind(&ControlAPI::set_int, &numwant_shed_cpu, _1),
+            boost::bind(&ControlAPI::get_int, &numwant_shed_cpu));
+    controls.add_variable("numwant_shed_min",
+            boost::bind(&ControlAPI::set_int, &numwant_shed_min, _1),
+            boost::bind(&ControlAPI::get_int, &numwant_shed_min));
+    controls.add_variable("locality_as_table",
+            boost::bind(&Swarm::set_as_table, _1),
+            boost::bind(&network_map::filename));
+    controls.add_variable("swarm_peer_selection",
+            boost::bind(&Swarm::set_peer_selection_algorithm, &peer_selection_algorithm, _1),
+            boost::bind(&Swarm::get_peer_selection_algorithm, &peer_selection_algorithm));
 }
 
 #ifndef NDEBUG
 
 void Swarm::check_invariant() const
 {
-    for (int c = 0; c < peer_struct::num_categories; ++c)
+    std::vector<std::pair<peer_id, peer_struct> > all_peers;
+    if (table)
+    {
+        assert(num_small_peers == 0);
+        for (int c = 0; c < peer_struct::num_categories; ++c)
+        {
+            assert(table->endpoints4.endpoints[c].size() == table->endpoints4.peer[c].size());
+            assert(table->endpoints6.endpoints[c].size() == table->endpoints6.peer[c].size());
+            assert(table->endpoints4.handouts[c].size() == table->endpoints4.endpoints[c].size());
+            assert(table->endpoints6.handouts[c].size() == table->endpoints6.endpoints[c].size());
+            assert(!table->endpoints4.groups
+                || table->endpoints4.groups[c].size() == table->endpoints4.endpoints[c].size());
+            assert(!table->endpoints6.groups
+                || table->endpoints6.groups[c].size() == table->endpoints6.endpoints[c].size());
+            assert(!table->endpoints4.ages
+                || table->endpoints4.ages[c].size() == table->endpoints4.endpoints[c].size());
+            assert(!table->endpoints6.ages
+                || table->endpoints6.ages[c].size() == table->endpoints6.endpoints[c].size());
+        }
+        assert(table->peers.size() == table->size());
+        assert(table->last_check_in.size() == table->size());
+        assert(table->status.size() == table->size());
+        assert(table->ep_pos.size() == table->size());
+        assert(table->ep6_pos.size() == table->size());
+        assert(table->cursor.size() == table->size());
+        for (size_t slot = 0; slot < table->size(); ++slot)
+        {
+            peer_struct p;
+            p.last_check_in = table->last_check_in[slot];
+            p.status = table->status[slot];
+            p.ep_pos = table->ep_pos[slot];
+            p.ep6_pos = table->ep6_pos[slot];
+            all_peers.push_back(std::make_pair(table->ids[slot], p));
+        }
+    }
+    else
     {
-        assert(peer_endpoints[c].size() == peer_endpoint_to_peer[c].size());
-        assert(peer6_endpoints[c].size() == peer6_endpoint_to_peer[c].size());
+        assert(num_small_peers >= 0 && num_small_peers <= SMALL_SWARM_PEERS);
+        for (int n = 0; n < num_small_peers; ++n)
+        {
+            small_peer const& sp = small_peers[n];
+            assert(sp.p.ep_pos == n);
+            assert(sp.p.ep6_pos == -1);
+            assert((sp.p.status & IS_ROUTABLE6) == 0);
+            all_peers.push_back(std::make_pair(sp.pid, sp.p));
+        }
     }
 
     int num_routable = 0;
@@ -1121,30 +2696,42 @@ void Swarm::check_invariant() const
     int num_incomplete = 0;
     int num_downloading = 0;
     int num_paused = 0;
-    for (peer_map::const_iterator i = peers.begin(),
-         end(peers.end()); i != end; ++i)
+    for (std::vector<std::pair<peer_id, peer_struct> >::const_iterator i
+        = all_peers.begin(), end(all_peers.end()); i != end; ++i)
     {
-        // make sure the id is unique
-        assert(peers.count(i->first) == 1);
-        // peer-id has to be 20 bytes
         peer_struct const& p = i->second;
         int category = p.category();
-        if (p.status & IS_ROUTABLE)
+        if (table)
         {
-            // if the peer is routable, there should be an entry in
-            // the endpoint list
-            assert(p.ep_pos >= 0);
-            assert(p.ep_pos < int(peer_endpoints[category].size()));
-            assert(peer_endpoint_to_peer[category][p.ep_pos]->first == i->first);
-        }
+            // make sure the id is unique, and maps to its slot
+            int slot = i - all_peers.begin();
+            peer_map::const_iterator j = table->peers.find(i->first);
+            assert(j != table->peers.end() && j->second == slot);
+
+            if (p.status & IS_ROUTABLE)
+            {
+                // if the peer is routable, there should be an entry in
+                // the endpoint list
+                assert(p.ep_pos >= 0);
+                assert(p.ep_pos < int(table->endpoints4.endpoints[category].size()));
+                assert(table->endpoints4.peer[category][p.ep_pos] == slot);
+            }
 
-        if (p.status & IS_ROUTABLE6)
+            if (p.status & IS_ROUTABLE6)
+            {
+                // if the peer is routable, there should be an entry in
+                // the endpoint list
+                assert(p.ep6_pos >= 0);
+                assert(p.ep6_pos < int(table->endpoints6.endpoints[category].size()));
+                assert(table->endpoints6.peer[category][p.ep6_pos] == slot);
+            }
+        }
+        else
         {
-            // if the peer is routable, there should be an entry in
-            // the endpoint list
-            assert(p.ep6_pos >= 0);
-            assert(p.ep6_pos < int(peer6_endpoints[category].size()));
-            assert(peer6_endpoint_to_peer[category][p.ep6_pos]->first == i->first);
+            // make sure the id is unique
+            for (std::vector<std::pair<peer_id, peer_struct> >::const_iterator j
+                = all_peers.begin(); j != i; ++j)
+                assert(j->first != i->first);
         }
 
         if (p.status & (IS_ROUTABLE | IS_ROUTABLE6))
@@ -1164,9 +2751,10 @@ void Swarm::check_invariant() const
                ++num_paused;
         }
     }
-    assert(int(get_num_peers()) == num_incomplete);
-    assert(int(get_num_downloaders()) == num_downloading);
-    assert(int(get_num_seeds()) == num_complete);
+    assert(peer_counts[peer_struct::active]
+        + peer_counts[peer_struct::paused] == num_incomplete);
+    assert(peer_counts[peer_struct::active] == num_downloading);
+    assert(peer_counts[peer_struct::seeding] == num_complete);
 }
 
 #endif
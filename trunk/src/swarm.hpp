@@ -13,11 +13,25 @@
 #include "xplat_hash_map.hpp"
 #include "templates.h"
 #include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/scoped_array.hpp>
 #include "boost_utils.hpp"
 #include "stats.hpp"
 #include "server.hpp"
 #include "libtorrent/peer_id.hpp"
+#include "hyperloglog.hpp"
+#include "chunked_vector.hpp"
+#include "peer_list.hpp"
+#include "locality.hpp"
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/static_assert.hpp>
+#include <cstddef>
+
+class Journal;
+class ReplicationServer;
+struct journal_record;
+struct segment_swarm;
+struct segment_peer;
 
 namespace http {
 namespace server {
@@ -51,6 +65,32 @@ struct peer6_endpoint_struct
     uint16 port;
 };
 
+// the endpoint lists are appended to announce replies as they are,
+// so the structs must be the compact 6 and 18 byte peer records
+BOOST_STATIC_ASSERT(sizeof(peer_endpoint_struct) == 6);
+BOOST_STATIC_ASSERT(offsetof(peer_endpoint_struct, port) == 4);
+BOOST_STATIC_ASSERT(sizeof(peer6_endpoint_struct) == 18);
+BOOST_STATIC_ASSERT(offsetof(peer6_endpoint_struct, port) == 16);
+
+// the handouts of an endpoint counted against
+// max_handouts_per_interval. The count loses 1/16 of its value every
+// INTERVAL/16 seconds, so it's about the handouts in the last
+// INTERVAL. It's kept next to the endpoint, in its own column, since
+// the endpoints are handed out as they are
+struct handout_counter
+{
+    handout_counter() : count(0), step(0) {}
+    // in 16ths of a handout
+    uint16 count;
+    // the time step count was last decayed at
+    uint16 step;
+};
+
+// the freshest endpoints are handed out first by grouping them by the
+// INTERVAL/8 in which their peers last checked in
+enum { age_group_seconds = INTERVAL / 8 > 0 ? INTERVAL / 8 : 1 };
+inline uint64 age_group(int time) { return uint64(time) / age_group_seconds; }
+
 // peer status bits
 // v4 address is routable
 #define IS_ROUTABLE 1
@@ -71,7 +111,8 @@ struct peer_struct
 
     peer_struct(): ep_pos(-1), ep6_pos(-1), last_check_in(0), status(0) {}
     enum category_t { seeding, active, paused, num_categories };
-    int category() const
+    int category() const { return category_of(status); }
+    static int category_of(unsigned char status)
     {
         if (status & IS_COMPLETE) return seeding;
         if (status & IS_DOWNLOADING) return active;
@@ -81,8 +122,56 @@ struct peer_struct
     void update_status(stats_struct const& stats);
 };
 
+// refers to the fields of a peer, whether they're in a peer_struct
+// or in the columns of a swarm's peer table
+struct peer_ref
+{
+    peer_ref(peer_struct& p)
+        : ep_pos(p.ep_pos), ep6_pos(p.ep6_pos),
+          last_check_in(p.last_check_in), status(p.status) {}
+    peer_ref(int& ep, int& ep6, int& check_in, unsigned char& s)
+        : ep_pos(ep), ep6_pos(ep6), last_check_in(check_in), status(s) {}
+
+    int& ep_pos;
+    int& ep6_pos;
+    int& last_check_in;
+    unsigned char& status;
+
+    int category() const { return peer_struct::category_of(status); }
+    void update_status(stats_struct const& stats);
+};
+
+// the address families of the endpoints a swarm hands out. The code
+// that keeps and hands out endpoints is a template on the family, so
+// each instance only deals with one kind of endpoint
+struct ipv4_family
+{
+    typedef peer_endpoint_struct endpoint_type;
+    typedef boost::asio::ip::address_v4 address_type;
+    // the status bits of a peer with a routable endpoint, and with
+    // an address, of the family
+    enum { routable = IS_ROUTABLE, has_address = HAS_V4 };
+    // small swarms keep v4 endpoints only
+    enum { in_small_swarms = true };
+    static int& position(peer_ref const& p) { return p.ep_pos; }
+};
+
+struct ipv6_family
+{
+    typedef peer6_endpoint_struct endpoint_type;
+    typedef boost::asio::ip::address_v6 address_type;
+    enum { routable = IS_ROUTABLE6, has_address = HAS_V6 };
+    enum { in_small_swarms = false };
+    static int& position(peer_ref const& p) { return p.ep6_pos; }
+};
+
 using libtorrent::peer_id;
 
+// swarms with at most this many peers keep them in a short array in
+// the Swarm object, which is scanned linearly, instead of in a peer_map
+// and endpoint lists. Most swarms are that small
+#define SMALL_SWARM_PEERS 8
+
 struct hash_fun
 {
 	size_t operator()(peer_id const& pid) const
@@ -98,31 +187,75 @@ struct hash_fun
 class Swarm : private boost::noncopyable
 {
 public:
-    // TODO: this could be replaced with a
-    // boost.multi_index for better performance
-    typedef hash_map<peer_id, peer_struct, hash_fun> peer_map;
+    // peer-id -> the peer's slot in the peer_table. The nodes come
+    // from a slab_pool
+#ifdef WIN32
+    typedef hash_map<peer_id, int, hash_fun> peer_map;
+#else
+    typedef hash_map<peer_id, int, hash_fun, std::equal_to<peer_id>,
+        slab_allocator<std::pair<const peer_id, int>, peer_memory> > peer_map;
+#endif
+
+    // swarms are allocated from a slab_pool
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
 
     Swarm(const std::string& info_hash, boost::asio::io_service& ios);
-    Swarm(char const* flat_file, int& size, boost::asio::io_service& ios, int &num_peers);
+    Swarm(segment_swarm const& image, segment_peer const* image_peers, boost::asio::io_service& ios);
+
+    // returns a swarm from the pool, or a new one if it's empty
+    static Swarm* create(const std::string& info_hash, boost::asio::io_service& ios);
+    // puts a swarm that's no longer in use back in the pool
+    static void recycle(Swarm* s);
+
+    // true if the swarm has no peers, no flags that must be kept,
+    // and no announces for idle_timeout seconds
+    bool is_idle(time_t now) const;
+
+    // true if a swarm created now would let the peer announce
+    static bool new_swarm_permits(const std::string& peer_id);
 
     std::string info_hash;
 
+    // numwant is the number of peers asked for, or -1 if the
+    // announce didn't say. See cap_numwant()
     void handle_announce(const std::string &peer_id,
         boost::asio::ip::address_v4 ip, uint16 port,
         boost::asio::ip::address_v6 ipv6, uint16 port6,
         int numwant, stats_struct& stats,
-        std::string& peers, std::string& peers6, bool client_debug);
+        peer_list& peers, peer_list& peers6, bool client_debug);
     void add_peer(peer_id const& pid, bool ipv4, bool ipv6,
         stats_struct& stats);
-    void update_peer(peer_map::iterator i,
+    void update_peer(peer_id const& pid, int slot,
         boost::asio::ip::address_v4 ip, uint16 port,
         boost::asio::ip::address_v6 ipv6, uint16 port6,
         stats_struct& stats, bool client_debug);
-    void remove_peer(peer_map::iterator& peer_iter);
-    void get_peers(std::string& peers, int count, int category, bool ipv6);
+    void remove_peer(peer_id const& pid);
+    // removes the peer in a slot of the peer_table (or of
+    // small_peers). The last peer is moved into the slot, and the
+    // swarm isn't demoted
+    void remove_peer_at(int slot);
+    // re-applies a change read back from the journal (or
+    // received from the replication primary)
+    void replay(journal_record const& r);
+    // restarts the timeout of every peer. Used when a replica is
+    // promoted, since it doesn't know when the peers last announced
+    void renew_peers();
     void timeout_peers();
+    // gives back memory a swarm no longer needs after it has shrunk
+    // well below its peak. Returns the number of bytes freed
+    size_t compact();
+    // calls timeout_peers() every INTERVAL/2 seconds
+    void check_timeout(time_t now)
+    {
+        if (now >= next_timeout) timeout_peers();
+    }
+    // the number of peers, routable or not
+    size_t size() const
+    {
+        return table ? table->size() : num_small_peers;
+    }
     void print_peers() const;
-    float get_handout_ratio(int num_category, int denom_category, bool ipv6) const;
     size_t get_num_peers() const; // incompletes only
     size_t get_num_downloaders() const;
     size_t get_num_paused() const;
@@ -139,10 +272,25 @@ public:
         // of peers (including non-natted). Another could be req/s.
         // Probably this should adjust for seeds having a different
         // checkin interval.
-        return peers.size();
+        return size();
     }
 
     void save_state(std::vector<char>& flat_file) const;
+    // parses one swarm saved by save_state(). Returns the number of
+    // bytes used, 0 if more than size bytes are needed or -1 if the
+    // data is corrupt. Only the routable peers are returned
+    static int read_state(char const* flat_file, int size,
+        std::string& info_hash, std::vector<segment_peer>& peers);
+    // adds the peers that aren't in the swarm already. Returns the
+    // number of peers added
+    size_t merge_peers(segment_peer const* peers, size_t num_peers);
+
+    // the number of peer records save_image() writes
+    size_t image_peers() const { return size(); }
+    // saves every peer, including its v4 and v6 endpoints, to
+    // the state segment. image_peers must have room for
+    // image_peers() records
+    void save_image(segment_swarm& image, segment_peer* image_peers) const;
 
     void set_rank(size_t nrank) { rank = nrank; }
     size_t get_rank() { return rank; }
@@ -176,105 +324,405 @@ public:
 
     bool is_terminated() { return (flags & Swarm::TERMINATE) != 0; }
 
+    // how often the endpoints have been handed out recently, for
+    // /control/handouts
+    std::string get_handout_distribution() const;
+
     static void setup_controls(ControlAPI &);
 
 private:
 
-    void start_natcheck(libtorrent::peer_id const& pid, boost::asio::ip::tcp::endpoint const& ep);
+    void reset(const std::string& info_hash);
+
+    void start_natcheck(libtorrent::peer_id const& pid, boost::asio::ip::tcp::endpoint const& ep,
+        bool seed);
     
-    typedef std::vector<peer_endpoint_struct> peer_endpoint_t;
-    typedef std::vector<peer6_endpoint_struct> peer6_endpoint_t;
-    // by looking at the source code of <ext/hash_map>
-    // it seems like iterators are only invalidated
-    // when the elements they refer to are ereased.
-    // i.e. it is safe to store these iterators as
-    // long as their elements still exist
-    typedef std::vector<peer_map::iterator> peer_endpoint_to_peer_t;
-    peer_endpoint_t peer_endpoints[peer_struct::num_categories];
-    peer6_endpoint_t peer6_endpoints[peer_struct::num_categories];
-    peer_endpoint_to_peer_t peer_endpoint_to_peer[peer_struct::num_categories];
-    peer_endpoint_to_peer_t peer6_endpoint_to_peer[peer_struct::num_categories];
-
-    void remove_endpoint(int category, int index)
+    // the routable endpoints of one address family in a peer_table.
+    // There's a list per category, and the slot of the peer of each
+    // endpoint. A flash crowd grows the lists a chunk at a time,
+    // without copying the whole list, and compact() gives the memory
+    // back
+    template <class Family>
+    struct endpoint_list
     {
-        assert(category >= 0 && category < peer_struct::num_categories);
-        peer_endpoint_t& endpoints = peer_endpoints[category];
-        assert(index >= 0 && index < endpoints.size());
-
-        int last = endpoints.size() - 1;
-        endpoints[index] = endpoints[last];
-        peer_endpoint_to_peer[category][last]->second.ep_pos = index;
-        peer_endpoint_to_peer[category][index] = peer_endpoint_to_peer[category][last];
-        endpoints.pop_back();
-        peer_endpoint_to_peer[category].pop_back();
-    }
+        typedef typename Family::endpoint_type endpoint_type;
+
+        chunked_vector<endpoint_type, endpoint_memory> endpoints[peer_struct::num_categories];
+        chunked_vector<int, endpoint_memory> peer[peer_struct::num_categories];
+        chunked_vector<handout_counter, endpoint_memory> handouts[peer_struct::num_categories];
+        // the time step in which every endpoint of the category was
+        // found at its budget, or -1. Counters only go down as steps
+        // pass, so until then only new endpoints can be handed out
+        int exhausted[peer_struct::num_categories];
+        // the endpoints of each category grouped by network. Only
+        // large swarms have them, see update_locality()
+        boost::scoped_array<endpoint_groups> groups;
+        // the endpoints of each category grouped by age_group() of
+        // their peers' last check-in. Only swarms that hand out the
+        // freshest endpoints first have them, see update_freshness()
+        boost::scoped_array<endpoint_groups> ages;
+
+        endpoint_list()
+        {
+            std::fill(exhausted, exhausted + peer_struct::num_categories, -1);
+        }
+
+        // returns the endpoint's index
+        int add(int category, int slot, endpoint_type const& endp,
+            int checked_in)
+        {
+            exhausted[category] = -1;
+            int ret = endpoints[category].size();
+            endpoints[category].push_back(endp);
+            peer[category].push_back(slot);
+            handouts[category].push_back(handout_counter());
+            if (groups)
+                groups[category].add(ret, network_map::network(endp.ip));
+            if (ages) ages[category].add(ret, age_group(checked_in));
+            return ret;
+        }
+
+        // the peer of the endpoint at index checked in
+        void checked_in(int category, int index, int time)
+        {
+            if (ages) ages[category].update(index, age_group(time));
+        }
+
+        // the endpoint at index has a new address or port
+        void set(int category, int index, endpoint_type const& endp)
+        {
+            endpoints[category][index] = endp;
+            if (groups)
+                groups[category].update(index, network_map::network(endp.ip));
+        }
+
+        void group_by_network(bool on)
+        {
+            if (!on)
+            {
+                groups.reset();
+                return;
+            }
+            if (groups) return;
+            groups.reset(new endpoint_groups[peer_struct::num_categories]);
+            for (int c = 0; c < peer_struct::num_categories; ++c)
+            {
+                for (size_t i = 0; i < endpoints[c].size(); ++i)
+                    groups[c].add(i, network_map::network(endpoints[c][i].ip));
+            }
+        }
+
+        // last_check_in is the peer_table column
+        void group_by_age(bool on,
+            chunked_vector<int, peer_memory> const& last_check_in)
+        {
+            if (!on)
+            {
+                ages.reset();
+                return;
+            }
+            if (ages) return;
+            ages.reset(new endpoint_groups[peer_struct::num_categories]);
+            for (int c = 0; c < peer_struct::num_categories; ++c)
+            {
+                for (size_t i = 0; i < endpoints[c].size(); ++i)
+                    ages[c].add(i, age_group(last_check_in[peer[c][i]]));
+            }
+        }
+
+        // moves the last endpoint of the category into index.
+        // positions is the peer_table column of the peers' indices
+        // in these lists
+        void remove(int category, int index, chunked_vector<int, peer_memory>& positions)
+        {
+            assert(category >= 0 && category < peer_struct::num_categories);
+            chunked_vector<endpoint_type, endpoint_memory>& list = endpoints[category];
+            assert(index >= 0 && index < int(list.size()));
+
+            if (groups) groups[category].remove(index);
+            if (ages) ages[category].remove(index);
+            int last = list.size() - 1;
+            list[index] = list[last];
+            positions[peer[category][last]] = index;
+            peer[category][index] = peer[category][last];
+            handouts[category][index] = handouts[category][last];
+            list.pop_back();
+            peer[category].pop_back();
+            handouts[category].pop_back();
+        }
+
+        size_t shrink()
+        {
+            size_t freed = 0;
+            for (int c = 0; c < peer_struct::num_categories; ++c)
+            {
+                freed += endpoints[c].shrink() + peer[c].shrink()
+                    + handouts[c].shrink();
+                if (groups) freed += groups[c].shrink();
+                if (ages) freed += ages[c].shrink();
+            }
+            return freed;
+        }
+    };
 
-    int add_endpoint(peer_map::iterator iter, peer_endpoint_struct const& endp)
+    // the peers of a swarm that has grown beyond SMALL_SWARM_PEERS.
+    // Each peer has a slot, and its fields are stored in columns
+    // indexed by the slot, so sweeps over all the peers (timeouts,
+    // counts) scan contiguous memory instead of hash map nodes. The
+    // slots are kept dense, erase() moves the last peer into the
+    // slot it frees
+    struct peer_table
     {
-        int category = iter->second.category();
-        assert(category >= 0 && category < peer_struct::num_categories);
-        int ret = peer_endpoints[category].size();
-        peer_endpoints[category].push_back(endp);
-        peer_endpoint_to_peer[category].push_back(iter);
-        return ret;
-    }
+        static void* operator new(size_t size);
+        static void operator delete(void* p);
+
+        peer_map peers;
+        chunked_vector<peer_id, peer_memory> ids;
+        chunked_vector<int, peer_memory> last_check_in;
+        chunked_vector<unsigned char, peer_memory> status;
+        chunked_vector<int, peer_memory> ep_pos;
+        chunked_vector<int, peer_memory> ep6_pos;
+        // where the peer's next list starts, see requester
+        chunked_vector<uint32, peer_memory> cursor;
+
+        endpoint_list<ipv4_family> endpoints4;
+        endpoint_list<ipv6_family> endpoints6;
+
+        endpoint_list<ipv4_family>& endpoints(ipv4_family) { return endpoints4; }
+        endpoint_list<ipv6_family>& endpoints(ipv6_family) { return endpoints6; }
+        endpoint_list<ipv4_family> const& endpoints(ipv4_family) const { return endpoints4; }
+        endpoint_list<ipv6_family> const& endpoints(ipv6_family) const { return endpoints6; }
+        chunked_vector<int, peer_memory>& positions(ipv4_family) { return ep_pos; }
+        chunked_vector<int, peer_memory>& positions(ipv6_family) { return ep6_pos; }
+
+        size_t size() const { return ids.size(); }
+
+        peer_ref at(int slot)
+        {
+            return peer_ref(ep_pos[slot], ep6_pos[slot],
+                last_check_in[slot], status[slot]);
+        }
+
+        // returns the new peer's slot. It has no endpoints yet
+        int insert(peer_id const& pid, peer_struct const& p)
+        {
+            int slot = ids.size();
+            ids.push_back(pid);
+            last_check_in.push_back(p.last_check_in);
+            status.push_back(p.status);
+            ep_pos.push_back(-1);
+            ep6_pos.push_back(-1);
+            // the peers start out at different places, so the first
+            // lists are spread over the swarm like the later ones
+            cursor.push_back(fast_rand());
+            peers.insert(std::make_pair(pid, slot));
+            return slot;
+        }
+
+        // the peer's endpoints must be removed first
+        void erase(int slot);
+        size_t shrink();
+
+        // adds an endpoint of the family to the peer in slot, in the
+        // list of the peer's category
+        template <class Family>
+        void add_endpoint(int slot, typename Family::endpoint_type const& endp)
+        {
+            int category = peer_struct::category_of(status[slot]);
+            positions(Family())[slot] = endpoints(Family()).add(category,
+                slot, endp, last_check_in[slot]);
+        }
+
+        // moves the peer's endpoints to the age group of its last
+        // check-in
+        void checked_in(int slot)
+        {
+            int category = peer_struct::category_of(status[slot]);
+            if (ep_pos[slot] != -1)
+                endpoints4.checked_in(category, ep_pos[slot], last_check_in[slot]);
+            if (ep6_pos[slot] != -1)
+                endpoints6.checked_in(category, ep6_pos[slot], last_check_in[slot]);
+        }
+
+        void group_by_age(bool on)
+        {
+            endpoints4.group_by_age(on, last_check_in);
+            endpoints6.group_by_age(on, last_check_in);
+        }
+
+        // removes the peer's endpoint of the family from the list of
+        // category
+        template <class Family>
+        void remove_endpoint(int slot, int category)
+        {
+            chunked_vector<int, peer_memory>& pos = positions(Family());
+            assert(pos[slot] >= 0);
+            assert(endpoints(Family()).peer[category][pos[slot]] == slot);
+            endpoints(Family()).remove(category, pos[slot], pos);
+            pos[slot] = -1;
+        }
+    };
 
-    void remove_endpoint6(int category, int index)
+    // a peer of a small swarm. ep is only valid if the peer is
+    // IS_ROUTABLE, and p.ep_pos is the peer's index in small_peers.
+    // There's no room for v6 endpoints, the first one moves the swarm
+    // to a peer_table
+    struct small_peer
     {
-        assert(category >= 0 && category < peer_struct::num_categories);
-        peer6_endpoint_t& endpoints = peer6_endpoints[category];
-        assert(index >= 0 && index < endpoints.size());
-
-        int last = endpoints.size() - 1;
-        endpoints[index] = endpoints[last];
-        peer6_endpoint_to_peer[category][last]->second.ep6_pos = index;
-        peer6_endpoint_to_peer[category][index] = peer6_endpoint_to_peer[category][last];
-        endpoints.pop_back();
-        peer6_endpoint_to_peer[category].pop_back();
-    }
+        peer_id pid;
+        peer_struct p;
+        peer_endpoint_struct ep;
+    };
 
-    int add_endpoint6(peer_map::iterator iter, peer6_endpoint_struct const& endp)
-    {
-        int category = iter->second.category();
-        assert(category >= 0 && category < peer_struct::num_categories);
-        int ret = peer6_endpoints[category].size();
-        peer6_endpoints[category].push_back(endp);
-        peer6_endpoint_to_peer[category].push_back(iter);
-        return ret;
-    }
+    // NULL while the swarm is small, then its peers are in small_peers
+    boost::scoped_ptr<peer_table> table;
+    small_peer small_peers[SMALL_SWARM_PEERS];
+    int num_small_peers;
 
-    peer_map peers;
+    // the peers a swarm at max_peers doesn't keep. They're only
+    // counted, in sketches of the current and the previous INTERVAL
+    struct untracked_peers
+    {
+        untracked_peers();
+        ~untracked_peers();
+
+        HyperLogLog seeds[2];
+        HyperLogLog downloaders[2];
+        int current;
+        time_t window_start;
+        // the number of new peers offered to the reservoir this window
+        int64_t seen;
+        // refreshed at most once a second
+        time_t estimated;
+        int64_t num_seeds;
+        int64_t num_downloaders;
+    };
+    // NULL unless the swarm has been at max_peers recently
+    boost::scoped_ptr<untracked_peers> untracked;
+
+    // reservoir sampling. Returns true if a new peer should be added
+    // to a swarm at max_peers, a random routable peer has been
+    // removed to make room for it then
+    bool make_room();
+    bool remove_random_peer();
+    void count_untracked(peer_id const& pid, bool seed);
+    // starts a new window every INTERVAL
+    void rotate_untracked(time_t now);
+    void update_estimate() const;
+    int64_t untracked_seeds() const;
+    int64_t untracked_downloaders() const;
+
+    // the peers with an address of one family in each category, and
+    // how far the handouts have come in the family's endpoint lists
+    struct handout_state
+    {
+        int counts[peer_struct::num_categories];
+        float list_cursor[peer_struct::num_categories];
+        int next_handout[peer_struct::num_categories];
+    };
+    handout_state handout4;
+    handout_state handout6;
+    handout_state& handout(ipv4_family) { return handout4; }
+    handout_state& handout(ipv6_family) { return handout6; }
+    handout_state const& handout(ipv4_family) const { return handout4; }
+    handout_state const& handout(ipv6_family) const { return handout6; }
 
     // the number of peers in each category
-    int peer4_counts[peer_struct::num_categories];
-    float peer4_list_cursor[peer_struct::num_categories];
-    int next_handout4[peer_struct::num_categories];
-
-    int peer6_counts[peer_struct::num_categories];
-    float peer6_list_cursor[peer_struct::num_categories];
-    int next_handout6[peer_struct::num_categories];
-
     int peer_counts[peer_struct::num_categories];
 
     mutable StatsLogger stats_logger;
-    LoopingCall timeout;
+    // when timeout_peers() is due next
+    time_t next_timeout;
 
     boost::asio::io_service& io_service_;
 
     size_t rank;
     double cpuload;
 
-    void add_peer_endpoint(peer_map::iterator peer,
+    time_t last_announce;
+    // NAT-checks that will call back into this swarm
+    int natchecks_pending;
+
+    // returns the peer's slot, or -1 if it's not in the swarm
+    int find_peer(peer_id const& pid);
+    peer_ref peer_at(int slot)
+    {
+        if (table) return table->at(slot);
+        return peer_ref(small_peers[slot].p);
+    }
+    // adds a peer that's not in the swarm and counts it, without
+    // logging it. ep and ep6 are the endpoints of a routable peer
+    void insert_peer(peer_id const& pid, peer_struct const& peer,
+        peer_endpoint_struct const* ep, peer6_endpoint_struct const* ep6);
+    void uncount_peer(unsigned char status);
+    // the number of routable endpoints of a family in a category
+    template <class Family>
+    int num_endpoints(int category) const;
+    template <class Family>
+    int num_routable() const;
+    // moves the peers of a small swarm to a peer_table, and back
+    // again once it's shrunk to half of SMALL_SWARM_PEERS
+    void promote();
+    void maybe_demote();
+    // rebuilds the peer_map of the peer_table at the right size
+    void rebuild_table();
+    void reset_cursors();
+
+    void add_peer_endpoint(peer_id const& pid,
         boost::asio::ip::address ip, uint16 port);
+    // adds the NAT-checked endpoint of a family to the peer in slot,
+    // unless it has one already
+    template <class Family>
+    void add_peer_endpoint(peer_id const& pid, int slot,
+        typename Family::address_type const& ip, uint16 port);
+    // counts the address of a family the peer announced with, if it
+    // didn't have one. Returns true if it didn't
+    template <class Family>
+    bool add_address(peer_ref const& p);
+    // refreshes the peer's endpoint of a family, if it has one
+    template <class Family>
+    void update_endpoint(peer_ref const& p,
+        typename Family::address_type const& ip, uint16 port);
+    // moves the peer's counts and endpoints from old_category to
+    // the category its status bits currently say
+    void move_peer(int slot, int old_category);
+    template <class Family>
+    void move_endpoint(int slot, int old_category);
+    void log_change(int type, peer_id const& pid, peer_ref const& p,
+        boost::asio::ip::address const& ip = boost::asio::ip::address(),
+        uint16 port = 0);
     void nat_ok(peer_id const& pid, boost::asio::ip::tcp::endpoint ep, int r);
     void nat_bad(peer_id const& pid, boost::asio::ip::tcp::endpoint ep, const std::exception &e);
 
     static int64_t peers_delivered;
     static int64_t num_peers_created;
+    static int64_t num_swarms_recycled;
+    static int64_t num_swarms_reused;
+    static int64_t num_swarms_promoted;
+    static int64_t num_swarms_demoted;
+    static int64_t num_swarms_compacted;
+    static int64_t num_bytes_compacted;
+    static int64_t num_peers_replaced;
+    static int64_t num_local_peers_delivered;
+    static int64_t num_numwant_capped;
+    static int64_t numwant_bytes_saved;
+    // the handouts of a sample of the announces by the age of the
+    // endpoint, < 1/8, 1/4, 1/2 and 1 INTERVAL, and older
+    enum { num_age_buckets = 5 };
+    static int64_t handout_ages[num_age_buckets];
+    static int age_bucket(int age);
+    static int64_t num_announces_untracked;
+    static int64_t num_capped_swarms;
+    static int64_t untracked_estimate;
+    static std::vector<Swarm*> pool;
     enum {
         DISABLED = 0x1,
         DNA_ONLY = 0x2,
         TERMINATE = 0x4,
+        // the swarm's peer selection algorithm + 1, or 0 for the
+        // default one. Set with selection=<name> in /control/flags
+        SELECTION_MASK = 0x70,
+        SELECTION_SHIFT = 4,
     };
     int flags;
     struct flagnames_t {
@@ -288,18 +736,127 @@ private:
     enum peer_selection_algorithm_t {
         RANDOM,
         PRUNED,
+        FRESH,
     };
+    // the algorithm of swarms that don't have their own
     static peer_selection_algorithm_t peer_selection_algorithm;
 
+    // the peer a list of endpoints is handed to
+    struct requester
+    {
+        requester() : category(-1), self4(-1), self6(-1),
+            has_cursor(false), cursor(0), walked(0), sample_ages(false) {}
+
+        // the category the requester's own endpoints are listed in,
+        // and their indices there, or -1. They're never handed back
+        // to it
+        int category;
+        int self4;
+        int self6;
+        // the index of the requester's endpoint in the list of
+        // category, or -1
+        int self(ipv4_family, int c) const { return c == category ? self4 : -1; }
+        int self(ipv6_family, int c) const { return c == category ? self6 : -1; }
+
+        // a tracked peer of a large swarm has its own cursor through
+        // the endpoint lists, so its next list continues where this
+        // one ends. The others share the swarm's cursors
+        bool has_cursor;
+        uint32 cursor;
+        // the most endpoints walked over in one list, the peer's
+        // cursor moves on that far once its lists are handed out
+        int walked;
+        // count the ages of the endpoints handed out in handout_ages
+        bool sample_ages;
+    };
+    // the requester of the peer in slot (of the table, or of
+    // small_peers), or of a peer the swarm doesn't track if it's -1
+    requester make_requester(int slot) const;
+
+    // a peer selection algorithm hands out up to count endpoints of
+    // a category, and returns the number handed out. get_peers()
+    // decides how many to take from each category. If budgeted is
+    // set, endpoints that have had max_handouts_per_interval are
+    // skipped (in large swarms, small ones don't count handouts)
+    typedef int (Swarm::*peer_selector)(peer_list& peers, float count,
+        int category, bool budgeted, requester& to);
     struct peer_selection_function_t {
         enum peer_selection_algorithm_t algo;
-        char *name;
+        char const* name;
+        peer_selector select4;
+        peer_selector select6;
     };
     static peer_selection_function_t peer_selection_funcs[];
-
-    int get_peers_sequential(std::string& peers, float count, int category, bool ipv6);
-    int get_peers_random(std::string& peers, int count, int category, bool ipv6);
-    int get_peers_at(std::string& peers, int start_peer, int count, int category, bool ipv6);
+    static peer_selector selector(peer_selection_function_t const& f, ipv4_family)
+    { return f.select4; }
+    static peer_selector selector(peer_selection_function_t const& f, ipv6_family)
+    { return f.select6; }
+    static int find_peer_selection_algorithm(const std::string& name);
+    peer_selection_algorithm_t selection_algorithm() const;
+
+    // the number of peers a peer of category is handed, when it asks
+    // for numwant
+    static int cap_numwant(int numwant, int category);
+    // the endpoints get_peers() could hand a peer of category
+    template <class Family>
+    int num_candidates(int category, requester const& to) const;
+    template <class Family>
+    float get_handout_ratio(int num_category, int denom_category) const;
+    template <class Family>
+    void get_peers(peer_list& peers, int count, int category,
+        typename Family::address_type const& ip, requester& to);
+    // starts or stops grouping the endpoints by network, as the swarm
+    // grows or shrinks past locality_min_peers
+    void update_locality();
+    // starts or stops grouping the endpoints by age, as the swarm
+    // starts or stops using the fresh selection
+    void update_freshness();
+    // hands out up to count endpoints in network, of the categories
+    // a peer of category is handed
+    template <class Family>
+    int get_local_peers(peer_list& peers, int count, int category,
+        uint64 network, requester const& to);
+    template <class Family>
+    int get_peers_sequential(peer_list& peers, float count, int category,
+        bool budgeted, requester& to);
+    // hands out the endpoints of a category with the swarm's
+    // algorithm
+    template <class Family>
+    int select_peers(peer_list& peers, float count, int category,
+        bool budgeted, requester& to);
+    // hands out count endpoints picked at random, without duplicates
+    template <class Family>
+    int get_peers_random(peer_list& peers, float count, int category,
+        bool budgeted, requester& to);
+    // hands out the endpoints whose peers checked in last first
+    template <class Family>
+    int get_peers_fresh(peer_list& peers, float count, int category,
+        bool budgeted, requester& to);
+    // adds the age of the endpoint at index to handout_ages
+    template <class Family>
+    void count_handout_age(int category, int index);
+    // hands out count endpoints from start_peer on, leaving out the
+    // requester's own. walked is set to the number of positions passed
+    template <class Family>
+    int get_peers_at(peer_list& peers, int start_peer, int count,
+        int category, requester const& to, int& walked);
+    // hands out up to count endpoints from start_peer on that are
+    // within their budget. scanned is set to the number of endpoints
+    // looked at, which is bounded so a swarm whose endpoints are all
+    // at their budget doesn't cost a sweep per announce
+    template <class Family>
+    int get_budgeted_peers_at(peer_list& peers, int start_peer, int count,
+        int category, requester const& to, int& scanned);
+    // true if handing an endpoint of category to a peer of
+    // peer_category counts against its budget
+    static bool budgeted(int peer_category, int category)
+    {
+        return peer_category != peer_struct::active
+            || category == peer_struct::seeding;
+    }
+    // the v4 endpoints of a small swarm
+    int get_small_peers_at(peer_list& peers, int start_peer, int count,
+        int category, int skip, int& walked);
 //    void get_peers_pruned(std::string& peers, int count, int category);
     static void set_peer_selection_algorithm(
             enum peer_selection_algorithm_t *,
@@ -324,6 +881,41 @@ public:
     // single peer can be handed out during one announce
     // interval (typically around 30 minutes).
     static int max_peer_handout_per_interval;
+    // if set, all peer changes are logged here between checkpoints
+    static Journal* journal;
+    // if set, all peer changes are sent to the replication followers
+    static ReplicationServer* replicator;
+    // set while following a replication primary. Peers are only
+    // timed out by the primary then
+    static bool replica;
+    // empty swarms without announces for this many seconds are
+    // removed. 0 keeps them forever
+    static int idle_timeout;
+    // the number of removed swarms kept for reuse
+    static size_t max_pooled;
+    // the most peers tracked per swarm. 0 is no limit
+    static int max_peers;
+    // the percentage of the peers handed out that are taken from the
+    // announcing peer's network, if it has enough. 0 turns it off
+    static int locality_share;
+    // swarms group their peers by network from this many peers, and
+    // stop when they shrink to half of it
+    static int locality_min_peers;
+    static void set_as_table(std::vector<std::string> args);
+    // the peers handed out if the announce doesn't ask for a number,
+    // and the most handed out whatever it asks for
+    static int numwant_default;
+    static int numwant_max;
+    // the percentages of the number asked for that seeds and paused
+    // peers are handed
+    static int numwant_seed_percent;
+    static int numwant_paused_percent;
+    // above this tracker CPU percentage the cap comes down, to
+    // numwant_shed_min at 100%. 100 turns it off
+    static int numwant_shed_cpu;
+    static int numwant_shed_min;
+    // the tracker's CPU percentage, updated every second
+    static double tracker_cpu;
 };
 
 } // namespace server
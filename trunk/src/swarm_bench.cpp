@@ -0,0 +1,339 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+// measures a full sweep over the peers of one large swarm, with the
+// peer_table's columns and with the hash map of peer structs the
+// swarms used to keep their peers in, the announces of peers with v4
+// endpoints only and with both v4 and v6 endpoints, and the building
+// of their replies, with the peer lists copied through the dictionary
+// and bencoded straight from the swarm, and the announces with each
+// peer selection algorithm
+//
+// usage: swarm_bench [peers] [rounds]
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <ctime>
+#include <sstream>
+#include <iterator>
+#include <boost/asio.hpp>
+#include <libtorrent/bencode.hpp>
+
+#include "swarm.hpp"
+#include "reply.hpp"
+#include "state_segment.hpp"
+#include "utils.hpp"
+
+bool verbose_logging = false;
+
+using namespace http::server;
+
+namespace
+{
+    // the previous layout, one hash map node per peer
+    typedef hash_map<peer_id, peer_struct, hash_fun> old_peer_map;
+
+    // what timeout_peers() did for every peer, when none have expired
+    int old_sweep(old_peer_map const& peers, int now)
+    {
+        int expired = 0;
+        for (old_peer_map::const_iterator i = peers.begin();
+            i != peers.end(); ++i)
+        {
+            if (now - i->second.last_check_in > (INTERVAL + INTERVAL/10))
+                ++expired;
+        }
+        return expired;
+    }
+
+    void old_renew(old_peer_map& peers, int now)
+    {
+        for (old_peer_map::iterator i = peers.begin(); i != peers.end(); ++i)
+            i->second.last_check_in = std::max(i->second.last_check_in, now);
+    }
+
+    void report(char const* name, double ms, size_t num_peers)
+    {
+        std::cout << name << ": " << string_format("%.2f", ms) << " ms, "
+            << string_format("%.2f", ms * 1000000. / num_peers)
+            << " ns/peer" << std::endl;
+    }
+
+    // the load tester's peer-ids may announce as often as they like
+    std::string announcer_id(int i)
+    {
+        std::string ret = "MAGICMAG";
+        ret.resize(20, 0);
+        memcpy(&ret[8], &i, sizeof(i));
+        return ret;
+    }
+
+    enum reply_build
+    {
+        // only the handout
+        no_reply,
+        // the peer lists copied into the dictionary, bencoded into a
+        // stream and the stream's string copied into the reply, which
+        // is copied again to the connection
+        copied_reply,
+        // the peer lists bencoded straight into the reply, which is
+        // swapped into the connection
+        direct_reply
+    };
+
+    // the reply to the connection
+    reply sent;
+
+    void build_reply(reply_build build, peer_list const& peers,
+        peer_list const& peers6)
+    {
+        if (build == no_reply) return;
+        libtorrent::entry::dictionary_type dict;
+        dict["interval"] = INTERVAL;
+        dict["min interval"] = MIN_INTERVAL;
+        dict["external ip"] = std::string(4, 'x');
+        dict["snapdelta"] = SNAP_DELTA;
+        reply rep;
+        if (build == copied_reply)
+        {
+            dict["peers"] = peers.str();
+            if (!peers6.empty()) dict["peers6"] = peers6.str();
+            std::stringstream st;
+            libtorrent::bencode(std::ostream_iterator<char>(st), dict);
+            std::string const& str = st.str();
+            rep.content.append(str);
+            sent = rep;
+        }
+        else
+        {
+            rep.content.reserve(peers.size() + peers6.size() + 200);
+            bencode_announce(rep.content, dict, peers, peers6);
+            sent.swap(rep);
+        }
+    }
+
+    // times announces from the peers of a swarm of num_peers
+    // routable peers, which are handed numwant peers each. selection
+    // is the swarm's peer selection algorithm, if not the default
+    double bench_announces(int num_peers, int num_announces,
+        bool dual_stack, int numwant = 50, reply_build build = no_reply,
+        char const* selection = NULL)
+    {
+        int now = time(NULL);
+        std::vector<segment_peer> peers(num_peers);
+        for (int i = 0; i < num_peers; ++i)
+        {
+            segment_peer& sp = peers[i];
+            memset(&sp, 0, sizeof(sp));
+            std::string pid = announcer_id(i);
+            std::copy(pid.begin(), pid.end(), sp.peer_id);
+            sp.last_check_in = now;
+            sp.status = IS_ROUTABLE | ((i & 3) ? IS_DOWNLOADING : IS_COMPLETE);
+            memcpy(sp.ip, &i, 4);
+            sp.port = i;
+            if (dual_stack)
+            {
+                sp.status |= IS_ROUTABLE6;
+                memcpy(sp.ip6, &i, 4);
+                sp.port6 = i;
+            }
+        }
+
+        boost::asio::io_service ios;
+        Swarm swarm(std::string(20, dual_stack ? '6' : '4'), ios);
+        swarm.merge_peers(&peers[0], peers.size());
+        if (selection)
+        {
+            Swarm::query_param_map flags;
+            flags["selection"].push_back(selection);
+            swarm.set_flags(flags);
+        }
+
+        stats_struct stats;
+        memset(&stats, 0, sizeof(stats));
+        stats.left = 1;
+        boost::asio::ip::address_v4 ip(0x0a000001);
+        boost::asio::ip::address_v6 ipv6;
+        if (dual_stack)
+            ipv6 = boost::asio::ip::address_v6::from_string("2001:db8::1");
+        peer_list reply4;
+        peer_list reply6;
+
+        StopWatch sw;
+        for (int i = 0; i < num_announces; ++i)
+        {
+            reply4.clear();
+            reply6.clear();
+            swarm.handle_announce(announcer_id(i % num_peers), ip, 6881,
+                ipv6, dual_stack ? 6881 : 0, numwant, stats, reply4, reply6,
+                false);
+            build_reply(build, reply4, reply6);
+        }
+        return sw.get_msec();
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int num_peers = argc > 1 ? atoi(argv[1]) : 1000000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    if (num_peers <= 0 || rounds <= 0)
+    {
+        std::cerr << "usage: swarm_bench [peers] [rounds]" << std::endl;
+        return 1;
+    }
+
+    // timeout_peers() logs the sweeps it times
+    std::ostream quiet(NULL);
+    logger_p = &quiet;
+    // the replies are as long as they ask for
+    Swarm::numwant_max = 1 << 30;
+
+    int now = time(NULL);
+    std::vector<segment_peer> peers(num_peers);
+    old_peer_map old_peers;
+    srand(now);
+    for (int i = 0; i < num_peers; ++i)
+    {
+        segment_peer& sp = peers[i];
+        memset(&sp, 0, sizeof(sp));
+        for (int j = 0; j < 20; ++j) sp.peer_id[j] = rand();
+        memcpy(sp.peer_id, &i, sizeof(i));
+        sp.last_check_in = now;
+        sp.status = IS_ROUTABLE | ((rand() & 3) ? IS_DOWNLOADING : IS_COMPLETE);
+        memcpy(sp.ip, &i, 4);
+        sp.port = i;
+
+        peer_id pid;
+        std::copy(sp.peer_id, sp.peer_id + 20, pid.begin());
+        peer_struct p;
+        p.last_check_in = sp.last_check_in;
+        p.status = sp.status;
+        old_peers.insert(std::make_pair(pid, p));
+    }
+
+    boost::asio::io_service ios;
+    Swarm swarm(std::string(20, 'b'), ios);
+    swarm.merge_peers(&peers[0], peers.size());
+    std::cout << num_peers << " peers, best of " << rounds << " rounds"
+        << std::endl;
+
+    double old_ms = 1e9;
+    double new_ms = 1e9;
+    double old_renew_ms = 1e9;
+    double new_renew_ms = 1e9;
+    int expired = 0;
+    for (int r = 0; r < rounds; ++r)
+    {
+        StopWatch sw;
+        expired += old_sweep(old_peers, now);
+        old_ms = std::min(old_ms, sw.get_msec());
+
+        sw.restart();
+        swarm.timeout_peers();
+        new_ms = std::min(new_ms, sw.get_msec());
+
+        sw.restart();
+        old_renew(old_peers, now);
+        old_renew_ms = std::min(old_renew_ms, sw.get_msec());
+
+        sw.restart();
+        swarm.renew_peers();
+        new_renew_ms = std::min(new_renew_ms, sw.get_msec());
+    }
+
+    if (expired != 0 || int(swarm.size()) != num_peers)
+    {
+        std::cerr << "peers expired during the benchmark" << std::endl;
+        return 1;
+    }
+
+    report("timeout sweep, hash map", old_ms, num_peers);
+    report("timeout sweep, columns", new_ms, num_peers);
+    report("renew, hash map", old_renew_ms, num_peers);
+    report("renew, columns", new_renew_ms, num_peers);
+
+    int const announce_peers = std::min(num_peers, 10000);
+    int const num_announces = 200000;
+    double v4_ms = 1e9;
+    double dual_ms = 1e9;
+    for (int r = 0; r < rounds; ++r)
+    {
+        v4_ms = std::min(v4_ms,
+            bench_announces(announce_peers, num_announces, false));
+        dual_ms = std::min(dual_ms,
+            bench_announces(announce_peers, num_announces, true));
+    }
+    std::cout << num_announces << " announces to a swarm of "
+        << announce_peers << " peers" << std::endl;
+    std::cout << "announce, v4 only: "
+        << string_format("%.0f", v4_ms * 1000000. / num_announces)
+        << " ns/announce" << std::endl;
+    std::cout << "announce, v4 and v6: "
+        << string_format("%.0f", dual_ms * 1000000. / num_announces)
+        << " ns/announce" << std::endl;
+
+    int const numwants[] = { 50, 1000, 5000 };
+    for (int n = 0; n < 3; ++n)
+    {
+        int const replies = num_announces / numwants[n] * 10;
+        double copied_ms = 1e9;
+        double direct_ms = 1e9;
+        for (int r = 0; r < rounds; ++r)
+        {
+            copied_ms = std::min(copied_ms, bench_announces(announce_peers,
+                replies, true, numwants[n], copied_reply));
+            direct_ms = std::min(direct_ms, bench_announces(announce_peers,
+                replies, true, numwants[n], direct_reply));
+        }
+        std::cout << "reply of " << numwants[n] << " peers, copied: "
+            << string_format("%.0f", copied_ms * 1000000. / replies)
+            << " ns, bencoded from the swarm: "
+            << string_format("%.0f", direct_ms * 1000000. / replies)
+            << " ns" << std::endl;
+    }
+
+    char const* selections[] = { "pruned", "random", "fresh" };
+    int const num_selections = sizeof(selections) / sizeof(selections[0]);
+    for (int n = 0; n < 3; ++n)
+    {
+        int const replies = num_announces / numwants[n] * 10;
+        std::cout << "handout of " << numwants[n] << " peers";
+        for (int s = 0; s < num_selections; ++s)
+        {
+            double ms = 1e9;
+            for (int r = 0; r < rounds; ++r)
+            {
+                ms = std::min(ms, bench_announces(announce_peers,
+                    replies, false, numwants[n], no_reply, selections[s]));
+            }
+            std::cout << ", " << selections[s] << ": "
+                << string_format("%.0f", ms * 1000000. / replies) << " ns";
+        }
+        std::cout << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,371 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "swarm_index.hpp"
+
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+namespace
+{
+    // the table is grown when it's more than 70% full
+    const size_t initial_size = 1024;
+    inline bool too_full(size_t size, size_t capacity)
+    { return size * 10 > capacity * 7; }
+
+    inline uint64 rotl(uint64 x, int b)
+    { return (x << b) | (x >> (64 - b)); }
+
+    inline void sip_round(uint64& v0, uint64& v1, uint64& v2, uint64& v3)
+    {
+        v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+        v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+    }
+
+    inline uint64 read_le64(byte const* p)
+    {
+        uint64 ret = 0;
+        for (int i = 7; i >= 0; --i) ret = (ret << 8) | p[i];
+        return ret;
+    }
+
+    // SipHash-2-4 of a 20 byte key
+    uint64 siphash20(uint64 const* seed, byte const* in)
+    {
+        uint64 v0 = seed[0] ^ 0x736f6d6570736575ULL;
+        uint64 v1 = seed[1] ^ 0x646f72616e646f6dULL;
+        uint64 v2 = seed[0] ^ 0x6c7967656e657261ULL;
+        uint64 v3 = seed[1] ^ 0x7465646279746573ULL;
+
+        // two full words, and the last 4 bytes together with the length
+        uint64 m[3];
+        m[0] = read_le64(in);
+        m[1] = read_le64(in + 8);
+        m[2] = (uint64(20) << 56) | in[16] | (uint64(in[17]) << 8)
+            | (uint64(in[18]) << 16) | (uint64(in[19]) << 24);
+
+        for (int i = 0; i < 3; ++i)
+        {
+            v3 ^= m[i];
+            sip_round(v0, v1, v2, v3);
+            sip_round(v0, v1, v2, v3);
+            v0 ^= m[i];
+        }
+
+        v2 ^= 0xff;
+        for (int i = 0; i < 4; ++i) sip_round(v0, v1, v2, v3);
+        return v0 ^ v1 ^ v2 ^ v3;
+    }
+
+    void random_seed(uint64* seed)
+    {
+        FILE* f = fopen("/dev/urandom", "rb");
+        if (f)
+        {
+            size_t n = fread(seed, sizeof(uint64), 2, f);
+            fclose(f);
+            if (n == 2) return;
+        }
+        // not as good, but it's still not known outside
+        seed[0] = (uint64(time(NULL)) << 32) ^ uint64(getpid());
+        seed[1] = (uint64(rand()) << 32) ^ uint64(size_t(seed));
+    }
+}
+
+namespace http {
+namespace server {
+
+SwarmIndex::SwarmIndex()
+    : mask_(0),
+      size_(0),
+      lookups_(0),
+      probes_(0),
+      longest_probe_(0)
+{
+    random_seed(seed_);
+    slot empty;
+    empty.second = NULL;
+    table_.resize(initial_size, empty);
+    mask_ = initial_size - 1;
+}
+
+size_t SwarmIndex::hash(key_type const& k) const
+{
+    return size_t(siphash20(seed_, k.begin()));
+}
+
+size_t SwarmIndex::lookup(key_type const& k) const
+{
+    size_t i = hash(k) & mask_;
+    size_t probes = 1;
+    while (table_[i].second != NULL && table_[i].first != k)
+    {
+        i = (i + 1) & mask_;
+        ++probes;
+    }
+    ++lookups_;
+    probes_ += probes;
+    if (probes > longest_probe_) longest_probe_ = probes;
+    return i;
+}
+
+Swarm* SwarmIndex::find(key_type const& info_hash) const
+{
+    return table_[lookup(info_hash)].second;
+}
+
+Swarm* SwarmIndex::find(std::string const& info_hash) const
+{
+    if (info_hash.size() != key_type::size) return NULL;
+    return find(key_type(info_hash));
+}
+
+Swarm*& SwarmIndex::find_or_insert(key_type const& info_hash, bool& inserted)
+{
+    size_t i = lookup(info_hash);
+    inserted = table_[i].second == NULL;
+    if (!inserted) return table_[i].second;
+
+    if (too_full(size_ + 1, table_.size()))
+    {
+        grow();
+        i = lookup(info_hash);
+    }
+    ++size_;
+    table_[i].first = info_hash;
+    return table_[i].second;
+}
+
+bool SwarmIndex::insert(key_type const& info_hash, Swarm* s)
+{
+    assert(s != NULL);
+    bool inserted;
+    Swarm*& v = find_or_insert(info_hash, inserted);
+    if (inserted) v = s;
+    return inserted;
+}
+
+bool SwarmIndex::erase(key_type const& info_hash)
+{
+    size_t i = lookup(info_hash);
+    if (table_[i].second == NULL) return false;
+
+    // move back the following entries that would otherwise no
+    // longer be reachable from their home slot, instead of
+    // leaving a tombstone
+    size_t j = i;
+    for (;;)
+    {
+        j = (j + 1) & mask_;
+        if (table_[j].second == NULL) break;
+        size_t home = hash(table_[j].first) & mask_;
+        // is home cyclically outside of (i, j]?
+        if (((j - home) & mask_) >= ((j - i) & mask_))
+        {
+            table_[i] = table_[j];
+            i = j;
+        }
+    }
+    table_[i].second = NULL;
+    --size_;
+    return true;
+}
+
+void SwarmIndex::clear()
+{
+    for (std::vector<slot>::iterator i = table_.begin(); i != table_.end(); ++i)
+        i->second = NULL;
+    size_ = 0;
+}
+
+void SwarmIndex::grow()
+{
+    std::vector<slot> old;
+    old.swap(table_);
+
+    slot empty;
+    empty.second = NULL;
+    table_.resize(old.size() * 2, empty);
+    mask_ = table_.size() - 1;
+
+    for (std::vector<slot>::const_iterator i = old.begin(); i != old.end(); ++i)
+    {
+        if (i->second == NULL) continue;
+        size_t j = hash(i->first) & mask_;
+        while (table_[j].second != NULL) j = (j + 1) & mask_;
+        table_[j] = *i;
+    }
+}
+
+std::string SwarmIndex::instance_stats() const
+{
+    // the swarms that aren't in their home slot, and how far
+    // they are from it
+    size_t displaced = 0;
+    size_t max_displacement = 0;
+    for (size_t i = 0; i < table_.size(); ++i)
+    {
+        if (table_[i].second == NULL) continue;
+        size_t d = (i - hash(table_[i].first)) & mask_;
+        if (d == 0) continue;
+        ++displaced;
+        if (d > max_displacement) max_displacement = d;
+    }
+
+    std::stringstream st;
+
+    st << "Swarm index size: " << size_ << std::endl;
+    st << "Swarm index capacity: " << table_.size() << std::endl;
+    st << "Swarm index collisions: " << displaced << std::endl;
+    st << "Swarm index max displacement: " << max_displacement << std::endl;
+    st << "Swarm index lookups: " << lookups_ << std::endl;
+    st << "Swarm index average probe length: "
+        << (lookups_ ? double(probes_) / lookups_ : 0.) << std::endl;
+    st << "Swarm index longest probe: " << longest_probe_ << std::endl;
+
+    return st.str();
+}
+
+ProbationTable::ProbationTable(int capacity, int timeout)
+    : mask_(0),
+      size_(0),
+      timeout_(timeout),
+      inserted_(0),
+      admitted_(0),
+      evicted_(0),
+      expired_(0)
+{
+    random_seed(seed_);
+    set_capacity(capacity);
+}
+
+void ProbationTable::set_capacity(int capacity)
+{
+    size_t buckets = 0;
+    if (capacity > 0)
+    {
+        buckets = 1;
+        while (buckets * bucket_size < size_t(capacity)) buckets *= 2;
+    }
+
+    probationary_announce empty;
+    memset(&empty, 0, sizeof(empty));
+    std::vector<probationary_announce>(buckets * bucket_size, empty).swap(table_);
+    mask_ = buckets ? buckets - 1 : 0;
+    size_ = 0;
+}
+
+size_t ProbationTable::bucket(key_type const& k) const
+{
+    return (size_t(siphash20(seed_, k.begin())) & mask_) * bucket_size;
+}
+
+bool ProbationTable::announce(probationary_announce const& a,
+    probationary_announce& first)
+{
+    assert(enabled());
+    assert(a.time != 0);
+
+    probationary_announce* b = &table_[bucket(a.info_hash)];
+    // the entry to use if the info-hash isn't there
+    probationary_announce* victim = b;
+    for (int i = 0; i < bucket_size; ++i)
+    {
+        probationary_announce& e = b[i];
+        if (e.time != 0 && expired(e, a.time))
+        {
+            e.time = 0;
+            --size_;
+            ++expired_;
+        }
+        if (e.time != 0 && e.info_hash == a.info_hash)
+        {
+            if (e.pid == a.pid)
+            {
+                // the same peer again
+                e = a;
+                return false;
+            }
+            first = e;
+            e.time = 0;
+            --size_;
+            ++admitted_;
+            return true;
+        }
+        if (victim->time != 0 && (e.time == 0 || e.time < victim->time))
+            victim = &b[i];
+    }
+
+    if (victim->time != 0)
+        ++evicted_;
+    else
+        ++size_;
+    *victim = a;
+    ++inserted_;
+    return false;
+}
+
+void ProbationTable::stopped(key_type const& info_hash,
+    libtorrent::peer_id const& pid)
+{
+    if (!enabled()) return;
+    probationary_announce* b = &table_[bucket(info_hash)];
+    for (int i = 0; i < bucket_size; ++i)
+    {
+        probationary_announce& e = b[i];
+        if (e.time == 0 || e.info_hash != info_hash || e.pid != pid)
+            continue;
+        e.time = 0;
+        --size_;
+        return;
+    }
+}
+
+std::string ProbationTable::instance_stats() const
+{
+    std::stringstream st;
+
+    st << "Probationary swarms: " << size_ << std::endl;
+    st << "Probation capacity: " << table_.size() << std::endl;
+    st << "Probationary swarms created: " << inserted_ << std::endl;
+    st << "Swarms admitted from probation: " << admitted_ << std::endl;
+    st << "Probationary swarms evicted: " << evicted_ << std::endl;
+    st << "Probationary swarms expired: " << expired_ << std::endl;
+
+    return st.str();
+}
+
+} // namespace server
+} // namespace http
@@ -0,0 +1,198 @@
+/*
+The MIT License
+
+Copyright (c) 2009 BitTorrent Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __SWARM_INDEX_HPP__
+#define __SWARM_INDEX_HPP__
+
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include "libtorrent/peer_id.hpp"
+#include "templates.h"
+
+namespace http {
+namespace server {
+
+class Swarm;
+
+/// The index of all swarms by info-hash. An open addressing table
+/// (linear probing) keyed by the 20 byte info-hash. Info-hashes are
+/// chosen by the clients, so the hash is keyed with a random seed
+/// (SipHash-2-4), to make it impossible to craft colliding ones.
+class SwarmIndex : private boost::noncopyable
+{
+public:
+    typedef libtorrent::sha1_hash key_type;
+
+    struct slot
+    {
+        key_type first;
+        // NULL if the slot is empty
+        Swarm* second;
+    };
+
+    // iterates over the swarms in no particular order. Inserting
+    // or erasing invalidates all iterators
+    template <typename Slot>
+    class iterator_base
+    {
+    public:
+        iterator_base() : i_(NULL), end_(NULL) {}
+        iterator_base(Slot* i, Slot* end) : i_(i), end_(end) { skip(); }
+        template <typename S>
+        iterator_base(iterator_base<S> const& o) : i_(o.i_), end_(o.end_) {}
+
+        Slot& operator*() const { return *i_; }
+        Slot* operator->() const { return i_; }
+        iterator_base& operator++() { ++i_; skip(); return *this; }
+        iterator_base operator++(int) { iterator_base ret(*this); ++*this; return ret; }
+        bool operator==(iterator_base const& o) const { return i_ == o.i_; }
+        bool operator!=(iterator_base const& o) const { return i_ != o.i_; }
+
+    private:
+        template <typename S> friend class iterator_base;
+        void skip() { while (i_ != end_ && i_->second == NULL) ++i_; }
+        Slot* i_;
+        Slot* end_;
+    };
+
+    typedef iterator_base<slot> iterator;
+    typedef iterator_base<slot const> const_iterator;
+
+    SwarmIndex();
+
+    // returns NULL if there's no swarm with this info-hash
+    Swarm* find(key_type const& info_hash) const;
+    Swarm* find(std::string const& info_hash) const;
+
+    // looks up the info-hash and adds an empty slot for it if it's
+    // not there. The caller must set a new slot to a swarm before
+    // the index is used again. Sets inserted if the slot is new
+    Swarm*& find_or_insert(key_type const& info_hash, bool& inserted);
+
+    // returns false if the info-hash is already in the index
+    bool insert(key_type const& info_hash, Swarm* s);
+    // returns false if the info-hash isn't in the index
+    bool erase(key_type const& info_hash);
+    void clear();
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    iterator begin() { return iterator(&table_[0], &table_[0] + table_.size()); }
+    iterator end() { return iterator(&table_[0] + table_.size(), &table_[0] + table_.size()); }
+    const_iterator begin() const { return const_iterator(&table_[0], &table_[0] + table_.size()); }
+    const_iterator end() const { return const_iterator(&table_[0] + table_.size(), &table_[0] + table_.size()); }
+
+    // the number of collisions and the probe lengths
+    std::string instance_stats() const;
+
+private:
+    size_t hash(key_type const& k) const;
+    // returns the slot of k, or the empty slot where it belongs
+    size_t lookup(key_type const& k) const;
+    void grow();
+
+    std::vector<slot> table_;
+    size_t mask_;
+    size_t size_;
+    uint64 seed_[2];
+
+    mutable uint64 lookups_;
+    mutable uint64 probes_;
+    mutable uint64 longest_probe_;
+};
+
+/// The first announce of an info-hash on probation
+struct probationary_announce
+{
+    SwarmIndex::key_type info_hash;
+    libtorrent::peer_id pid;
+    uint64 left;
+    // when it was announced, 0 if the entry is free
+    int32 time;
+    uint8 event;
+    uint8 reserved;
+    // ports are in host order
+    uint16 port;
+    uint16 port6;
+    byte ip[4];
+    byte ip6[16];
+};
+
+/// Info-hashes that only a single peer has announced. Anyone can
+/// announce any info-hash, so a swarm is only created once a second
+/// peer announces it, until then the first announce is kept here.
+/// The table has a fixed number of entries in buckets of four, with
+/// the same keyed hash as the SwarmIndex. When a bucket is full, the
+/// oldest announce in it is dropped.
+class ProbationTable : private boost::noncopyable
+{
+public:
+    typedef SwarmIndex::key_type key_type;
+
+    // announces older than timeout seconds are dropped
+    ProbationTable(int capacity, int timeout);
+
+    // sets the number of entries, rounded up to a power of two, and
+    // drops all of them. 0 turns probation off
+    void set_capacity(int capacity);
+    int capacity() const { return int(table_.size()); }
+    bool enabled() const { return !table_.empty(); }
+
+    // records an announce of an info-hash without a swarm. Returns
+    // true if another peer announced it before, and copies that
+    // announce to first. The info-hash is then removed from the
+    // table, the caller is expected to create its swarm
+    bool announce(probationary_announce const& a,
+        probationary_announce& first);
+    // drops the info-hash if pid is the peer that announced it
+    void stopped(key_type const& info_hash, libtorrent::peer_id const& pid);
+
+    size_t size() const { return size_; }
+
+    std::string instance_stats() const;
+
+private:
+    enum { bucket_size = 4 };
+    size_t bucket(key_type const& k) const;
+    bool expired(probationary_announce const& e, int now) const
+    { return now - e.time > timeout_; }
+
+    std::vector<probationary_announce> table_;
+    size_t mask_;
+    size_t size_;
+    int timeout_;
+    uint64 seed_[2];
+
+    int64 inserted_;
+    int64 admitted_;
+    int64 evicted_;
+    int64 expired_;
+};
+
+} // namespace server
+} // namespace http
+
+#endif //__SWARM_INDEX_HPP__
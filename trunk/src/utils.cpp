@@ -41,6 +41,7 @@ THE SOFTWARE.
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #endif
 
@@ -256,6 +257,48 @@ uint32 parse_ip(cstr ip, bool *valid)
     return r;
 }
 
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+namespace
+{
+    THREAD_LOCAL uint64 rand_state[2];
+
+    void seed_fast_rand()
+    {
+        FILE* f = fopen("/dev/urandom", "rb");
+        if (f)
+        {
+            size_t n = fread(rand_state, sizeof(uint64), 2, f);
+            fclose(f);
+            if (n != 2) rand_state[0] = rand_state[1] = 0;
+        }
+        // the state mustn't be all zeros, and threads started at the
+        // same time get different ones
+        rand_state[0] ^= uint64(time(NULL)) ^ uint64(size_t(rand_state));
+        rand_state[1] |= 1;
+    }
+}
+
+uint32 fast_rand()
+{
+    uint64 s1 = rand_state[0];
+    uint64 const s0 = rand_state[1];
+    if (s0 == 0)
+    {
+        seed_fast_rand();
+        return fast_rand();
+    }
+    rand_state[0] = s0;
+    s1 ^= s1 << 23;
+    rand_state[1] = s1 ^ s0 ^ (s1 >> 17) ^ (s0 >> 26);
+    // the high bits are the better ones
+    return uint32((rand_state[1] + s0) >> 32);
+}
+
 #if !defined(_WIN32)
 
 uid_t get_user_uid(std::string username)
@@ -123,6 +123,21 @@ inline Result safe_lexical_cast(const Source &s, const Result def = 0)
     }
 }
 
+// a xorshift128+ generator with a state per thread, so unlike rand()
+// it doesn't take a lock. It's seeded from /dev/urandom the first time
+// a thread uses it. Not for anything that must be unpredictable
+uint32 fast_rand();
+// returns a number in [0, n)
+inline uint32 fast_rand(uint32 n)
+{
+    return uint32((uint64(fast_rand()) * n) >> 32);
+}
+// returns a number in [0, 1)
+inline double fast_rand_unit()
+{
+    return fast_rand() / 4294967296.0;
+}
+
 #if !defined(_WIN32)
 
 #include <sys/time.h>
@@ -52,13 +52,24 @@ class hash : public stdext::hash_compare<_Kty, _Pr>
 
 namespace __gnu_cxx
 {
+        // FNV-1a over every byte. Keys are often binary, so
+        // hashing can't stop at the first NUL
+        inline size_t hash_bytes(unsigned char const* p, size_t len)
+        {
+                size_t ret = 2166136261U;
+                for (size_t i = 0; i < len; ++i)
+                {
+                        ret ^= p[i];
+                        ret *= 16777619U;
+                }
+                return ret;
+        }
+
         template<> struct hash<libtorrent::sha1_hash>
         {
                 size_t operator()( const libtorrent::sha1_hash& x ) const
                 {
-                        size_t ret = 0;
-                        for (int i = 0; i < 20; ++i) ret += x[i];
-                        return ret;
+                        return hash_bytes(x.begin(), libtorrent::sha1_hash::size);
                 }
         };
 
@@ -66,7 +77,7 @@ namespace __gnu_cxx
         {
                 size_t operator()( const std::string& x ) const
                 {
-                        return hash< const char* >()( x.c_str() );
+                        return hash_bytes((unsigned char const*)x.data(), x.size());
                 }
         };
 }